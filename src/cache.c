@@ -17,210 +17,1717 @@
 #include <stdio.h>
 #include <pthread.h>
 #include <stdlib.h>
+#include <limits.h>
 #include <unistd.h>
 #include <string.h>
 #include <errno.h>
 #include <time.h>
+#include <fcntl.h>
+#include <stddef.h>
+#include <sys/time.h>
 
 #include "nscd.h"
 #include "misc.h"
 #include "lookup.h"
 #include "cache.h"
+#include "epoch.h"
+#include "timer.h"
+#include "slab.h"
+#include "shared.h"
+#include "snapshot.h"
+#include "hash.h"
+#include "negative.h"
 
-/* All access to the cache is synchronized with this mutex. */
-pthread_mutex_t cache_mutex = PTHREAD_MUTEX_INITIALIZER;
+/* Each reply is stored after this header, which keeps its reference count.
+ * The cache holds one reference to the replies of its entries, and threads
+ * writing a reply to a client hold another, so that no cache lock need be
+ * held while writing and the cache can replace or remove the entry. The reply
+ * itself is never modified once it has been generated. Replies either have a
+ * slab object of their own, or live at the end of their entry's object, in
+ * which case offset is how far into that object the header is. */
+struct reply_header {
+	int refs;
+	int32_t reply_len;
+	int32_t offset;
+};
 
-/* This hash is supposed to be good for short textual data. */
-static uint32_t bernstein_hash(uint8_t * key, int32_t key_len, uint32_t level)
+void * reply_alloc(int32_t reply_len)
 {
-	uint32_t hash = level;
-	while(key_len-- > 0)
-		hash = 33 * hash + *(key++);
-	return hash;
+	struct reply_header * header = slab_alloc(sizeof(*header) + reply_len);
+	if(!header)
+		return NULL;
+	header->refs = 1;
+	header->reply_len = reply_len;
+	header->offset = 0;
+	return header + 1;
 }
 
-#define cache_hash(key, key_len, type) bernstein_hash(key, key_len, 0xDEADBEEF + type)
+void reply_ref(void * reply)
+{
+	struct reply_header * header = (struct reply_header *) reply - 1;
+	__sync_add_and_fetch(&header->refs, 1);
+}
 
-/* This hash table stores all cache entries. Note that 10007 is prime. */
-#define HASH_SIZE 10007
-static struct cache_entry * hash_table[HASH_SIZE] = {NULL};
+void reply_release(void * reply)
+{
+	struct reply_header * header = (struct reply_header *) reply - 1;
+	if(!__sync_sub_and_fetch(&header->refs, 1))
+		slab_free((char *) header - header->offset, header->offset + sizeof(*header) + header->reply_len);
+}
 
-/* MUST BE CALLED WITH THE LOCK HELD */
-int cache_search(request_header * req, void * key, uid_t uid, struct cache_entry ** entry)
+int32_t reply_length(void * reply)
 {
-	uint32_t hash = cache_hash(key, req->key_len, req->type);
-	struct cache_entry * scan = hash_table[hash % HASH_SIZE];
-	for(scan = hash_table[hash % HASH_SIZE]; scan; scan = scan->chain)
-		if(scan->key_hash == hash && scan->key_len == req->key_len
-		   && scan->type == req->type && !memcmp(scan->key, key, req->key_len))
-			break;
-	if(!scan)
+	return ((struct reply_header *) reply - 1)->reply_len;
+}
+
+static uint64_t hash_seed;
+
+#define cache_hash(key, key_len, type) word_hash(key, key_len, hash_seed + (type))
+
+static void hash_init(void)
+{
+	hash_seed = hash_random_seed();
+}
+
+/* The hash table is split into shards, each with its own lock, so that threads
+ * changing different parts of the cache don't contend with each other. Cache
+ * hits don't lock anything: they probe the tables inside an epoch (see
+ * epoch.h), and writers publish entries and replies with release semantics and
+ * retire anything they remove or replace. The low bits of the hash pick the
+ * shard, and the rest pick the slot within its table. */
+#define CACHE_SHARDS 64
+
+/* Each shard is an open addressing table with linear probing. Next to the
+ * array of entry pointers is an array of control bytes, one per slot, which
+ * holds 7 bits of the entry's hash (its fingerprint), so most slots can be
+ * skipped without touching the entry at all. A probe sequence ends at an empty
+ * slot, so removed entries leave a tombstone behind. */
+#define CONTROL_EMPTY 0x80
+#define CONTROL_DELETED 0xFE
+
+struct cache_table {
+	uint32_t size; /* always a power of two */
+	uint32_t used, deleted;
+	uint8_t * control;
+	struct cache_entry ** slots;
+};
+
+/* Tables start small and double in size when they are 3/4 full. Rather than
+ * rehash everything at once, a shard keeps its previous table around while
+ * its entries are copied over a few at a time, each time the shard is changed.
+ * New entries only go in the new table, but removed ones are removed from both,
+ * and lookups check both tables until the copy is complete. */
+#define TABLE_MIN_SIZE 16
+#define MIGRATE_STEP 16
+
+struct cache_shard {
+	pthread_mutex_t mutex;
+	struct cache_table * table;
+	struct cache_table * old;
+	uint32_t migrated;
+	struct cache_flight * flights;
+	/* the CLOCK hand for eviction, a slot in table */
+	uint32_t clock_hand;
+	/* statistics, protected by the mutex (except lock_waits) */
+	int entries;
+	unsigned long lock_waits;
+	unsigned long grows;
+	unsigned long lookups, coalesced, wait_timeouts;
+} __attribute__((aligned(64)));
+
+static struct cache_shard shards[CACHE_SHARDS];
+
+#define shard_index(hash) ((hash) % CACHE_SHARDS)
+#define slot_index(hash) ((hash) / CACHE_SHARDS)
+#define fingerprint(hash) ((uint8_t) ((hash) >> 25))
+
+static void shard_lock(struct cache_shard * shard)
+{
+	if(pthread_mutex_trylock(&shard->mutex))
+	{
+		/* only counted to show whether the locks are contended */
+		shard->lock_waits++;
+		pthread_mutex_lock(&shard->mutex);
+	}
+}
+
+static struct cache_table * table_alloc(uint32_t size)
+{
+	/* the table, its control bytes, and its slots are all one allocation */
+	struct cache_table * table = malloc(sizeof(*table) + size * (sizeof(*table->slots) + 1));
+	if(!table)
+		return NULL;
+	table->size = size;
+	table->used = 0;
+	table->deleted = 0;
+	table->slots = (struct cache_entry **) (table + 1);
+	table->control = (uint8_t *) (table->slots + size);
+	memset(table->control, CONTROL_EMPTY, size);
+	memset(table->slots, 0, size * sizeof(*table->slots));
+	return table;
+}
+
+/* Find the next entry matching the request in the probe sequence, starting at
+ * *index, and update *index to continue after it. This can be called either
+ * with the shard lock held or from inside an epoch. */
+static struct cache_entry * table_probe(struct cache_table * table, request_header * req, void * key, uint32_t hash, uint32_t * index)
+{
+	uint32_t mask = table->size - 1;
+	uint8_t wanted = fingerprint(hash);
+	for(;;)
+	{
+		uint32_t i = *index & mask;
+		uint8_t control = __atomic_load_n(&table->control[i], __ATOMIC_ACQUIRE);
+		*index = i + 1;
+		if(control == CONTROL_EMPTY)
+			return NULL;
+		if(control == wanted)
+		{
+			struct cache_entry * scan = __atomic_load_n(&table->slots[i], __ATOMIC_ACQUIRE);
+			/* the slot may have been emptied since we read its control byte */
+			if(scan && scan->key_hash == hash && scan->key_len == req->key_len
+			   && scan->type == req->type && !memcmp(scan->key, key, req->key_len))
+				return scan;
+		}
+	}
+}
+
+/* Invalidating a database just starts a new generation of it. Entries remember
+ * the generation they were looked up in, and those from an earlier one are
+ * never served again. They are removed when a lookup or their timer comes
+ * across them, or by eviction, rather than all at once. */
+static unsigned int db_generation[DB_COUNT];
+static unsigned long db_invalidations[DB_COUNT];
+static unsigned long db_removals[DB_COUNT];
+
+static unsigned int type_generation(request_type type)
+{
+	int db = request_database(type);
+	return db < 0 ? 0 : __atomic_load_n(&db_generation[db], __ATOMIC_ACQUIRE);
+}
+
+#define entry_current(entry) ((entry)->generation == type_generation((entry)->type))
+
+/* Return whether an entry can still be served, possibly stale: expired entries
+ * are served during their database's grace period, and after that for as long
+ * as max-stale allows while a refresh is pending or failing. */
+static int entry_usable(struct cache_entry * entry, time_t now)
+{
+	time_t expire_time = __atomic_load_n(&entry->expire_time, __ATOMIC_RELAXED);
+	int db;
+	if(!entry_current(entry))
+		return 0;
+	if(now <= expire_time)
+		return 1;
+	db = request_database(entry->type);
+	if(db < 0)
+		return 0;
+	if(now <= expire_time + grace_period[db])
+		return 1;
+	return __atomic_load_n(&entry->refresh_pending, __ATOMIC_RELAXED) && now <= expire_time + max_stale[db];
+}
+
+/* Look for a usable entry for the request in one table. Expired entries
+ * are skipped, since a newer entry for the same request may follow them in the
+ * probe sequence. If mark is set (and the shard lock is held), the expired ones
+ * are marked for removal. */
+static struct cache_entry * table_search(struct cache_table * table, request_header * req, void * key, uint32_t hash, int mark)
+{
+	uint32_t index = slot_index(hash);
+	time_t now = time(NULL);
+	struct cache_entry * scan;
+	while((scan = table_probe(table, req, key, hash, &index)))
+	{
+		if(entry_usable(scan, now))
+			return scan;
+		/* don't return expired data, just leave it for cleanup */
+		if(mark)
+		{
+			if(debug)
+				printf("Expired cache entry for [%s], refreshes %d\n", (char *) scan->key, scan->refreshes);
+			scan->refreshes = 5;
+			/* get it cleaned up right away */
+			timer_schedule(&scan->timer, now);
+		}
+	}
+	return NULL;
+}
+
+/* Look for an entry in both tables of a shard. The old table keeps everything
+ * it had until the copy is complete, so a reader that still sees it as the
+ * current table won't miss anything that was there. */
+static struct cache_entry * shard_find(struct cache_shard * shard, request_header * req, void * key, uint32_t hash, int mark)
+{
+	struct cache_table * table = __atomic_load_n(&shard->table, __ATOMIC_ACQUIRE);
+	struct cache_table * old = __atomic_load_n(&shard->old, __ATOMIC_ACQUIRE);
+	struct cache_entry * scan = NULL;
+	if(table)
+		scan = table_search(table, req, key, hash, mark);
+	if(!scan && old && old != table)
+		scan = table_search(old, req, key, hash, mark);
+	return scan;
+}
+
+/* MUST BE CALLED WITH THE SHARD LOCK HELD */
+static struct cache_entry * shard_search(struct cache_shard * shard, request_header * req, void * key, uint32_t hash)
+{
+	return shard_find(shard, req, key, hash, 1);
+}
+
+/* MUST BE CALLED WITH THE SHARD LOCK HELD */
+static void table_insert(struct cache_table * table, struct cache_entry * entry)
+{
+	uint32_t mask = table->size - 1;
+	uint32_t i = slot_index(entry->key_hash) & mask;
+	while(table->control[i] != CONTROL_EMPTY && table->control[i] != CONTROL_DELETED)
+		i = (i + 1) & mask;
+	if(table->control[i] == CONTROL_DELETED)
+		table->deleted--;
+	table->used++;
+	__atomic_store_n(&table->slots[i], entry, __ATOMIC_RELEASE);
+	/* readers may see the entry as soon as this is stored */
+	__atomic_store_n(&table->control[i], fingerprint(entry->key_hash), __ATOMIC_RELEASE);
+}
+
+/* MUST BE CALLED WITH THE SHARD LOCK HELD */
+static int table_remove(struct cache_table * table, struct cache_entry * entry)
+{
+	uint32_t mask = table->size - 1;
+	uint32_t i = slot_index(entry->key_hash) & mask;
+	while(table->control[i] != CONTROL_EMPTY)
+	{
+		if(table->slots[i] == entry)
+		{
+			__atomic_store_n(&table->control[i], CONTROL_DELETED, __ATOMIC_RELEASE);
+			__atomic_store_n(&table->slots[i], NULL, __ATOMIC_RELEASE);
+			table->used--;
+			table->deleted++;
+			return 0;
+		}
+		i = (i + 1) & mask;
+	}
+	return -1;
+}
+
+static void table_free(void * table)
+{
+	free(table);
+}
+
+/* Copy up to count slots' worth of entries from the old table to the new one.
+ * MUST BE CALLED WITH THE SHARD LOCK HELD */
+static void shard_migrate(struct cache_shard * shard, uint32_t count)
+{
+	struct cache_table * old = shard->old;
+	if(!old)
+		return;
+	while(count-- && shard->migrated < old->size)
+	{
+		struct cache_entry * entry = old->slots[shard->migrated++];
+		if(entry)
+			table_insert(shard->table, entry);
+	}
+	if(shard->migrated == old->size)
+	{
+		__atomic_store_n(&shard->old, NULL, __ATOMIC_RELEASE);
+		epoch_retire(table_free, old);
+	}
+}
+
+/* Make room in the shard for one more entry, growing its table if necessary.
+ * MUST BE CALLED WITH THE SHARD LOCK HELD */
+static int shard_reserve(struct cache_shard * shard)
+{
+	struct cache_table * table = shard->table;
+	struct cache_table * grown;
+	uint32_t size;
+	
+	if(shard->old)
+	{
+		/* A new table starts at most 3/8 full, so copy enough of the old
+		 * one each time that it is done long before the new one needs to
+		 * grow too: at most size/4 more entries can be added meanwhile. */
+		uint32_t step = shard->old->size / table->size * 4;
+		shard_migrate(shard, step < MIGRATE_STEP ? MIGRATE_STEP : step);
+	}
+	if(table && (table->used + table->deleted + 1) * 4 <= table->size * 3)
+		return 0;
+	
+	/* that should make this impossible, but just in case */
+	if(shard->old)
+		shard_migrate(shard, shard->old->size);
+	
+	/* pick a size that will be at most 3/8 full once everything is copied,
+	 * which may be the same size if the table is mostly tombstones */
+	size = TABLE_MIN_SIZE;
+	while(table && size * 3 < (table->used + 1) * 8)
+		size *= 2;
+	grown = table_alloc(size);
+	if(!grown)
 		return -1;
-	/* don't return expired data, just leave it for cleanup */
-	if(time(NULL) > scan->expire_time)
+	if(debug)
+		printf("Growing cache shard %d to %u slots\n", (int) (shard - shards), size);
+	
+	shard->migrated = 0;
+	/* readers that see the new table must also see the old one */
+	__atomic_store_n(&shard->old, table, __ATOMIC_RELEASE);
+	__atomic_store_n(&shard->table, grown, __ATOMIC_RELEASE);
+	shard->grows++;
+	return 0;
+}
+
+/* Expired entries get queued here to be refreshed in the background by a pool
+ * of refresh threads, both when their timers go off and when clients are
+ * served stale replies. Each database has a limit on how many refreshes may
+ * be talking to its name service at once; queued entries for a database at its
+ * limit are passed over for ones that aren't. The queue, the refresh_queued
+ * fields of the entries, and the in-flight counts are protected by
+ * refresh_mutex. While an entry is queued or being refreshed, the refresh
+ * threads own it: nothing else removes it from the cache. */
+#define REFRESH_IDLE 0
+#define REFRESH_QUEUED 1
+#define REFRESH_RUNNING 2
+/* the entry has been removed, so it must not be queued again */
+#define REFRESH_DEAD -1
+
+static struct cache_entry * refresh_head = NULL;
+static struct cache_entry * refresh_tail = NULL;
+static pthread_mutex_t refresh_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t refresh_cond = PTHREAD_COND_INITIALIZER;
+static int refresh_count = 0;
+static int refresh_in_flight[DB_COUNT];
+
+/* how long to wait before trying a failed refresh again */
+#define REFRESH_RETRY 30
+
+#define entry_of_timer(timer) ((struct cache_entry *) ((char *) (timer) - offsetof(struct cache_entry, timer)))
+
+/* statistics, protected by refresh_mutex (except stale_hits) */
+static unsigned long stale_hits = 0;
+static unsigned long refreshes_queued = 0;
+static unsigned long refreshes_done = 0;
+static unsigned long refresh_failures = 0;
+static int max_refresh_count = 0;
+static uint64_t refresh_lag_usec = 0;
+static uint64_t max_refresh_lag_usec = 0;
+
+/* MUST BE CALLED INSIDE AN EPOCH OR WITH THE SHARD LOCK HELD */
+static void refresh_enqueue(struct cache_entry * entry)
+{
+	pthread_mutex_lock(&refresh_mutex);
+	if(entry->refresh_queued == REFRESH_IDLE)
 	{
-		/* the newly added one will occur before this one in
-		 * the hash chain, so this won't be touched again */
 		if(debug)
-			printf("Expired cache entry for [%s], refreshes %d\n", (char *) scan->key, scan->refreshes);
-		scan->refreshes = 5;
-		return -1;
+			printf("Queueing refresh of cache entry for [%s]\n", (char *) entry->key);
+		entry->refresh_queued = REFRESH_QUEUED;
+		gettimeofday(&entry->refresh_time, NULL);
+		entry->refresh_next = NULL;
+		if(refresh_tail)
+			refresh_tail->refresh_next = entry;
+		else
+			refresh_head = entry;
+		refresh_tail = entry;
+		if(++refresh_count > max_refresh_count)
+			max_refresh_count = refresh_count;
+		refreshes_queued++;
+		/* keep serving it past the grace period until it is refreshed */
+		__atomic_store_n(&entry->refresh_pending, 1, __ATOMIC_RELAXED);
+		pthread_cond_signal(&refresh_cond);
 	}
-	*entry = scan;
+	pthread_mutex_unlock(&refresh_mutex);
+}
+
+/* MUST BE CALLED WITH refresh_mutex HELD */
+static void refresh_unlink(struct cache_entry * entry)
+{
+	struct cache_entry ** point = &refresh_head;
+	struct cache_entry * previous = NULL;
+	while(*point && *point != entry)
+	{
+		previous = *point;
+		point = &previous->refresh_next;
+	}
+	if(!*point)
+		return;
+	*point = entry->refresh_next;
+	if(refresh_tail == entry)
+		refresh_tail = previous;
+	refresh_count--;
+}
+
+/* Take the first queued entry whose database is not at its refresh limit off
+ * the queue, or return NULL if there are none.
+ * MUST BE CALLED WITH refresh_mutex HELD */
+static struct cache_entry * refresh_dequeue(void)
+{
+	struct cache_entry * entry;
+	struct timeval now;
+	uint64_t lag;
+	
+	for(entry = refresh_head; entry; entry = entry->refresh_next)
+	{
+		int db = request_database(entry->type);
+		if(db < 0 || refresh_in_flight[db] < max_refreshes[db])
+			break;
+	}
+	if(!entry)
+		return NULL;
+	refresh_unlink(entry);
+	entry->refresh_queued = REFRESH_RUNNING;
+	
+	gettimeofday(&now, NULL);
+	lag = (now.tv_sec - entry->refresh_time.tv_sec) * 1000000LL + now.tv_usec - entry->refresh_time.tv_usec;
+	refresh_lag_usec += lag;
+	if(lag > max_refresh_lag_usec)
+		max_refresh_lag_usec = lag;
+	return entry;
+}
+
+/* Make sure an entry won't be queued to be refreshed, so that it can be
+ * removed. Returns -1 if it has already been queued.
+ * MUST BE CALLED WITH THE SHARD LOCK HELD */
+static int refresh_claim(struct cache_entry * entry)
+{
+	int r = -1;
+	pthread_mutex_lock(&refresh_mutex);
+	if(entry->refresh_queued == REFRESH_IDLE)
+	{
+		entry->refresh_queued = REFRESH_DEAD;
+		r = 0;
+	}
+	pthread_mutex_unlock(&refresh_mutex);
+	return r;
+}
+
+int cache_search(request_header * req, void * key, uid_t uid, void ** reply, int32_t * reply_len, int * close_socket)
+{
+	uint32_t hash = cache_hash(key, req->key_len, req->type);
+	struct cache_shard * shard = &shards[shard_index(hash)];
+	struct cache_entry * entry;
+	
+	epoch_enter();
+	/* Don't return data that is too old. We can't mark it here since we
+	 * don't have the lock, but cache_add() will when the new reply is added. */
+	entry = shard_find(shard, req, key, hash, 0);
+	if(!entry)
+	{
+		epoch_exit();
+		*close_socket = 0;
+		return negative_search(req, key, reply, reply_len);
+	}
+	/* serve stale data now, but get it refreshed */
+	if(time(NULL) > __atomic_load_n(&entry->expire_time, __ATOMIC_RELAXED))
+	{
+		__sync_add_and_fetch(&stale_hits, 1);
+		if(__atomic_load_n(&entry->refresh_queued, __ATOMIC_RELAXED) == REFRESH_IDLE)
+			refresh_enqueue(entry);
+	}
+	/* Note that it has been used since it was last refreshed. Only write
+	 * it if it isn't already set, so that hot entries stay shared in the
+	 * CPU caches of all the threads reading them. */
+	if(__atomic_load_n(&entry->accessed, __ATOMIC_RELAXED) != (ENTRY_USED | ENTRY_REFERENCED))
+		__atomic_or_fetch(&entry->accessed, ENTRY_USED | ENTRY_REFERENCED, __ATOMIC_RELAXED);
+	/* The cache's reference to this reply is only released after we exit
+	 * the epoch, so it is safe to take our own reference to it here. */
+	*reply = __atomic_load_n(&entry->reply, __ATOMIC_ACQUIRE);
+	*reply_len = reply_length(*reply);
+	*close_socket = entry->close_socket;
+	reply_ref(*reply);
+	epoch_exit();
 	return 0;
 }
 
-/* MUST BE CALLED WITH THE LOCK HELD */
-int cache_add(request_header * req, void * key, uid_t uid, void * reply, int32_t reply_len, int close_socket, time_t refresh_interval)
+static void reply_retire(void * reply)
+{
+	reply_release(reply);
+}
+
+/* The bytes used by the entries for each database, counting the entry, its
+ * key, and its reply, and the number of entries evicted to keep that within
+ * max_db_size. Entries don't know how big their table slots are, so those
+ * aren't counted. */
+static size_t db_bytes[DB_COUNT];
+static unsigned long db_evictions[DB_COUNT];
+
+/* An entry, its key, and the reply it was added with share one slab object:
+ * the key follows the entry, and this "home" reply follows the key. The home
+ * reply can't be freed on its own, so the entry holds a reference to it for as
+ * long as it exists, besides the reference it holds to its current reply. If a
+ * refresh gets a different reply, that one gets an object of its own and the
+ * home reply just takes up space until the entry goes away. */
+#define entry_home_offset(key_len) ((sizeof(struct cache_entry) + (key_len) + 7) & ~(size_t) 7)
+#define entry_home(entry) ((void *) ((char *) (entry) + entry_home_offset((entry)->key_len) + sizeof(struct reply_header)))
+
+/* Siblings can share a reply, which is only counted for the entry that owns
+ * it: the one whose object it lives in, or which got it from a lookup, rather
+ * than from its sibling. */
+static size_t entry_size(struct cache_entry * entry, void * reply)
+{
+	void * home = entry_home(entry);
+	size_t size = slab_size(entry_home_offset(entry->key_len) + sizeof(struct reply_header) + reply_length(home));
+	if(reply != home && !((struct reply_header *) reply - 1)->offset && !entry->sibling_reply)
+		size += slab_size(sizeof(struct reply_header) + reply_length(reply));
+	return size;
+}
+
+static int reply_equal(void * a, void * b)
+{
+	return reply_length(a) == reply_length(b) && !memcmp(a, b, reply_length(a));
+}
+
+/* The sibling flag says whether the reply comes from the entry's sibling.
+ * MUST BE CALLED WITH THE SHARD LOCK HELD */
+static void entry_set_reply(struct cache_entry * entry, void * reply, int sibling)
+{
+	void * old = entry->reply;
+	void * home = entry_home(entry);
+	size_t size;
+	/* most refreshes get the same reply back, so keep the one we have */
+	if(reply_equal(reply, old))
+	{
+		reply_release(reply);
+		return;
+	}
+	if(reply_equal(reply, home))
+	{
+		reply_release(reply);
+		reply_ref(home);
+		reply = home;
+	}
+	entry->sibling_reply = sibling;
+	size = entry_size(entry, reply);
+	__atomic_add_fetch(&db_bytes[request_database(entry->type)], size - entry->size, __ATOMIC_RELAXED);
+	entry->size = size;
+	__atomic_store_n(&entry->reply, reply, __ATOMIC_RELEASE);
+	shared_add(entry);
+	/* readers may still be taking references to the old reply */
+	epoch_retire(reply_retire, old);
+}
+
+static void cache_entry_free(void * arg)
+{
+	struct cache_entry * entry = arg;
+	reply_release(entry->reply);
+	/* this frees the entry itself once nobody is using its home reply */
+	reply_release(entry_home(entry));
+}
+
+/* MUST BE CALLED WITH THE SHARD LOCK HELD */
+static int cache_entry_destroy(struct cache_shard * shard, struct cache_entry * entry)
+{
+	if(debug)
+		printf("Removing cache entry for [%s], refreshes %d\n", (char *) entry->key, entry->refreshes);
+	/* it is only freed once readers that may have found it have moved on */
+	table_remove(shard->table, entry);
+	if(shard->old)
+		table_remove(shard->old, entry);
+	shard->entries--;
+	__atomic_sub_fetch(&db_bytes[request_database(entry->type)], entry->size, __ATOMIC_RELAXED);
+	timer_cancel(&entry->timer);
+	shared_remove(entry);
+	
+	pthread_mutex_lock(&refresh_mutex);
+	if(entry->refresh_queued == REFRESH_QUEUED)
+		refresh_unlink(entry);
+	entry->refresh_queued = REFRESH_DEAD;
+	pthread_mutex_unlock(&refresh_mutex);
+	
+	epoch_retire(cache_entry_free, entry);
+	return 0;
+}
+
+/* Evict entries for a database from a shard until the database is back within
+ * its budget, using the CLOCK algorithm: a hand goes around the shard's table,
+ * clearing the referenced bits of the entries it passes, and evicts the first
+ * entry it finds that hasn't been referenced since it last came by. Only the
+ * shard an entry was just added to is looked at, so a database can go over
+ * budget for a while if it has few entries here, but since keys are spread
+ * evenly over the shards that doesn't last.
+ * MUST BE CALLED WITH THE SHARD LOCK HELD */
+static void shard_evict(struct cache_shard * shard, int db, struct cache_entry * keep)
 {
-	struct cache_entry * entry = malloc(sizeof(*entry));
-	uint32_t index;
+	struct cache_table * table = shard->table;
+	/* twice around clears every referenced bit */
+	uint32_t steps = table->size * 2;
+	while(__atomic_load_n(&db_bytes[db], __ATOMIC_RELAXED) > (size_t) max_db_size[db] && steps--)
+	{
+		struct cache_entry * entry;
+		shard->clock_hand = (shard->clock_hand + 1) & (table->size - 1);
+		entry = table->slots[shard->clock_hand];
+		if(!entry || entry == keep || request_database(entry->type) != db)
+			continue;
+		/* entries from before an invalidation go first */
+		if((__atomic_load_n(&entry->accessed, __ATOMIC_RELAXED) & ENTRY_REFERENCED) && entry_current(entry))
+		{
+			__atomic_and_fetch(&entry->accessed, ~ENTRY_REFERENCED, __ATOMIC_RELAXED);
+			continue;
+		}
+		/* entries being refreshed belong to the refresh threads */
+		if(refresh_claim(entry) < 0)
+			continue;
+		if(debug)
+			printf("Evicting cache entry for [%s]\n", (char *) entry->key);
+		cache_entry_destroy(shard, entry);
+		__atomic_add_fetch(&db_evictions[db], 1, __ATOMIC_RELAXED);
+	}
+}
+
+/* MUST BE CALLED WITH THE SHARD LOCK HELD */
+static struct cache_entry * shard_add(struct cache_shard * shard, request_header * req, void * key, uint32_t hash, void * reply, int close_socket, time_t refresh_interval, int copy)
+{
+	struct cache_entry * entry;
+	struct reply_header * home;
+	size_t offset = entry_home_offset(req->key_len);
+	int db;
+	if(shard_reserve(shard) < 0)
+		return NULL;
+	entry = slab_alloc(offset + sizeof(*home) + (copy ? reply_length(reply) : 0));
 	if(!entry)
-		return -1;
+		return NULL;
 	/* query information */
 	entry->type = req->type;
-	entry->key = malloc(req->key_len);
-	if(!entry->key)
-	{
-		free(entry);
-		return -1;
-	}
+	entry->key = entry + 1;
 	memcpy(entry->key, key, req->key_len);
 	entry->key_len = req->key_len;
-	entry->key_hash = cache_hash(key, req->key_len, req->type);
+	entry->key_hash = hash;
 	
-	/* cached information */
-	entry->reply = reply;
-	entry->reply_len = reply_len;
+	/* cached information: the entry gets a copy of the reply, referenced
+	 * both as its home reply and as its current reply, unless it is to
+	 * share the reply with its sibling, in which case its home is empty */
+	home = (struct reply_header *) ((char *) entry + offset);
+	home->offset = offset;
+	if(copy)
+	{
+		home->refs = 2;
+		home->reply_len = reply_length(reply);
+		memcpy(home + 1, reply, home->reply_len);
+		reply_release(reply);
+		entry->reply = home + 1;
+	}
+	else
+	{
+		home->refs = 1;
+		home->reply_len = 0;
+		entry->reply = reply;
+	}
+	entry->sibling_reply = !copy;
 	entry->close_socket = close_socket;
 	
 	/* refresh information */
 	entry->expire_time = time(NULL) + refresh_interval;
 	entry->refresh_interval = refresh_interval;
 	entry->refreshes = 0;
+	/* give it a chance before it can be evicted */
+	entry->accessed = ENTRY_REFERENCED;
+	entry->refresh_pending = 0;
+	entry->refresh_queued = REFRESH_IDLE;
+	entry->timer.point = NULL;
+	timer_schedule(&entry->timer, entry->expire_time);
 	
-	/* chaining information */
-	index = entry->key_hash % HASH_SIZE;
-	entry->point = &hash_table[index];
-	entry->chain = hash_table[index];
-	if(entry->chain)
-		entry->chain->point = &entry->chain;
-	hash_table[index] = entry;
+	entry->generation = type_generation(entry->type);
+	table_insert(shard->table, entry);
+	shard->entries++;
+	entry->shared = ENDREF;
+	shared_add(entry);
 	
 	if(debug)
-		printf("Adding cache entry for [%s] hash 0x%08x at index %d\n", (char *) key, entry->key_hash, index);
-	return 0;
+		printf("Adding cache entry for [%s] hash 0x%08x at shard %d\n", (char *) key, hash, shard_index(hash));
+	
+	/* account for it, and make room for it if needed */
+	db = request_database(entry->type);
+	entry->size = entry_size(entry, entry->reply);
+	if(__atomic_add_fetch(&db_bytes[db], entry->size, __ATOMIC_RELAXED) > (size_t) max_db_size[db])
+		shard_evict(shard, db, entry);
+	return entry;
+}
+
+/* An entry for GETPWBYNAME and one for GETPWBYUID (or GETGRBYNAME and
+ * GETGRBYGID) can answer each other's requests. When either of them gets a
+ * reply, its sibling gets the same reply, and is added if it isn't there, so a
+ * lookup by name saves the lookup by id and the other way around. Refreshing
+ * one of them refreshes both, so they stay the same. The sibling's shard is
+ * only locked after the entry's is released, so this is what it needs to know
+ * about the entry. */
+#define SIBLING_KEY_MAX 256
+
+struct sibling_update {
+	request_header req;
+	char key[SIBLING_KEY_MAX];
+	void * reply;
+	int close_socket;
+	time_t expire_time;
+	time_t refresh_interval;
+	unsigned int generation;
+};
+
+static unsigned long sibling_updates = 0;
+
+/* MUST BE CALLED WITH THE SHARD LOCK HELD */
+static void sibling_prepare(struct sibling_update * update, struct cache_entry * entry)
+{
+	if(reply_sibling(entry->type, entry->reply, reply_length(entry->reply), &update->req, update->key, sizeof(update->key)) < 0)
+		return;
+	update->reply = entry->reply;
+	reply_ref(update->reply);
+	update->close_socket = entry->close_socket;
+	update->expire_time = entry->expire_time;
+	update->refresh_interval = entry->refresh_interval;
+	update->generation = entry->generation;
+}
+
+/* Several users can have the same uid (and groups the same gid), so the reply
+ * for one of their names must not replace an entry by id that has another's.
+ * MUST BE CALLED WITH THE SHARD LOCK HELD */
+static int sibling_matches(struct cache_entry * entry, void * reply)
+{
+	request_header old_req, new_req;
+	char old_key[SIBLING_KEY_MAX], new_key[SIBLING_KEY_MAX];
+	if(entry->type != GETPWBYUID && entry->type != GETGRBYGID)
+		return 1;
+	if(reply_sibling(entry->type, entry->reply, reply_length(entry->reply), &old_req, old_key, sizeof(old_key)) < 0)
+		return 1;
+	if(reply_sibling(entry->type, reply, reply_length(reply), &new_req, new_key, sizeof(new_key)) < 0)
+		return 0;
+	return old_req.key_len == new_req.key_len && !memcmp(old_key, new_key, old_req.key_len);
+}
+
+/* Give the sibling of an entry the entry's reply, as if it had been refreshed
+ * along with it, or add it. Nothing is done if sibling_prepare() found none. */
+static void sibling_update(struct sibling_update * update)
+{
+	uint32_t hash;
+	struct cache_shard * shard;
+	struct cache_entry * entry;
+	
+	if(!update->reply)
+		return;
+	/* the database may have been invalidated since */
+	if(update->generation != type_generation(update->req.type))
+	{
+		reply_release(update->reply);
+		return;
+	}
+	hash = cache_hash((void *) update->key, update->req.key_len, update->req.type);
+	shard = &shards[shard_index(hash)];
+	shard_lock(shard);
+	entry = shard_search(shard, &update->req, update->key, hash);
+	if(!entry)
+	{
+		entry = shard_add(shard, &update->req, update->key, hash, update->reply, update->close_socket, update->refresh_interval, 0);
+		if(!entry)
+			reply_release(update->reply);
+		else
+		{
+			__atomic_store_n(&entry->expire_time, update->expire_time, __ATOMIC_RELAXED);
+			timer_schedule(&entry->timer, update->expire_time);
+		}
+	}
+	else if(!sibling_matches(entry, update->reply))
+	{
+		reply_release(update->reply);
+		entry = NULL;
+	}
+	else
+	{
+		if(debug)
+			printf("Updating sibling cache entry for [%s]\n", update->key);
+		entry_set_reply(entry, update->reply, 1);
+		entry->close_socket = update->close_socket;
+		__atomic_store_n(&entry->expire_time, update->expire_time, __ATOMIC_RELAXED);
+		entry->refresh_interval = update->refresh_interval;
+		entry->refreshes++;
+		__atomic_store_n(&entry->refresh_pending, 0, __ATOMIC_RELAXED);
+		/* it doesn't need a refresh of its own any more */
+		pthread_mutex_lock(&refresh_mutex);
+		if(entry->refresh_queued == REFRESH_QUEUED)
+		{
+			refresh_unlink(entry);
+			entry->refresh_queued = REFRESH_IDLE;
+		}
+		pthread_mutex_unlock(&refresh_mutex);
+		timer_schedule(&entry->timer, update->expire_time);
+	}
+	pthread_mutex_unlock(&shard->mutex);
+	if(entry)
+		__sync_add_and_fetch(&sibling_updates, 1);
+}
+
+/* Return whether an entry by id has a sibling by name which is being refreshed,
+ * and so will be refreshed with it. Only entries by id wait for their siblings,
+ * so that two siblings never wait for each other. This is only called by the
+ * refresh threads, for entries they own. */
+static int sibling_refreshing(struct cache_entry * entry)
+{
+	struct cache_shard * shard = &shards[shard_index(entry->key_hash)];
+	request_header req;
+	char key[SIBLING_KEY_MAX];
+	struct cache_entry * sibling;
+	uint32_t hash;
+	int r;
+	
+	if(entry->type != GETPWBYUID && entry->type != GETGRBYGID)
+		return 0;
+	shard_lock(shard);
+	r = reply_sibling(entry->type, entry->reply, reply_length(entry->reply), &req, key, sizeof(key));
+	pthread_mutex_unlock(&shard->mutex);
+	if(r < 0)
+		return 0;
+	
+	hash = cache_hash((void *) key, req.key_len, req.type);
+	shard = &shards[shard_index(hash)];
+	shard_lock(shard);
+	sibling = shard_find(shard, &req, key, hash, 0);
+	if(sibling)
+	{
+		pthread_mutex_lock(&refresh_mutex);
+		r = sibling->refresh_queued == REFRESH_QUEUED || sibling->refresh_queued == REFRESH_RUNNING;
+		pthread_mutex_unlock(&refresh_mutex);
+	}
+	pthread_mutex_unlock(&shard->mutex);
+	return sibling && r;
 }
 
-static int cache_entry_destroy(struct cache_entry * entry)
+int cache_add(request_header * req, void * key, uid_t uid, void * reply, int32_t reply_len, int close_socket, time_t refresh_interval)
+{
+	uint32_t hash = cache_hash(key, req->key_len, req->type);
+	struct cache_shard * shard = &shards[shard_index(hash)];
+	struct sibling_update update = {reply: NULL};
+	struct cache_entry * entry;
+	int r = -1;
+	
+	if(!negative_add(req, key, reply))
+	{
+		reply_release(reply);
+		return 0;
+	}
+	shard_lock(shard);
+	/* don't add duplicate entries */
+	if(!shard_search(shard, req, key, hash))
+	{
+		entry = shard_add(shard, req, key, hash, reply, close_socket, refresh_interval, 1);
+		if(entry)
+		{
+			sibling_prepare(&update, entry);
+			r = 0;
+		}
+	}
+	pthread_mutex_unlock(&shard->mutex);
+	sibling_update(&update);
+	return r;
+}
+
+void cache_invalidate(int db)
 {
 	if(debug)
-		printf("Removing cache entry for [%s], refreshes %d\n", (char *) entry->key, entry->refreshes);
-	*entry->point = entry->chain;
-	if(entry->chain)
-		entry->chain->point = entry->point;
-	free(entry->key);
-	free(entry->reply);
-	free(entry);
+		printf("Invalidating the %s cache\n", db_names[db]);
+	__atomic_add_fetch(&db_generation[db], 1, __ATOMIC_ACQ_REL);
+	__sync_add_and_fetch(&db_invalidations[db], 1);
+	/* clients searching the shared database don't know about generations */
+	shared_invalidate(db);
+	negative_invalidate(db);
+	ent_invalidate(db);
+}
+
+/* Remove an entry, or if a refresh thread owns it, make sure it isn't served
+ * again and have the refresh thread remove it when it is done.
+ * MUST BE CALLED WITH THE SHARD LOCK HELD */
+static void entry_remove(struct cache_shard * shard, struct cache_entry * entry)
+{
+	int claimed = 0;
+	pthread_mutex_lock(&refresh_mutex);
+	if(entry->refresh_queued == REFRESH_QUEUED)
+	{
+		refresh_unlink(entry);
+		entry->refresh_queued = REFRESH_IDLE;
+	}
+	if(entry->refresh_queued == REFRESH_IDLE)
+	{
+		entry->refresh_queued = REFRESH_DEAD;
+		claimed = 1;
+	}
+	pthread_mutex_unlock(&refresh_mutex);
+	if(claimed)
+		cache_entry_destroy(shard, entry);
+	else
+	{
+		entry->refreshes = 5;
+		__atomic_store_n(&entry->refresh_pending, 0, __ATOMIC_RELAXED);
+		__atomic_store_n(&entry->expire_time, 0, __ATOMIC_RELAXED);
+		shared_remove(entry);
+	}
+}
+
+/* Remove every entry for a request, stale or not, and return whether one of
+ * them had a sibling, which is filled in. */
+static int cache_remove_key(request_header * req, void * key, request_header * sibling, char * sibling_key)
+{
+	uint32_t hash = cache_hash(key, req->key_len, req->type);
+	struct cache_shard * shard = &shards[shard_index(hash)];
+	struct cache_table * tables[2];
+	struct cache_entry * entry;
+	int i, found = 0;
+	
+	shard_lock(shard);
+	tables[0] = shard->table;
+	tables[1] = shard->old;
+	for(i = 0; i < 2; i++)
+	{
+		uint32_t index = slot_index(hash);
+		if(!tables[i])
+			continue;
+		while((entry = table_probe(tables[i], req, key, hash, &index)))
+		{
+			if(debug)
+				printf("Invalidating cache entry for [%s]\n", (char *) entry->key);
+			if(!found && sibling)
+				found = !reply_sibling(entry->type, entry->reply, reply_length(entry->reply), sibling, sibling_key, SIBLING_KEY_MAX);
+			entry_remove(shard, entry);
+		}
+	}
+	pthread_mutex_unlock(&shard->mutex);
+	return found;
+}
+
+void cache_remove(request_header * req, void * key)
+{
+	request_header sibling;
+	char sibling_key[SIBLING_KEY_MAX];
+	int db = request_database(req->type);
+	if(db < 0)
+		return;
+	__sync_add_and_fetch(&db_removals[db], 1);
+	if(cache_remove_key(req, key, &sibling, sibling_key))
+		cache_remove_key(&sibling, sibling_key, NULL, NULL);
+	negative_remove(req, key);
+	/* the user or group may have changed in the enumeration too */
+	ent_invalidate(db);
+}
+
+/* When an entry misses, the first thread to look it up records that it is
+ * doing so here, and other threads wanting the same entry wait for its reply
+ * instead of all asking the name service at once. Each shard keeps a list of
+ * the lookups in progress for its keys, protected by the shard lock. */
+struct cache_flight {
+	/* query information (the key belongs to the thread doing the lookup) */
+	request_type type;
+	void * key;
+	int32_t key_len;
+	uint32_t key_hash;
+	struct cache_shard * shard;
+	
+	/* the result, once done is set (the flight holds a reference) */
+	int done;
+	void * reply;
+	int close_socket;
+	/* the reply isn't cached if the database is invalidated meanwhile */
+	unsigned int generation;
+	
+	/* the lookup thread and each waiter hold a reference to the flight */
+	int refs;
+	pthread_cond_t cond;
+	struct cache_flight * next;
+};
+
+/* MUST BE CALLED WITH THE SHARD LOCK HELD */
+static void flight_release(struct cache_flight * flight)
+{
+	if(--flight->refs)
+		return;
+	if(flight->reply)
+		reply_release(flight->reply);
+	pthread_cond_destroy(&flight->cond);
+	free(flight);
+}
+
+int cache_wait(request_header * req, void * key, uid_t uid, void ** reply, int32_t * reply_len, int * close_socket, int timeout, struct cache_flight ** flight)
+{
+	uint32_t hash = cache_hash(key, req->key_len, req->type);
+	struct cache_shard * shard = &shards[shard_index(hash)];
+	struct cache_flight * scan;
+	struct cache_entry * entry;
+	struct timespec deadline;
+	int r = 0;
+	
+	*flight = NULL;
+	shard_lock(shard);
+	/* it may have been added since we missed it */
+	entry = shard_search(shard, req, key, hash);
+	if(entry)
+	{
+		*reply = entry->reply;
+		*reply_len = reply_length(*reply);
+		*close_socket = entry->close_socket;
+		reply_ref(*reply);
+		pthread_mutex_unlock(&shard->mutex);
+		return 0;
+	}
+	
+	for(scan = shard->flights; scan; scan = scan->next)
+		if(scan->key_hash == hash && scan->key_len == req->key_len
+		   && scan->type == req->type && !memcmp(scan->key, key, req->key_len))
+			break;
+	if(!scan)
+	{
+		/* nobody else is looking it up, so we will */
+		scan = malloc(sizeof(*scan));
+		if(scan)
+		{
+			scan->type = req->type;
+			scan->key = key;
+			scan->key_len = req->key_len;
+			scan->key_hash = hash;
+			scan->shard = shard;
+			scan->done = 0;
+			scan->reply = NULL;
+			scan->generation = type_generation(req->type);
+			scan->refs = 1;
+			pthread_cond_init(&scan->cond, NULL);
+			scan->next = shard->flights;
+			shard->flights = scan;
+			*flight = scan;
+		}
+		shard->lookups++;
+		pthread_mutex_unlock(&shard->mutex);
+		return 1;
+	}
+	
+	if(debug)
+		printf("Waiting for another thread to look up [%s]\n", (char *) key);
+	clock_gettime(CLOCK_REALTIME, &deadline);
+	deadline.tv_sec += timeout / 1000;
+	deadline.tv_nsec += (timeout % 1000) * 1000000;
+	if(deadline.tv_nsec >= 1000000000)
+	{
+		deadline.tv_sec++;
+		deadline.tv_nsec -= 1000000000;
+	}
+	scan->refs++;
+	while(!scan->done && !r)
+		r = pthread_cond_timedwait(&scan->cond, &shard->mutex, &deadline);
+	
+	if(!scan->done)
+	{
+		/* give up and look it up ourselves */
+		shard->wait_timeouts++;
+		shard->lookups++;
+		r = 1;
+	}
+	else if(!scan->reply)
+		/* the lookup failed, and we'd only fail the same way */
+		r = -1;
+	else
+	{
+		*reply = scan->reply;
+		*reply_len = reply_length(*reply);
+		*close_socket = scan->close_socket;
+		reply_ref(*reply);
+		shard->coalesced++;
+		r = 0;
+	}
+	flight_release(scan);
+	pthread_mutex_unlock(&shard->mutex);
+	return r;
+}
+
+int cache_finish(struct cache_flight * flight, request_header * req, void * key, uid_t uid, void * reply, int32_t reply_len, int close_socket, time_t refresh_interval)
+{
+	struct cache_shard * shard;
+	struct cache_flight ** point;
+	struct sibling_update update = {reply: NULL};
+	struct cache_entry * entry;
+	int r = -1;
+	
+	if(!flight)
+		return reply ? cache_add(req, key, uid, reply, reply_len, close_socket, refresh_interval) : -1;
+	
+	shard = flight->shard;
+	shard_lock(shard);
+	if(reply)
+	{
+		/* the waiters get their own reference */
+		reply_ref(reply);
+		flight->reply = reply;
+		flight->close_socket = close_socket;
+		if(flight->generation != type_generation(req->type))
+			r = -1;
+		else if(!negative_add(req, key, reply))
+		{
+			reply_release(reply);
+			r = 0;
+		}
+		else if(!shard_search(shard, req, key, flight->key_hash))
+		{
+			entry = shard_add(shard, req, key, flight->key_hash, reply, close_socket, refresh_interval, 1);
+			if(entry)
+			{
+				sibling_prepare(&update, entry);
+				r = 0;
+			}
+		}
+	}
+	
+	/* wake up the waiters */
+	for(point = &shard->flights; *point != flight; point = &(*point)->next);
+	*point = flight->next;
+	flight->done = 1;
+	pthread_cond_broadcast(&flight->cond);
+	flight_release(flight);
+	pthread_mutex_unlock(&shard->mutex);
+	sibling_update(&update);
+	return r;
+}
+
+/* Mark an entry as no longer being refreshed.
+ * MUST BE CALLED WITH THE SHARD LOCK HELD */
+static void refresh_done(struct cache_entry * entry)
+{
+	pthread_mutex_lock(&refresh_mutex);
+	entry->refresh_queued = REFRESH_IDLE;
+	pthread_mutex_unlock(&refresh_mutex);
+}
+
+/* Look an entry up again and update its reply, or remove it if that fails and
+ * it is too old to keep serving. This is only called by the refresh threads,
+ * for entries they own, so the entry can't go away while the shard is
+ * unlocked. */
+static void cache_refresh(struct cache_entry * entry)
+{
+	struct cache_shard * shard = &shards[shard_index(entry->key_hash)];
+	request_header req = {version: NSCD_VERSION, type: entry->type, key_len: entry->key_len};
+	struct sibling_update update = {reply: NULL};
+	int r = -1;
+	/* the old and new copies of a group which changed, see below */
+	void * old_group = NULL;
+	void * new_group = NULL;
+	void * reply;
+	int32_t reply_len;
+	time_t refresh_interval, now;
+	
+	if(entry->refreshes != 5 && entry_current(entry) && sibling_refreshing(entry))
+	{
+		if(debug)
+			printf("Leaving cache entry for [%s] to be refreshed with its sibling\n", (char *) entry->key);
+		shard_lock(shard);
+		refresh_done(entry);
+		/* look it up after all if that refresh fails */
+		timer_schedule(&entry->timer, time(NULL) + REFRESH_RETRY);
+		pthread_mutex_unlock(&shard->mutex);
+		return;
+	}
+	
+	/* don't bother if a new copy has already been fetched */
+	if(entry->refreshes != 5 && entry_current(entry))
+	{
+		if(debug)
+			printf("Refreshing cache entry for [%s], refreshes %d\n", (char *) entry->key, entry->refreshes);
+		r = generate_reply(&req, entry->key, -1, &reply, &reply_len, &refresh_interval);
+	}
+	shard_lock(shard);
+	now = time(NULL);
+	
+	/* while we were refreshing it, it may have been marked stale and a
+	 * new copy fetched, or its database may have been invalidated */
+	if(entry->refreshes == 5 || !entry_current(entry))
+	{
+		/* kill it */
+		cache_entry_destroy(shard, entry);
+		if(r >= 0)
+			reply_release(reply);
+	}
+	else if(r < 0)
+	{
+		/* keep serving the old reply until it gets too old,
+		 * and try again later, or once it is too old */
+		pthread_mutex_lock(&refresh_mutex);
+		refresh_failures++;
+		pthread_mutex_unlock(&refresh_mutex);
+		__atomic_store_n(&entry->refresh_pending, 1, __ATOMIC_RELAXED);
+		if(!entry_usable(entry, now))
+			cache_entry_destroy(shard, entry);
+		else
+		{
+			time_t retry = now + REFRESH_RETRY;
+			time_t limit = entry->expire_time + max_stale[request_database(entry->type)] + 1;
+			refresh_done(entry);
+			timer_schedule(&entry->timer, retry < limit ? retry : limit);
+		}
+	}
+	else if(!negative_add(&req, entry->key, reply))
+	{
+		/* it is gone, so only the negative cache needs to know about it */
+		if(entry->type == GETGRBYNAME || entry->type == GETGRBYGID)
+		{
+			old_group = entry->reply;
+			reply_ref(old_group);
+		}
+		cache_entry_destroy(shard, entry);
+		reply_release(reply);
+	}
+	else
+	{
+		if((entry->type == GETGRBYNAME || entry->type == GETGRBYGID) && !reply_equal(reply, entry->reply))
+		{
+			old_group = entry->reply;
+			new_group = reply;
+			reply_ref(old_group);
+			reply_ref(new_group);
+		}
+		/* if it went stale, it expires a full interval from now */
+		time_t expire_time = entry->expire_time + refresh_interval;
+		if(expire_time <= now)
+			expire_time = now + refresh_interval;
+		entry_set_reply(entry, reply, 0);
+		__atomic_store_n(&entry->expire_time, expire_time, __ATOMIC_RELAXED);
+		__atomic_store_n(&entry->refresh_pending, 0, __ATOMIC_RELAXED);
+		entry->refresh_interval = refresh_interval;
+		entry->refreshes++;
+		refresh_done(entry);
+		timer_schedule(&entry->timer, expire_time);
+		sibling_prepare(&update, entry);
+	}
+	pthread_mutex_unlock(&shard->mutex);
+	sibling_update(&update);
+	/* the member index would still have the old members of the group */
+	if(old_group)
+	{
+		members_refresh(old_group, new_group);
+		reply_release(old_group);
+		if(new_group)
+			reply_release(new_group);
+	}
+}
+
+static void * refresh_thread(void * arg)
+{
+	for(;;)
+	{
+		struct cache_entry * entry;
+		int db;
+		
+		pthread_mutex_lock(&refresh_mutex);
+		while(!(entry = refresh_dequeue()))
+			pthread_cond_wait(&refresh_cond, &refresh_mutex);
+		db = request_database(entry->type);
+		if(db >= 0)
+			refresh_in_flight[db]++;
+		pthread_mutex_unlock(&refresh_mutex);
+		
+		cache_refresh(entry);
+		
+		pthread_mutex_lock(&refresh_mutex);
+		if(db >= 0)
+			refresh_in_flight[db]--;
+		refreshes_done++;
+		/* entries passed over for being at the limit may now be taken */
+		if(refresh_head)
+			pthread_cond_broadcast(&refresh_cond);
+		pthread_mutex_unlock(&refresh_mutex);
+	}
+	return NULL;
+}
+
+/* Deal with an entry whose timer has gone off, queueing it to be refreshed or
+ * removing it. */
+static void cache_expire(struct cache_entry * entry)
+{
+	struct cache_shard * shard = &shards[shard_index(entry->key_hash)];
+	time_t now;
+	
+	shard_lock(shard);
+	now = time(NULL);
+	/* it was evicted after its timer went off */
+	if(entry->refresh_queued == REFRESH_DEAD)
+	{
+		pthread_mutex_unlock(&shard->mutex);
+		return;
+	}
+	/* clients have used it since it was last refreshed */
+	if(__atomic_load_n(&entry->accessed, __ATOMIC_RELAXED) & ENTRY_USED)
+	{
+		__atomic_and_fetch(&entry->accessed, ~ENTRY_USED, __ATOMIC_RELAXED);
+		entry->refreshes = 0;
+	}
+	/* if the refresh threads own it, they will set its timer again */
+	if(entry->refresh_queued != REFRESH_IDLE)
+	{
+		pthread_mutex_unlock(&shard->mutex);
+		return;
+	}
+	if(entry->refreshes == 5 || !entry_current(entry))
+	{
+		/* kill it, unless a client just queued it to be refreshed */
+		if(!refresh_claim(entry))
+			cache_entry_destroy(shard, entry);
+	}
+	else if(entry->expire_time > now)
+		/* it was replaced since the timer was set */
+		timer_schedule(&entry->timer, entry->expire_time);
+	else
+		refresh_enqueue(entry);
+	pthread_mutex_unlock(&shard->mutex);
+}
+
+/* The cache is saved to a snapshot every snapshot-interval seconds, and when
+ * gnscd is shut down, and loaded back when it starts. A new snapshot is
+ * written next to the old one and then renamed over it, so a crash while
+ * saving leaves the old one in place. */
+static pthread_mutex_t save_mutex = PTHREAD_MUTEX_INITIALIZER;
+static unsigned long snapshot_count = 0;
+static ssize_t snapshot_bytes = 0;
+static time_t snapshot_time = 0;
+static unsigned long snapshot_loaded = 0;
+
+/* MUST BE CALLED WITH THE SHARD LOCK HELD */
+static int snapshot_entry(struct snapshot * snapshot, struct cache_entry * entry)
+{
+	struct snapshot_record record;
+	void * reply = entry->reply;
+	if(!entry_current(entry))
+		return 0;
+	record.type = entry->type;
+	record.key_len = entry->key_len;
+	record.reply_len = reply_length(reply);
+	record.close_socket = entry->close_socket;
+	record.expire_time = entry->expire_time;
+	record.refresh_interval = entry->refresh_interval;
+	record.refreshes = entry->refreshes;
+	record.unused = 0;
+	snapshot_count++;
+	return snapshot_add(snapshot, &record, entry->key, reply);
+}
+
+/* MUST BE CALLED WITH THE SHARD LOCK HELD */
+static int snapshot_shard(struct snapshot * snapshot, struct cache_shard * shard)
+{
+	uint32_t i;
+	if(shard->table)
+		for(i = 0; i < shard->table->size; i++)
+			if(shard->table->slots[i] && snapshot_entry(snapshot, shard->table->slots[i]) < 0)
+				return -1;
+	/* the rest of the old table hasn't been copied to the new one yet */
+	if(shard->old)
+		for(i = shard->migrated; i < shard->old->size; i++)
+			if(shard->old->slots[i] && snapshot_entry(snapshot, shard->old->slots[i]) < 0)
+				return -1;
 	return 0;
 }
 
+/* MUST BE CALLED WITH THE SAVE LOCK HELD */
+static int cache_snapshot(int fd)
+{
+	struct snapshot * snapshot;
+	size_t size = 0;
+	int i, r = 0;
+	
+	/* the records are smaller than the entries, so this is plenty */
+	for(i = 0; i < DB_COUNT; i++)
+		size += __atomic_load_n(&db_bytes[i], __ATOMIC_RELAXED);
+	snapshot = snapshot_create(fd, size);
+	if(!snapshot)
+		r = -1;
+	snapshot_count = 0;
+	for(i = 0; i < CACHE_SHARDS && !r; i++)
+	{
+		shard_lock(&shards[i]);
+		r = snapshot_shard(snapshot, &shards[i]);
+		pthread_mutex_unlock(&shards[i].mutex);
+	}
+	if(snapshot)
+	{
+		snapshot_bytes = snapshot_finish(snapshot);
+		if(snapshot_bytes < 0)
+			r = -1;
+	}
+	return r;
+}
+
+/* Flush the directory a file was renamed into, so that the rename survives a
+ * crash too. */
+static int sync_directory(const char * path)
+{
+	char directory[PATH_MAX];
+	char * slash;
+	int fd, r;
+	
+	snprintf(directory, sizeof(directory), "%s", path);
+	slash = strrchr(directory, '/');
+	if(!slash)
+		strcpy(directory, ".");
+	else if(slash == directory)
+		slash[1] = 0;
+	else
+		*slash = 0;
+	fd = open(directory, O_RDONLY | O_DIRECTORY);
+	if(fd < 0)
+		return -1;
+	r = fsync(fd);
+	close(fd);
+	return r;
+}
+
+int cache_save(const char * path)
+{
+	char temp[PATH_MAX];
+	int fd, r;
+	
+	snprintf(temp, sizeof(temp), "%s.new", path);
+	pthread_mutex_lock(&save_mutex);
+	fd = open(temp, O_RDWR | O_CREAT | O_TRUNC, 0600);
+	if(fd < 0)
+	{
+		pthread_mutex_unlock(&save_mutex);
+		return -1;
+	}
+	r = cache_snapshot(fd);
+	if(!r && (fsync(fd) < 0 || rename(temp, path) < 0 || sync_directory(path) < 0))
+		r = -1;
+	close(fd);
+	if(r < 0)
+	{
+		if(debug)
+			printf("Failed to save cache snapshot to %s\n", path);
+		unlink(temp);
+	}
+	else
+	{
+		if(debug)
+			printf("Saved %lu cache entries to %s\n", snapshot_count, path);
+		snapshot_time = time(NULL);
+	}
+	pthread_mutex_unlock(&save_mutex);
+	return r;
+}
+
+int cache_write(int fd)
+{
+	int r;
+	pthread_mutex_lock(&save_mutex);
+	r = cache_snapshot(fd);
+	if(debug)
+		printf("Wrote %lu cache entries to FD %d\n", snapshot_count, fd);
+	pthread_mutex_unlock(&save_mutex);
+	return r;
+}
+
+/* Load the entries from a snapshot which can still be served. Those which have
+ * expired are served stale until they can be refreshed, which starts as soon
+ * as the maintenance thread runs. Only called before any other thread uses
+ * the cache. */
+static void cache_load(int fd)
+{
+	struct snapshot * snapshot = snapshot_open(fd);
+	const struct snapshot_record * record;
+	const void * key;
+	const void * reply;
+	time_t now = time(NULL);
+	if(!snapshot)
+	{
+		if(debug)
+			printf("Ignoring bad cache snapshot\n");
+		return;
+	}
+	while((record = snapshot_next(snapshot, &key, &reply)))
+	{
+		request_header req = {version: NSCD_VERSION, type: record->type, key_len: record->key_len};
+		int db = request_database(record->type);
+		uint32_t hash = cache_hash(key, record->key_len, record->type);
+		struct cache_shard * shard = &shards[shard_index(hash)];
+		struct cache_entry * entry;
+		void * copy;
+		
+		if(db < 0 || record->expire_time + max_stale[db] < now)
+			continue;
+		copy = reply_alloc(record->reply_len);
+		if(!copy)
+			break;
+		memcpy(copy, reply, record->reply_len);
+		shard_lock(shard);
+		entry = shard_search(shard, &req, (void *) key, hash) ? NULL : shard_add(shard, &req, (void *) key, hash, copy, record->close_socket, record->refresh_interval, 1);
+		if(entry)
+		{
+			entry->expire_time = record->expire_time;
+			entry->refreshes = record->refreshes;
+			/* keep serving it while it is refreshed */
+			entry->refresh_pending = (entry->expire_time < now);
+			timer_schedule(&entry->timer, entry->expire_time);
+			snapshot_loaded++;
+		}
+		else
+			reply_release(copy);
+		pthread_mutex_unlock(&shard->mutex);
+	}
+	snapshot_close(snapshot);
+	if(debug)
+		printf("Loaded %lu cache entries\n", snapshot_loaded);
+}
+
 static void * cache_maintain(void * arg)
 {
 	/* This code runs as a thread and is responsible for maintaining the
-	 * cache. Every 10 seconds it scans 1/6 of the cache, so that in a
-	 * minute it will scan the entire cache. It attempts to refresh cache
-	 * entries which have expired, but only up to 5 times if they have not
-	 * been used in the interim. After that they are removed. */
-	int entries = HASH_SIZE / 6;
-	int position = 0;
+	 * cache. Every entry has a timer set to go off when it expires, and
+	 * every second this thread deals with the entries whose timers have
+	 * gone off. It queues cache entries which have expired to be refreshed,
+	 * but only up to 5 times if they have not been used in the interim.
+	 * After that they are removed. No lock is held for longer than it takes
+	 * to deal with one entry. It also saves the cache now and then. */
+	time_t next_save = time(NULL) + snapshot_interval;
 	for(;;)
 	{
-		int i;
-		time_t now;
+		struct timer * timer;
 		struct timespec delay;
 		
-		delay.tv_sec = 10;
+		delay.tv_sec = 1;
 		delay.tv_nsec = 0;
 		while(nanosleep(&delay, &delay) < 0 && errno == EINTR)
 			if(debug)
 				printf("Resuming interrupted sleep!\n");
 		
-		pthread_mutex_lock(&cache_mutex);
-		if(debug)
-			printf("Look over 1/6 of cache...\n");
-		now = time(NULL);
-		for(i = 0; i < entries; i++)
-		{
-			/* Since we'll potentially be removing entries from the
-			 * linked list, we keep a pointer to the previous
-			 * element's link to us so that we can update it and use
-			 * that to get to the next element if we remove one. */
-			struct cache_entry ** point = &hash_table[position];
-			struct cache_entry * scan;
-			while((scan = *point))
-			{
-				/* GET*ENT entries do not get refreshed here */
-				if(scan->refreshes == 5 || (now > scan->expire_time &&
-				   (scan->type == GETPWENT || scan->type == GETGRENT)))
-					/* kill it */
-					cache_entry_destroy(scan);
-				else if(now > scan->expire_time)
-				{
-					request_header req = {version: NSCD_VERSION, type: scan->type, key_len: scan->key_len};
-					int r;
-					void * reply;
-					int32_t reply_len;
-					time_t refresh_interval;
-					
-					/* refresh it */
-					if(debug)
-						printf("Refreshing cache entry for [%s], refreshes %d\n", (char *) scan->key, scan->refreshes);
-					pthread_mutex_unlock(&cache_mutex);
-					r = generate_reply(&req, scan->key, -1, &reply, &reply_len, &refresh_interval);
-					pthread_mutex_lock(&cache_mutex);
-					now = time(NULL);
-					
-					/* while we were refreshing it, it may have
-					 * been marked stale and a new copy fetched */
-					if(scan->refreshes == 5 || r < 0)
-					{
-						/* kill it */
-						cache_entry_destroy(scan);
-						if(r >= 0)
-							free(reply);
-					}
-					else
-					{
-						free(scan->reply);
-						scan->reply = reply;
-						scan->reply_len = reply_len;
-						scan->expire_time += refresh_interval;
-						scan->refresh_interval = refresh_interval;
-						scan->refreshes++;
-						/* go to next entry */
-						point = &scan->chain;
-					}
-				}
-				else
-					/* go to next entry */
-					point = &scan->chain;
-			}
-			if(++position == HASH_SIZE)
-				position = 0;
+		/* once an expired entry's timer is off the wheel, it can be
+		 * evicted before we get to it, so make sure it isn't freed */
+		epoch_enter();
+		while((timer = timer_expired(time(NULL))))
+			cache_expire(entry_of_timer(timer));
+		epoch_exit();
+		/* free anything retired since last time */
+		epoch_reclaim();
+		shared_tick(time(NULL));
+		negative_tick(time(NULL));
+		
+		/* once another gnscd has taken over, it saves the cache */
+		if(snapshot_interval && time(NULL) >= next_save && !serve_handed_off())
+		{
+			cache_save(GNSCD_SNAPSHOT);
+			next_save = time(NULL) + snapshot_interval;
 		}
-		if(debug)
-			printf("Done looking over 1/6 of cache.\n");
-		pthread_mutex_unlock(&cache_mutex);
 	}
 	return NULL;
 }
 
-int cache_init(void)
+/* Add up how far the entries in a table are from their home slots.
+ * MUST BE CALLED WITH THE SHARD LOCK HELD */
+static void table_probe_stats(struct cache_table * table, unsigned long * total, uint32_t * longest)
+{
+	uint32_t mask = table->size - 1;
+	uint32_t i;
+	for(i = 0; i < table->size; i++)
+		if(table->slots[i])
+		{
+			uint32_t distance = (i - slot_index(table->slots[i]->key_hash)) & mask;
+			*total += distance;
+			if(distance > *longest)
+				*longest = distance;
+		}
+}
+
+void cache_stats(struct stats_buffer * stats)
+{
+	int i, entries = 0, busiest = 0;
+	unsigned long lock_waits = 0, grows = 0, slots = 0, deleted = 0, probes = 0;
+	unsigned long lookups = 0, coalesced = 0, wait_timeouts = 0;
+	uint32_t longest = 0;
+	/* this also makes sure no shard is stuck locked by some thread */
+	for(i = 0; i < CACHE_SHARDS; i++)
+	{
+		pthread_mutex_lock(&shards[i].mutex);
+		entries += shards[i].entries;
+		if(shards[i].entries > busiest)
+			busiest = shards[i].entries;
+		lock_waits += shards[i].lock_waits;
+		grows += shards[i].grows;
+		lookups += shards[i].lookups;
+		coalesced += shards[i].coalesced;
+		wait_timeouts += shards[i].wait_timeouts;
+		if(shards[i].table)
+		{
+			slots += shards[i].table->size;
+			deleted += shards[i].table->deleted;
+			table_probe_stats(shards[i].table, &probes, &longest);
+		}
+		pthread_mutex_unlock(&shards[i].mutex);
+	}
+	stats_printf(stats, "%15d  cache entries\n", entries);
+	stats_printf(stats, "%15d  cache shards\n", CACHE_SHARDS);
+	stats_printf(stats, "%15d  entries in the fullest shard\n", busiest);
+	stats_printf(stats, "%15lu  hash table slots\n", slots);
+	stats_printf(stats, "%15lu  removed entry slots\n", deleted);
+	stats_printf(stats, "%15lu  hash table resizes\n", grows);
+	stats_printf(stats, "%15.2f  average probe distance\n", entries ? (double) probes / entries : 0.0);
+	stats_printf(stats, "%15u  longest probe distance\n", longest);
+	stats_printf(stats, "%15lu  contended shard locks\n", lock_waits);
+	stats_printf(stats, "%15lu  cache misses looked up\n", lookups);
+	stats_printf(stats, "%15lu  cache misses answered by another lookup\n", coalesced);
+	stats_printf(stats, "%14.1f%%  cache misses coalesced\n", lookups + coalesced ? coalesced * 100.0 / (lookups + coalesced) : 0.0);
+	stats_printf(stats, "%15lu  waits for another lookup timed out\n", wait_timeouts);
+	stats_printf(stats, "%15lu  sibling entries added or updated\n", sibling_updates);
+	pthread_mutex_lock(&refresh_mutex);
+	stats_printf(stats, "%15lu  stale replies served\n", stale_hits);
+	stats_printf(stats, "%15lu  background refreshes queued\n", refreshes_queued);
+	stats_printf(stats, "%15lu  background refreshes done\n", refreshes_done);
+	stats_printf(stats, "%15lu  failed refreshes\n", refresh_failures);
+	stats_printf(stats, "%15d  refreshes currently queued\n", refresh_count);
+	stats_printf(stats, "%15d  most refreshes ever queued\n", max_refresh_count);
+	for(i = 0; i < DB_COUNT; i++)
+		stats_printf(stats, "%15d  %s refreshes in progress\n", refresh_in_flight[i], db_names[i]);
+	if(refresh_head)
+	{
+		struct timeval now;
+		gettimeofday(&now, NULL);
+		stats_printf(stats, "%15llu  oldest queued refresh (usec)\n", (unsigned long long) ((now.tv_sec - refresh_head->refresh_time.tv_sec) * 1000000LL + now.tv_usec - refresh_head->refresh_time.tv_usec));
+	}
+	else
+		stats_printf(stats, "%15d  oldest queued refresh (usec)\n", 0);
+	stats_printf(stats, "%15llu  average refresh queue wait (usec)\n", refreshes_done ? (unsigned long long) (refresh_lag_usec / refreshes_done) : 0ULL);
+	stats_printf(stats, "%15llu  longest refresh queue wait (usec)\n", (unsigned long long) max_refresh_lag_usec);
+	pthread_mutex_unlock(&refresh_mutex);
+	for(i = 0; i < DB_COUNT; i++)
+	{
+		stats_printf(stats, "%15zu  bytes used by %s entries\n", db_bytes[i], db_names[i]);
+		stats_printf(stats, "%15d  bytes allowed for %s entries\n", max_db_size[i], db_names[i]);
+		stats_printf(stats, "%15lu  %s entries evicted\n", db_evictions[i], db_names[i]);
+		stats_printf(stats, "%15lu  %s invalidations\n", db_invalidations[i], db_names[i]);
+		stats_printf(stats, "%15lu  %s keys invalidated\n", db_removals[i], db_names[i]);
+	}
+	pthread_mutex_lock(&save_mutex);
+	stats_printf(stats, "%15lu  entries loaded from snapshot\n", snapshot_loaded);
+	stats_printf(stats, "%15lu  entries in last snapshot\n", snapshot_count);
+	stats_printf(stats, "%15zd  bytes in last snapshot\n", snapshot_bytes);
+	stats_printf(stats, "%15ld  seconds since last snapshot\n", snapshot_time ? (long) (time(NULL) - snapshot_time) : -1L);
+	pthread_mutex_unlock(&save_mutex);
+	stats_printf(stats, "%15lu  retired objects awaiting reclamation\n", epoch_pending());
+	timer_stats(stats);
+	slab_stats(stats);
+	shared_stats(stats);
+	negative_stats(stats);
+}
+
+int cache_init(int snapshot)
 {
 	pthread_t thread;
-	if(pthread_create(&thread, NULL, cache_maintain, NULL) < 0)
+	int i;
+	slab_init();
+	hash_init();
+	if(shared_init() < 0)
+		return -1;
+	if(negative_init() < 0)
+		return -1;
+	timer_init(time(NULL));
+	for(i = 0; i < CACHE_SHARDS; i++)
+		pthread_mutex_init(&shards[i].mutex, NULL);
+	if(snapshot >= 0)
+		cache_load(snapshot);
+	else if(snapshot_interval && (snapshot = open(GNSCD_SNAPSHOT, O_RDONLY)) >= 0)
+	{
+		cache_load(snapshot);
+		close(snapshot);
+	}
+	if(pthread_create(&thread, NULL, cache_maintain, NULL))
 		return -1;
 	pthread_detach(thread);
+	for(i = 0; i < refresh_threads; i++)
+	{
+		if(pthread_create(&thread, NULL, refresh_thread, NULL))
+			return -1;
+		pthread_detach(thread);
+	}
 	return 0;
 }
@@ -20,8 +20,11 @@
 #include <stdint.h>
 #include <pthread.h>
 #include <time.h>
+#include <sys/time.h>
 
 #include "nscd.h"
+#include "misc.h"
+#include "timer.h"
 
 /* All entries in the cache are stored using this structure. */
 struct cache_entry {
@@ -31,31 +34,98 @@ struct cache_entry {
 	int32_t key_len;
 	uint32_t key_hash;
 	
-	/* cached information */
+	/* cached information (the entry holds a reference to the reply) */
 	void * reply;
-	int32_t reply_len;
 	int close_socket;
+	/* set if the reply was given to it by its sibling, see cache.c */
+	int sibling_reply;
 	
 	/* refresh information */
 	time_t expire_time;
 	time_t refresh_interval;
 	int refreshes;
+	/* set by readers when the entry is used, see below */
+	int accessed;
+	/* set while a refresh of this stale entry is pending or failing */
+	int refresh_pending;
 	
-	/* chaining information */
-	struct cache_entry ** point;
-	struct cache_entry * chain;
+	/* background refresh queue, see cache.c */
+	int refresh_queued;
+	struct timeval refresh_time;
+	struct cache_entry * refresh_next;
+	
+	/* goes off when the entry expires */
+	struct timer timer;
+	
+	/* bytes used by the entry, its key, and its reply */
+	size_t size;
+	
+	/* where its copy is in the shared database, or ENDREF */
+	ref_t shared;
+	
+	/* the generation of its database it was looked up in, see cache.c */
+	unsigned int generation;
 };
 
-/* All access to the cache is synchronized with this mutex. */
-extern pthread_mutex_t cache_mutex;
+/* Readers set both of these bits in the accessed field. ENTRY_USED is cleared
+ * when the entry is refreshed, and ENTRY_REFERENCED by cache eviction. */
+#define ENTRY_USED 1
+#define ENTRY_REFERENCED 2
+
+/* a lookup in progress, see cache_wait() */
+struct cache_flight;
+
+/* Replies are allocated with reply_alloc(), which returns them with one
+ * reference. Once generated they are immutable, and they are freed when the
+ * last reference is released. */
+extern void * reply_alloc(int32_t reply_len);
+extern void reply_ref(void * reply);
+extern void reply_release(void * reply);
+extern int32_t reply_length(void * reply);
+
+/* The cache does its own locking, so none of these need any locks held. */
 
-/* Search the cache for an entry, and fill in the pointers if one is found. */
-extern int cache_search(request_header * req, void * key, uid_t uid, struct cache_entry ** entry);
+/* Search the cache for an entry. If one is found, fill in the reply pointers
+ * and return 0. The caller gets a reference to the reply, which it must
+ * release with reply_release() when it is done with it. */
+extern int cache_search(request_header * req, void * key, uid_t uid, void ** reply, int32_t * reply_len, int * close_socket);
 
-/* Add an entry to the cache with the specified parameters. */
+/* Add an entry to the cache with the specified parameters. This fails if an
+ * entry for the same request is already there. On success, the cache takes
+ * over the caller's reference to the reply. */
 extern int cache_add(request_header * req, void * key, uid_t uid, void * reply, int32_t reply_len, int close_socket, time_t refresh_interval);
 
-/* Initialize the cache and start the cache maintenance thread. */
-extern int cache_init(void);
+/* Wait for another thread's lookup of an entry that missed the cache. If the
+ * entry has since been added, or another thread is looking it up and finishes
+ * within timeout milliseconds, fill in the reply pointers as cache_search()
+ * would and return 0. If that lookup failed, return -1. Otherwise return 1: the
+ * caller must then look it up itself and pass the result to cache_finish(),
+ * along with the flight set here, so that other threads can wait for it. */
+extern int cache_wait(request_header * req, void * key, uid_t uid, void ** reply, int32_t * reply_len, int * close_socket, int timeout, struct cache_flight ** flight);
+
+/* Like cache_add(), but also hand the reply to any threads waiting for it. The
+ * reply is NULL if the lookup failed. The flight may be NULL if none was set. */
+extern int cache_finish(struct cache_flight * flight, request_header * req, void * key, uid_t uid, void * reply, int32_t reply_len, int close_socket, time_t refresh_interval);
+
+/* Save the cache to a snapshot file, which is loaded by cache_init(). */
+extern int cache_save(const char * path);
+
+/* Write a snapshot of the cache to an empty file. */
+extern int cache_write(int fd);
+
+/* Invalidate every entry for a database. */
+extern void cache_invalidate(int db);
+
+/* Remove the entry for a request, along with its sibling entry and any
+ * negative reply for it. */
+extern void cache_remove(request_header * req, void * key);
+
+/* Add the cache statistics to a stats buffer. */
+extern void cache_stats(struct stats_buffer * stats);
+
+/* Initialize the cache and start the cache maintenance thread. The cache is
+ * loaded from the snapshot file descriptor given, or if that is -1, from the
+ * snapshot file. */
+extern int cache_init(int snapshot);
 
 #endif /* __CACHE_H */
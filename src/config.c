@@ -0,0 +1,256 @@
+/* This file is part of gnscd, a complete nscd replacement.
+ * Copyright (C) 2006 Google. Licensed under the GPL version 2. */
+
+/* gnscd is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; version 2 of the License.
+ * 
+ * gnscd is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ * 
+ * You can download the GNU General Public License from the GNU website
+ * at http://www.gnu.org/ or write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "nscd.h"
+#include "misc.h"
+
+/* The configuration file uses the same syntax as glibc's nscd.conf: one option
+ * per line, followed by its value, with comments starting with '#'. Options we
+ * don't know about are ignored, as are options for databases we don't have,
+ * so that an existing nscd.conf can be used. */
+
+int min_threads = 4;
+int max_threads = 32;
+
+const char * db_names[DB_COUNT] = {"passwd", "group", "hosts"};
+
+/* Whether requests for each database are answered, or clients are told to
+ * look them up themselves. */
+int enable_cache[DB_COUNT] = {1, 1, 1};
+
+/* Expired entries are still served for the grace period while they are
+ * refreshed in the background, and for up to max-stale seconds if the refresh
+ * is slow or keeps failing. */
+int grace_period[DB_COUNT] = {60, 60, 60};
+int max_stale[DB_COUNT] = {3600, 3600, 3600};
+
+/* Expired entries are refreshed by a pool of threads, which keep at most
+ * max-refreshes lookups for each database going at once. */
+int refresh_threads = 4;
+int max_refreshes[DB_COUNT] = {2, 2, 2};
+
+/* the most memory, in bytes, the cache may use for each database */
+int max_db_size[DB_COUNT] = {33554432, 33554432, 33554432};
+
+/* Whether clients may map a read-only copy of each database and search it
+ * themselves, and how many hash buckets that copy has. */
+int shared[DB_COUNT] = {1, 1, 1};
+int suggested_size[DB_COUNT] = {4093, 4093, 4093};
+
+/* how often, in seconds, to save the cache so it survives a restart */
+int snapshot_interval = 300;
+
+/* For how long replies saying that a user, group or host exists are kept. */
+int positive_ttl[DB_COUNT] = {600, 3600, 600};
+
+/* Hosts from DNS are kept for as long as their TTLs say instead, but no less
+ * than dns-min-time-to-live and no more than dns-max-time-to-live, see dns.c. */
+int dns_min_ttl = 30;
+int dns_max_ttl = 3600;
+
+/* Whether to invalidate each database when the local files it may be read
+ * from change, see watch.c. */
+int check_files[DB_COUNT] = {1, 1, 1};
+
+/* Replies saying that a user or group doesn't exist are kept for
+ * negative-time-to-live seconds, in a store of negative-size slots of their
+ * own. If negative-filter is set, a filter of every name and id is built from
+ * a full enumeration that often, and used to answer for the ones not in it. */
+int negative_ttl[DB_COUNT] = {20, 60, 20};
+int negative_size[DB_COUNT] = {65536, 65536, 65536};
+int negative_filter[DB_COUNT] = {0, 0, 0};
+
+/* Whether INITGROUPS is answered from the members of the groups in the group
+ * GET*ENT snapshot, see lookup.c. Off unless asked for, since it is only right
+ * if enumerating the groups shows every group a user is in. */
+int initgroups_index = 0;
+
+/* Options with per_db set are given for one database, as in "max-stale passwd
+ * 600", and their value points to an array with one entry per database. */
+struct config_option {
+	const char * name;
+	int * value;
+	int per_db;
+};
+
+static struct config_option options[] = {
+	{"threads", &min_threads, 0},
+	{"max-threads", &max_threads, 0},
+	{"enable-cache", enable_cache, 1},
+	{"grace-period", grace_period, 1},
+	{"max-stale", max_stale, 1},
+	{"refresh-threads", &refresh_threads, 0},
+	{"max-refreshes", max_refreshes, 1},
+	{"max-db-size", max_db_size, 1},
+	{"shared", shared, 1},
+	{"suggested-size", suggested_size, 1},
+	{"snapshot-interval", &snapshot_interval, 0},
+	{"positive-time-to-live", positive_ttl, 1},
+	{"dns-min-time-to-live", &dns_min_ttl, 0},
+	{"dns-max-time-to-live", &dns_max_ttl, 0},
+	{"check-files", check_files, 1},
+	{"negative-time-to-live", negative_ttl, 1},
+	{"negative-size", negative_size, 1},
+	{"negative-filter", negative_filter, 1},
+	{"initgroups-index", &initgroups_index, 0},
+	{NULL, NULL, 0}
+};
+
+int request_database(request_type type)
+{
+	switch(type)
+	{
+		case GETPWBYNAME:
+		case GETPWBYUID:
+		case GETPWENT:
+		case GETPWALL:
+			return DB_PASSWD;
+		case GETGRBYNAME:
+		case GETGRBYGID:
+		case GETGRENT:
+		case GETGRALL:
+		case INITGROUPS:
+			return DB_GROUP;
+		case GETHOSTBYNAME:
+		case GETHOSTBYNAMEv6:
+		case GETHOSTBYADDR:
+		case GETHOSTBYADDRv6:
+		case GETAI:
+			return DB_HOSTS;
+		default:
+			return -1;
+	}
+}
+
+/* Return the database an option is for, -1 if it is missing, or -2 if it is
+ * one gnscd doesn't have, like services or netgroup in a stock nscd.conf. */
+static int parse_db(const char * file, int line, const char * name)
+{
+	int db;
+	if(!name)
+	{
+		fprintf(stderr, "%s:%d: missing database\n", file, line);
+		return -1;
+	}
+	for(db = 0; db < DB_COUNT; db++)
+		if(!strcmp(db_names[db], name))
+			return db;
+	if(debug)
+		printf("%s:%d: ignoring unknown database [%s]\n", file, line, name);
+	return -2;
+}
+
+static int parse_int(const char * file, int line, const char * value, int * result)
+{
+	char * end;
+	long number;
+	if(!value)
+	{
+		fprintf(stderr, "%s:%d: missing value\n", file, line);
+		return -1;
+	}
+	/* as in nscd.conf, yes and no can be used for flags */
+	if(!strcmp(value, "yes") || !strcmp(value, "no"))
+	{
+		*result = (value[0] == 'y');
+		return 0;
+	}
+	number = strtol(value, &end, 10);
+	if(*end || number < 0)
+	{
+		fprintf(stderr, "%s:%d: invalid number [%s]\n", file, line, value);
+		return -1;
+	}
+	*result = number;
+	return 0;
+}
+
+int config_load(const char * file)
+{
+	char buffer[256];
+	int line = 0, errors = 0, db;
+	FILE * config = fopen(file, "r");
+	if(!config)
+		/* a missing configuration file just means use the defaults */
+		return (errno == ENOENT) ? 0 : -1;
+	
+	while(fgets(buffer, sizeof(buffer), config))
+	{
+		char * name;
+		char * value;
+		char * comment = strchr(buffer, '#');
+		int * result;
+		int i;
+		
+		line++;
+		if(comment)
+			*comment = 0;
+		name = strtok(buffer, " \t\r\n");
+		if(!name)
+			continue;
+		value = strtok(NULL, " \t\r\n");
+		
+		for(i = 0; options[i].name; i++)
+			if(!strcmp(options[i].name, name))
+				break;
+		if(!options[i].name)
+		{
+			if(debug)
+				printf("%s:%d: ignoring unknown option [%s]\n", file, line, name);
+			continue;
+		}
+		result = options[i].value;
+		if(options[i].per_db)
+		{
+			db = parse_db(file, line, value);
+			if(db < 0)
+			{
+				if(db == -1)
+					errors++;
+				continue;
+			}
+			result += db;
+			value = strtok(NULL, " \t\r\n");
+		}
+		if(parse_int(file, line, value, result) < 0)
+			errors++;
+	}
+	fclose(config);
+	
+	/* keep the thread limits sane */
+	if(min_threads < 1)
+		min_threads = 1;
+	if(max_threads < min_threads)
+		max_threads = min_threads;
+	if(refresh_threads < 1)
+		refresh_threads = 1;
+	for(db = 0; db < DB_COUNT; db++)
+	{
+		if(max_stale[db] < grace_period[db])
+			max_stale[db] = grace_period[db];
+		if(max_refreshes[db] < 1)
+			max_refreshes[db] = 1;
+		if(suggested_size[db] < 1)
+			suggested_size[db] = 1;
+	}
+	
+	return errors ? -1 : 0;
+}
@@ -0,0 +1,449 @@
+/* This file is part of gnscd, a complete nscd replacement.
+ * Copyright (C) 2006 Google. Licensed under the GPL version 2. */
+
+/* gnscd is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; version 2 of the License.
+ * 
+ * gnscd is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ * 
+ * You can download the GNU General Public License from the GNU website
+ * at http://www.gnu.org/ or write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA. */
+
+#include <stdio.h>
+#include <errno.h>
+#include <string.h>
+#include <strings.h>
+#include <stdint.h>
+#include <netdb.h>
+#include <resolv.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <arpa/nameser.h>
+
+#include "nscd.h"
+#include "misc.h"
+#include "dns.h"
+
+#define NSSWITCH_CONF "/etc/nsswitch.conf"
+#define HOSTS_FILE "/etc/hosts"
+
+/* what the hosts line of nsswitch.conf says, read again when the file changes */
+static pthread_mutex_t nsswitch_mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct stat nsswitch_stat;
+static int nsswitch_read = 0;
+static int hosts_dns_only = 0;
+
+/* Return 1 if the hosts line is "files dns" or "dns", with no actions. */
+static int read_nsswitch(void)
+{
+	char line[512];
+	FILE * file = fopen(NSSWITCH_CONF, "r");
+	int result = 0;
+	
+	/* without the file, glibc falls back to DNS and then the files */
+	if(!file)
+		return 0;
+	while(fgets(line, sizeof(line), file))
+	{
+		char * sources[3];
+		char * source;
+		char * save;
+		int count = 0;
+		
+		line[strcspn(line, "#\n")] = 0;
+		source = line + strspn(line, " \t");
+		if(strncmp(source, "hosts", 5))
+			continue;
+		source += 5 + strspn(source + 5, " \t");
+		if(*source != ':')
+			continue;
+		for(source = strtok_r(source + 1, " \t", &save); source && count < 3; source = strtok_r(NULL, " \t", &save))
+			sources[count++] = source;
+		if(count == 1)
+			result = !strcmp(sources[0], "dns");
+		else if(count == 2)
+			result = !strcmp(sources[0], "files") && !strcmp(sources[1], "dns");
+		break;
+	}
+	fclose(file);
+	return result;
+}
+
+static int nsswitch_dns_only(void)
+{
+	struct stat st;
+	int result;
+	
+	if(stat(NSSWITCH_CONF, &st) < 0)
+		memset(&st, 0, sizeof(st));
+	pthread_mutex_lock(&nsswitch_mutex);
+	if(!nsswitch_read || st.st_ino != nsswitch_stat.st_ino || st.st_mtime != nsswitch_stat.st_mtime || st.st_size != nsswitch_stat.st_size)
+	{
+		hosts_dns_only = read_nsswitch();
+		nsswitch_stat = st;
+		nsswitch_read = 1;
+	}
+	result = hosts_dns_only;
+	pthread_mutex_unlock(&nsswitch_mutex);
+	return result;
+}
+
+/* Return 1 if /etc/hosts has the name or address of a host request in it, or
+ * if it can't be read, which is left to the name service to sort out. This is
+ * the same pass through the file that the name service would make. */
+static int hosts_listed(request_header * req, const void * key)
+{
+	char line[1024];
+	unsigned char address[NS_IN6ADDRSZ];
+	int by_address = (req->type == GETHOSTBYADDR || req->type == GETHOSTBYADDRv6);
+	int family = (req->type == GETHOSTBYADDR) ? AF_INET : AF_INET6;
+	FILE * file = fopen(HOSTS_FILE, "r");
+	int found = 0;
+	
+	if(!file)
+		return errno != ENOENT;
+	while(!found && fgets(line, sizeof(line), file))
+	{
+		char * token;
+		char * save;
+		
+		line[strcspn(line, "#\n")] = 0;
+		token = strtok_r(line, " \t", &save);
+		if(!token)
+			continue;
+		if(by_address)
+		{
+			found = inet_pton(family, token, address) == 1 && !memcmp(address, key, req->key_len);
+			continue;
+		}
+		while(!found && (token = strtok_r(NULL, " \t", &save)))
+			found = !strcasecmp(token, key);
+	}
+	if(ferror(file))
+		found = 1;
+	fclose(file);
+	return found;
+}
+
+int dns_only(request_header * req, const void * key)
+{
+	struct in_addr ipv4;
+	unsigned char ipv6[NS_IN6ADDRSZ];
+	
+	if(req->type != GETHOSTBYADDR && req->type != GETHOSTBYADDRv6)
+	{
+		/* the name service answers addresses itself */
+		if(!*(const char *) key || inet_aton(key, &ipv4) || inet_pton(AF_INET6, key, ipv6) == 1)
+			return 0;
+	}
+	return nsswitch_dns_only() && !hosts_listed(req, key);
+}
+
+/* Return the length of a response, worked out from its records, since the
+ * resolver doesn't say when it also tells us that the name wasn't found. */
+static int packet_length(const unsigned char * packet, int size)
+{
+	const unsigned char * end = packet + size;
+	const unsigned char * p = packet + NS_HFIXEDSZ;
+	int i, count, length;
+	
+	if(size < NS_HFIXEDSZ)
+		return -1;
+	count = ns_get16(packet + 4);
+	for(i = 0; i < count; i++)
+	{
+		length = dn_skipname(p, end);
+		if(length < 0 || end - p < length + NS_QFIXEDSZ)
+			return -1;
+		p += length + NS_QFIXEDSZ;
+	}
+	count = ns_get16(packet + 6) + ns_get16(packet + 8) + ns_get16(packet + 10);
+	for(i = 0; i < count; i++)
+	{
+		length = dn_skipname(p, end);
+		if(length < 0 || end - p < length + NS_RRFIXEDSZ)
+			return -1;
+		p += length + NS_RRFIXEDSZ;
+		length = ns_get16(p - 2);
+		if(end - p < length)
+			return -1;
+		p += length;
+	}
+	return p - packet;
+}
+
+/* Return the negative TTL of a response saying that a name doesn't exist, or
+ * has no records of the type asked for: the smaller of the TTL of the SOA
+ * record in its authority section and the SOA's minimum field. Return -1 if
+ * it is some other response, or has no SOA record. */
+static long negative_answer_ttl(const unsigned char * answer, int length)
+{
+	ns_msg msg;
+	ns_rr rr;
+	int i;
+	
+	if(ns_initparse(answer, length, &msg) < 0)
+		return -1;
+	if(ns_msg_getflag(msg, ns_f_rcode) != ns_r_nxdomain && ns_msg_getflag(msg, ns_f_rcode) != ns_r_noerror)
+		return -1;
+	for(i = 0; i < ns_msg_count(msg, ns_s_ns); i++)
+	{
+		long minimum;
+		if(ns_parserr(&msg, ns_s_ns, i, &rr) < 0)
+			return -1;
+		if(ns_rr_type(rr) != ns_t_soa)
+			continue;
+		/* the minimum is the last of the five numbers after the two
+		 * names in the SOA data */
+		if(ns_rr_rdlen(rr) < 2 + 5 * NS_INT32SZ)
+			return -1;
+		minimum = ns_get32(ns_rr_rdata(rr) + ns_rr_rdlen(rr) - NS_INT32SZ);
+		return (ns_rr_ttl(rr) < minimum) ? ns_rr_ttl(rr) : minimum;
+	}
+	return -1;
+}
+
+/* Copy a name into the host. Return NULL if there is no room left. */
+static char * host_string(struct dns_host * host, const char * name)
+{
+	size_t length = strlen(name) + 1;
+	char * copy = host->names + host->names_used;
+	if(length > sizeof(host->names) - host->names_used)
+		return NULL;
+	memcpy(copy, name, length);
+	host->names_used += length;
+	return copy;
+}
+
+static void host_alias(struct dns_host * host, const char * name)
+{
+	int i;
+	if(host->name && !strcasecmp(host->name, name))
+		return;
+	for(i = 0; i < host->aliases; i++)
+		if(!strcasecmp(host->alias[i], name))
+			return;
+	/* leave room for the name of the host, which comes after its aliases */
+	if(!host->name && strlen(name) + 1 + NS_MAXDNAME > sizeof(host->names) - host->names_used)
+		return;
+	if(host->aliases < DNS_MAXALIASES && (host->alias[host->aliases] = host_string(host, name)))
+		host->aliases++;
+}
+
+static void host_address(struct dns_host * host, int family, const unsigned char * address)
+{
+	size_t length = (family == AF_INET) ? NS_INADDRSZ : NS_IN6ADDRSZ;
+	int i;
+	for(i = 0; i < host->addrs; i++)
+		if(host->family[i] == family && !memcmp(host->address[i], address, length))
+			return;
+	if(host->addrs == DNS_MAXADDRS)
+		return;
+	host->family[host->addrs] = family;
+	memcpy(host->address[host->addrs++], address, length);
+}
+
+/* Add the answer records of a response to the host: the names of the CNAME
+ * records that led to the answer become aliases, and the name of the first
+ * answer becomes the name of the host. Return the number of answers of the
+ * type asked for, or -1 if the response can't be read, and keep the smallest
+ * TTL of the records used in *ttl. */
+static int answer_records(const unsigned char * answer, int length, int type, struct dns_host * host, long * ttl)
+{
+	char name[NS_MAXDNAME];
+	ns_msg msg;
+	ns_rr rr;
+	int i, found = 0;
+	
+	*ttl = -1;
+	if(ns_initparse(answer, length, &msg) < 0)
+		return -1;
+	for(i = 0; i < ns_msg_count(msg, ns_s_an); i++)
+	{
+		if(ns_parserr(&msg, ns_s_an, i, &rr) < 0)
+			return -1;
+		if(ns_rr_class(rr) != ns_c_in)
+			continue;
+		if(ns_rr_type(rr) == ns_t_cname)
+			host_alias(host, ns_rr_name(rr));
+		else if(ns_rr_type(rr) != type)
+			continue;
+		else if(type == ns_t_ptr)
+		{
+			if(ns_name_uncompress(ns_msg_base(msg), ns_msg_end(msg), ns_rr_rdata(rr), name, sizeof(name)) < 0)
+				return -1;
+			if(!host->name)
+				host->name = host_string(host, name);
+			else
+				host_alias(host, name);
+			found++;
+		}
+		else
+		{
+			int family = (type == ns_t_a) ? AF_INET : AF_INET6;
+			if(ns_rr_rdlen(rr) != ((family == AF_INET) ? NS_INADDRSZ : NS_IN6ADDRSZ))
+				continue;
+			if(!host->name)
+				host->name = host_string(host, ns_rr_name(rr));
+			host_address(host, family, ns_rr_rdata(rr));
+			found++;
+		}
+		if(*ttl < 0 || ns_rr_ttl(rr) < *ttl)
+			*ttl = ns_rr_ttl(rr);
+	}
+	return found;
+}
+
+/* Ask for one type of record, with the search list applied if the name service
+ * would apply it. Return the h_errno of the lookup, and the TTL of what it
+ * found or of the name not being there in *ttl, or -1 if DNS didn't say. */
+static int dns_query(res_state state, const char * name, int type, int search, struct dns_host * host, long * ttl)
+{
+	unsigned char answer[NS_MAXMSG];
+	int length, found;
+	
+	*ttl = -1;
+	/* if nothing came back, this is an empty response */
+	memset(answer, 0, NS_HFIXEDSZ);
+	if(search)
+		length = res_nsearch(state, name, ns_c_in, type, answer, sizeof(answer));
+	else
+		length = res_nquery(state, name, ns_c_in, type, answer, sizeof(answer));
+	if(length < 0)
+	{
+		/* the response kept is the last one tried, so with a search list
+		 * this is the SOA of the last domain the name was looked for in */
+		if(state->res_h_errno != HOST_NOT_FOUND && state->res_h_errno != NO_DATA)
+			return state->res_h_errno;
+		length = packet_length(answer, sizeof(answer));
+		if(length >= 0)
+			*ttl = negative_answer_ttl(answer, length);
+		return state->res_h_errno;
+	}
+	if(length > sizeof(answer))
+		length = sizeof(answer);
+	found = answer_records(answer, length, type, host, ttl);
+	if(found < 0)
+		return NO_RECOVERY;
+	if(!found)
+	{
+		*ttl = negative_answer_ttl(answer, length);
+		return NO_DATA;
+	}
+	return NETDB_SUCCESS;
+}
+
+/* Work out the name to look up and the record types to ask for. */
+static int dns_question(request_header * req, const void * key, char * name, size_t size, int * types)
+{
+	const unsigned char * address = (const unsigned char *) key;
+	size_t length = 0;
+	int i;
+	
+	types[1] = -1;
+	switch(req->type)
+	{
+		case GETHOSTBYNAME:
+			types[0] = ns_t_a;
+			break;
+		case GETHOSTBYNAMEv6:
+			types[0] = ns_t_aaaa;
+			break;
+		case GETAI:
+			types[0] = ns_t_a;
+			types[1] = ns_t_aaaa;
+			break;
+		case GETHOSTBYADDR:
+			types[0] = ns_t_ptr;
+			snprintf(name, size, "%u.%u.%u.%u.in-addr.arpa", address[3], address[2], address[1], address[0]);
+			return 0;
+		case GETHOSTBYADDRv6:
+			types[0] = ns_t_ptr;
+			for(i = NS_IN6ADDRSZ - 1; i >= 0; i--)
+				length += snprintf(name + length, size - length, "%x.%x.", address[i] & 0xf, address[i] >> 4);
+			snprintf(name + length, size - length, "ip6.arpa");
+			return 0;
+		default:
+			return -1;
+	}
+	if(strlen(key) >= size)
+		return -1;
+	strcpy(name, key);
+	return 0;
+}
+
+/* How good an answer is, when GETAI gets one for each type. */
+static int error_rank(int error)
+{
+	switch(error)
+	{
+		case NETDB_SUCCESS:
+			return 4;
+		case TRY_AGAIN:
+			return 3;
+		case NO_DATA:
+			return 1;
+		case HOST_NOT_FOUND:
+			return 0;
+		default:
+			return 2;
+	}
+}
+
+time_t dns_clamp(long ttl)
+{
+	if(ttl < dns_min_ttl)
+		return dns_min_ttl;
+	if(ttl > dns_max_ttl)
+		return dns_max_ttl;
+	return ttl;
+}
+
+int dns_lookup(res_state state, request_header * req, const void * key, struct dns_host * host)
+{
+	char name[NS_MAXDNAME];
+	int by_address = (req->type == GETHOSTBYADDR || req->type == GETHOSTBYADDRv6);
+	int types[2];
+	int i, error, negatives = 0;
+	long ttl, negative_ttl = -1;
+	
+	if(dns_question(req, key, name, sizeof(name), types) < 0)
+		return -1;
+	host->error = HOST_NOT_FOUND;
+	host->ttl = -1;
+	host->name = NULL;
+	host->aliases = 0;
+	host->addrs = 0;
+	host->names_used = 0;
+	
+	for(i = 0; i < 2 && types[i] >= 0; i++)
+	{
+		error = dns_query(state, name, types[i], !by_address, host, &ttl);
+		if(error == NETDB_SUCCESS)
+		{
+			if(host->ttl < 0 || (ttl >= 0 && ttl < host->ttl))
+				host->ttl = ttl;
+		}
+		/* a name is only kept as long as all its answers say */
+		else if(!negatives++ || (negative_ttl >= 0 && ttl < negative_ttl))
+			negative_ttl = ttl;
+		if(error_rank(error) > error_rank(host->error))
+			host->error = error;
+	}
+	if(host->error != NETDB_SUCCESS)
+		host->ttl = (host->error == HOST_NOT_FOUND || host->error == NO_DATA) ? negative_ttl : -1;
+	else if(by_address)
+		host_address(host, (req->type == GETHOSTBYADDR) ? AF_INET : AF_INET6, key);
+	else if(!host->name)
+		host->name = host_string(host, name);
+	if(debug)
+		printf("DNS says [%s] may be kept for %ld seconds\n", name, host->ttl);
+	return 0;
+}
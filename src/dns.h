@@ -0,0 +1,66 @@
+/* This file is part of gnscd, a complete nscd replacement.
+ * Copyright (C) 2006 Google. Licensed under the GPL version 2. */
+
+/* gnscd is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; version 2 of the License.
+ * 
+ * gnscd is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ * 
+ * You can download the GNU General Public License from the GNU website
+ * at http://www.gnu.org/ or write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA. */
+
+
+#ifndef __DNS_H
+#define __DNS_H
+
+#include <time.h>
+#include <resolv.h>
+#include <arpa/nameser.h>
+
+#include "nscd.h"
+
+/* Host entries which came from DNS are kept for as long as the TTLs of the
+ * records they came from say, clamped to dns-min-time-to-live and
+ * dns-max-time-to-live, and names which don't exist for as long as the SOA
+ * record sent with the answer says (RFC 2308). The name service doesn't tell
+ * us the TTLs, so when it would only have asked DNS anyway, we ask DNS
+ * ourselves and build the reply from the response. */
+
+#define DNS_MAXALIASES 16
+#define DNS_MAXADDRS 64
+
+/* a host found in DNS, in the order the resolver would give it */
+struct dns_host {
+	/* NETDB_SUCCESS, HOST_NOT_FOUND, NO_DATA or TRY_AGAIN */
+	int error;
+	/* -1 if DNS didn't say */
+	long ttl;
+	char * name;
+	int aliases;
+	char * alias[DNS_MAXALIASES];
+	int addrs;
+	int family[DNS_MAXADDRS];
+	unsigned char address[DNS_MAXADDRS][NS_IN6ADDRSZ];
+	size_t names_used;
+	char names[NS_MAXDNAME * 4];
+};
+
+/* Return 1 if the name service would only find a host request in DNS: hosts
+ * come from "files dns" or just "dns" in nsswitch.conf, and the key is not in
+ * /etc/hosts. */
+extern int dns_only(request_header * req, const void * key);
+
+/* Look up a host request in DNS with the resolver state given. Return -1 if
+ * the request can't be asked in DNS, or 0 and fill in the host, which may say
+ * that it wasn't found. */
+extern int dns_lookup(res_state state, request_header * req, const void * key, struct dns_host * host);
+
+/* Keep a TTL between the configured limits. */
+extern time_t dns_clamp(long ttl);
+
+#endif /* __DNS_H */
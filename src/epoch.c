@@ -0,0 +1,205 @@
+/* This file is part of gnscd, a complete nscd replacement.
+ * Copyright (C) 2006 Google. Licensed under the GPL version 2. */
+
+/* gnscd is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; version 2 of the License.
+ * 
+ * gnscd is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ * 
+ * You can download the GNU General Public License from the GNU website
+ * at http://www.gnu.org/ or write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+
+#include "misc.h"
+#include "epoch.h"
+
+/* Each thread which reads gets a reader slot, which records the global epoch
+ * it saw when it entered its critical section (or 0 when it is outside one).
+ * The global epoch can only advance when every active reader has seen the
+ * current one. Objects retired in epoch E are destroyed once the global epoch
+ * reaches E + 2, since by then every reader that was active in epoch E has
+ * left its critical section. Slots are never freed, but they are reused when
+ * their threads exit. */
+struct epoch_reader {
+	volatile unsigned long epoch;
+	int nesting;
+	int in_use;
+	struct epoch_reader * next;
+};
+
+struct retired {
+	void (*destroy)(void *);
+	void * object;
+	unsigned long epoch;
+	struct retired * next;
+};
+
+/* when this many objects are waiting, epoch_retire() tries to reclaim them */
+#define RECLAIM_THRESHOLD 256
+
+static volatile unsigned long global_epoch = 1;
+static struct epoch_reader * readers = NULL;
+static pthread_mutex_t readers_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t reader_key;
+static pthread_once_t reader_once = PTHREAD_ONCE_INIT;
+
+static struct retired * retired_head = NULL;
+static struct retired ** retired_tail = &retired_head;
+static unsigned long retired_count = 0;
+static pthread_mutex_t retired_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static __thread struct epoch_reader * self = NULL;
+
+static void reader_release(void * arg)
+{
+	struct epoch_reader * reader = arg;
+	reader->epoch = 0;
+	reader->nesting = 0;
+	__sync_synchronize();
+	reader->in_use = 0;
+}
+
+static void reader_key_init(void)
+{
+	pthread_key_create(&reader_key, reader_release);
+}
+
+static struct epoch_reader * reader_get(void)
+{
+	struct epoch_reader * reader;
+	if(self)
+		return self;
+	
+	pthread_once(&reader_once, reader_key_init);
+	pthread_mutex_lock(&readers_mutex);
+	for(reader = readers; reader; reader = reader->next)
+		if(!reader->in_use)
+			break;
+	if(!reader)
+	{
+		/* if this fails there is nothing sensible we can do */
+		reader = calloc(1, sizeof(*reader));
+		if(!reader)
+			abort();
+		reader->next = readers;
+		/* epoch_advance() walks the list without the lock */
+		__atomic_store_n(&readers, reader, __ATOMIC_RELEASE);
+	}
+	reader->in_use = 1;
+	pthread_mutex_unlock(&readers_mutex);
+	
+	pthread_setspecific(reader_key, reader);
+	self = reader;
+	return reader;
+}
+
+void epoch_enter(void)
+{
+	struct epoch_reader * reader = reader_get();
+	if(reader->nesting++)
+		return;
+	reader->epoch = global_epoch;
+	/* our epoch must be visible before we read anything shared */
+	__sync_synchronize();
+}
+
+void epoch_exit(void)
+{
+	struct epoch_reader * reader = self;
+	if(--reader->nesting)
+		return;
+	__atomic_store_n(&reader->epoch, 0, __ATOMIC_RELEASE);
+}
+
+/* MUST BE CALLED WITH THE RETIRED LOCK HELD */
+static void epoch_advance(void)
+{
+	struct epoch_reader * reader;
+	unsigned long epoch = global_epoch;
+	
+	__sync_synchronize();
+	for(reader = __atomic_load_n(&readers, __ATOMIC_ACQUIRE); reader; reader = reader->next)
+	{
+		unsigned long seen = reader->epoch;
+		if(seen && seen != epoch)
+			/* somebody is still in an older epoch */
+			return;
+	}
+	__sync_synchronize();
+	global_epoch = epoch + 1;
+}
+
+int epoch_retire(void (*destroy)(void *), void * object)
+{
+	struct retired * retired = malloc(sizeof(*retired));
+	int reclaim;
+	if(!retired)
+	{
+		/* Not much we can do here, but leaking the object is better
+		 * than freeing it while somebody might be reading it. */
+		if(debug)
+			printf("Leaking retired object %p\n", object);
+		return -1;
+	}
+	retired->destroy = destroy;
+	retired->object = object;
+	retired->next = NULL;
+	
+	pthread_mutex_lock(&retired_mutex);
+	retired->epoch = global_epoch;
+	*retired_tail = retired;
+	retired_tail = &retired->next;
+	reclaim = ++retired_count >= RECLAIM_THRESHOLD;
+	pthread_mutex_unlock(&retired_mutex);
+	
+	if(reclaim)
+		epoch_reclaim();
+	return 0;
+}
+
+void epoch_reclaim(void)
+{
+	struct retired * done = NULL;
+	struct retired ** done_tail = &done;
+	
+	pthread_mutex_lock(&retired_mutex);
+	epoch_advance();
+	/* the list is in order of retirement, so the oldest are first */
+	while(retired_head && retired_head->epoch + 2 <= global_epoch)
+	{
+		*done_tail = retired_head;
+		done_tail = &retired_head->next;
+		retired_head = retired_head->next;
+		retired_count--;
+	}
+	*done_tail = NULL;
+	if(!retired_head)
+		retired_tail = &retired_head;
+	pthread_mutex_unlock(&retired_mutex);
+	
+	/* destroy them without holding the lock */
+	while(done)
+	{
+		struct retired * next = done->next;
+		done->destroy(done->object);
+		free(done);
+		done = next;
+	}
+}
+
+unsigned long epoch_pending(void)
+{
+	unsigned long count;
+	pthread_mutex_lock(&retired_mutex);
+	count = retired_count;
+	pthread_mutex_unlock(&retired_mutex);
+	return count;
+}
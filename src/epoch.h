@@ -0,0 +1,40 @@
+/* This file is part of gnscd, a complete nscd replacement.
+ * Copyright (C) 2006 Google. Licensed under the GPL version 2. */
+
+/* gnscd is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; version 2 of the License.
+ * 
+ * gnscd is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ * 
+ * You can download the GNU General Public License from the GNU website
+ * at http://www.gnu.org/ or write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA. */
+
+#ifndef __EPOCH_H
+#define __EPOCH_H
+
+/* Epoch-based reclamation lets threads read shared data structures without
+ * taking locks. A reader brackets its accesses with epoch_enter() and
+ * epoch_exit(). A writer which unlinks an object from a shared structure
+ * passes it to epoch_retire() instead of freeing it, and it is destroyed once
+ * every reader which might still be looking at it has called epoch_exit(). */
+
+/* Start and end a read-side critical section. These may be nested. */
+extern void epoch_enter(void);
+extern void epoch_exit(void);
+
+/* Call destroy(object) once no reader can still be using it. */
+extern int epoch_retire(void (*destroy)(void *), void * object);
+
+/* Destroy retired objects which are no longer in use. This is also called by
+ * epoch_retire() when a lot of objects are waiting. */
+extern void epoch_reclaim(void);
+
+/* Return the number of retired objects not yet destroyed. */
+extern unsigned long epoch_pending(void);
+
+#endif /* __EPOCH_H */
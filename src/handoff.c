@@ -0,0 +1,176 @@
+/* This file is part of gnscd, a complete nscd replacement.
+ * Copyright (C) 2006 Google. Licensed under the GPL version 2. */
+
+/* gnscd is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; version 2 of the License.
+ * 
+ * gnscd is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ * 
+ * You can download the GNU General Public License from the GNU website
+ * at http://www.gnu.org/ or write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA. */
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/poll.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+
+#include "nscd.h"
+#include "misc.h"
+#include "cache.h"
+#include "handoff.h"
+
+/* how long, in milliseconds, the old gnscd waits for the new one to load the
+ * cache and start up before it gives up and carries on */
+#define HANDOFF_TIMEOUT 60000
+
+/* the most sockets we hand over, plus the snapshot */
+#define HANDOFF_FDS 8
+
+/* sent as the key of a HANDOFF request, so that nothing but a new gnscd can
+ * ask for the sockets by mistake */
+#define HANDOFF_KEY "gnscd-handoff-1"
+
+/* the snapshot goes in a memfd, or else in a deleted file */
+static int handoff_snapshot(void)
+{
+	int fd = -1;
+#ifdef MFD_CLOEXEC
+	fd = memfd_create("gnscd-handoff", MFD_CLOEXEC);
+#endif
+	if(fd < 0)
+	{
+		fd = open(GNSCD_SNAPSHOT ".handoff", O_RDWR | O_CREAT | O_TRUNC, 0600);
+		unlink(GNSCD_SNAPSHOT ".handoff");
+	}
+	if(fd >= 0 && cache_write(fd) < 0)
+	{
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+int handoff_request(request_header * req, const void * key)
+{
+	return req->type == HANDOFF && req->key_len == sizeof(HANDOFF_KEY) && !memcmp(key, HANDOFF_KEY, sizeof(HANDOFF_KEY));
+}
+
+int handoff_send(int client, int * socks, int count)
+{
+	union {
+		struct cmsghdr header;
+		char bytes[CMSG_SPACE(sizeof(int) * HANDOFF_FDS)];
+	} control;
+	struct cmsghdr * cmsg;
+	struct msghdr msg;
+	struct iovec iov;
+	struct pollfd pfd;
+	int32_t sent = count;
+	int fds[HANDOFF_FDS];
+	char ready;
+	int r;
+	
+	if(count >= HANDOFF_FDS)
+		return -1;
+	memcpy(fds, socks, sizeof(*socks) * count);
+	fds[count] = handoff_snapshot();
+	if(fds[count] < 0)
+		return -1;
+	
+	iov.iov_base = &sent;
+	iov.iov_len = sizeof(sent);
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control.bytes;
+	msg.msg_controllen = CMSG_LEN(sizeof(int) * (count + 1));
+	cmsg = CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(sizeof(int) * (count + 1));
+	memcpy(CMSG_DATA(cmsg), fds, sizeof(int) * (count + 1));
+	r = sendmsg(client, &msg, MSG_NOSIGNAL);
+	close(fds[count]);
+	if(r < 0)
+		return -1;
+	
+	/* keep serving clients until the new gnscd is ready for them */
+	if(debug)
+		printf("Handed off to client %d, waiting for it to start\n", client);
+	pfd.fd = client;
+	pfd.events = POLLIN;
+	while((r = poll(&pfd, 1, HANDOFF_TIMEOUT)) < 0 && errno == EINTR);
+	if(r != 1 || read(client, &ready, 1) != 1)
+		return -1;
+	return 0;
+}
+
+int handoff_receive(int * socks, int count, int * snapshot)
+{
+	struct {
+		request_header req;
+		char key[sizeof(HANDOFF_KEY)];
+	} request = {{version: NSCD_VERSION, type: HANDOFF, key_len: sizeof(HANDOFF_KEY)}, HANDOFF_KEY};
+	union {
+		struct cmsghdr header;
+		char bytes[CMSG_SPACE(sizeof(int) * HANDOFF_FDS)];
+	} control;
+	struct cmsghdr * cmsg;
+	struct msghdr msg;
+	struct iovec iov;
+	struct sockaddr_un sun;
+	int32_t sent;
+	int sock, r;
+	
+	sock = socket(PF_UNIX, SOCK_STREAM, 0);
+	if(sock < 0)
+		return -1;
+	sun.sun_family = AF_UNIX;
+	strcpy(sun.sun_path, NSCD_SOCKET);
+	if(connect(sock, (struct sockaddr *) &sun, sizeof(sun)) < 0 || write(sock, &request, sizeof(request)) != sizeof(request))
+	{
+		close(sock);
+		return -1;
+	}
+	
+	iov.iov_base = &sent;
+	iov.iov_len = sizeof(sent);
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control.bytes;
+	msg.msg_controllen = sizeof(control.bytes);
+	while((r = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC)) < 0 && errno == EINTR);
+	cmsg = CMSG_FIRSTHDR(&msg);
+	if(r != sizeof(sent) || sent != count || !cmsg || cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS || cmsg->cmsg_len != CMSG_LEN(sizeof(int) * (count + 1)))
+	{
+		/* an old gnscd which doesn't know how just closes the connection */
+		close(sock);
+		return -1;
+	}
+	memcpy(socks, CMSG_DATA(cmsg), sizeof(int) * count);
+	memcpy(snapshot, (int *) CMSG_DATA(cmsg) + count, sizeof(int));
+	return sock;
+}
+
+void handoff_ready(int sock)
+{
+	char ready = 1;
+	write(sock, &ready, 1);
+	close(sock);
+}
@@ -0,0 +1,44 @@
+/* This file is part of gnscd, a complete nscd replacement.
+ * Copyright (C) 2006 Google. Licensed under the GPL version 2. */
+
+/* gnscd is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; version 2 of the License.
+ * 
+ * gnscd is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ * 
+ * You can download the GNU General Public License from the GNU website
+ * at http://www.gnu.org/ or write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA. */
+
+#ifndef __HANDOFF_H
+#define __HANDOFF_H
+
+#include "nscd.h"
+
+/* A new gnscd can take over from a running one without the sockets ever going
+ * away. The new one sends a HANDOFF request, and the old one answers with its
+ * listening sockets and a snapshot of its cache, passed as file descriptors.
+ * The old one keeps serving clients until the new one says it is ready, and
+ * then stops accepting new clients, finishes with the ones it has, and exits.
+ * Nothing is unlinked, and the new gnscd starts with a warm cache. */
+
+/* Return 1 if a request is a new gnscd asking to take over. */
+extern int handoff_request(request_header * req, const void * key);
+
+/* Send the listening sockets and a snapshot of the cache to the new gnscd on
+ * the other end of client, and return 0 once it is ready to take over, or -1
+ * if it can't. */
+extern int handoff_send(int client, int * socks, int count);
+
+/* Ask the running gnscd for its listening sockets and a snapshot of its cache.
+ * Returns the connection to tell it when we are ready, or -1. */
+extern int handoff_receive(int * socks, int count, int * snapshot);
+
+/* Tell the old gnscd that we are ready to serve clients. */
+extern void handoff_ready(int sock);
+
+#endif /* __HANDOFF_H */
@@ -0,0 +1,96 @@
+/* This file is part of gnscd, a complete nscd replacement.
+ * Copyright (C) 2006 Google. Licensed under the GPL version 2. */
+
+/* gnscd is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; version 2 of the License.
+ * 
+ * gnscd is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ * 
+ * You can download the GNU General Public License from the GNU website
+ * at http://www.gnu.org/ or write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA. */
+
+#ifndef __HASH_H
+#define __HASH_H
+
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+/* This hash works a word at a time, in the style of wyhash: each 8 bytes of
+ * the key are mixed in with a 64x64 to 128 bit multiply, whose halves are then
+ * folded together. Unlike a byte at a time hash, similar keys like numbers in
+ * sequence end up far apart. The seed is picked randomly at startup, so that
+ * clients can't pick keys that all land in the same part of the cache. */
+#define HASH_P0 0xa0761d6478bd642fULL
+#define HASH_P1 0xe7037ed1a0b428dbULL
+#define HASH_P2 0x8ebc6af09c88c6e3ULL
+
+static inline uint64_t hash_mix(uint64_t a, uint64_t b)
+{
+	__uint128_t product = (__uint128_t) a * b;
+	return (uint64_t) product ^ (uint64_t) (product >> 64);
+}
+
+static inline uint64_t hash_read64(const uint8_t * key)
+{
+	uint64_t word;
+	memcpy(&word, key, sizeof(word));
+	return word;
+}
+
+static inline uint64_t hash_read32(const uint8_t * key)
+{
+	uint32_t word;
+	memcpy(&word, key, sizeof(word));
+	return word;
+}
+
+/* Read 1 to 8 bytes of the key into a word. Shorter reads overlap rather than
+ * copying a byte at a time, since the length is mixed in at the end anyway. */
+static inline uint64_t hash_read(const uint8_t * key, int32_t length)
+{
+	if(length == 8)
+		return hash_read64(key);
+	if(length >= 4)
+		return (hash_read32(key) << 32) | hash_read32(key + length - 4);
+	return ((uint64_t) key[0] << 16) | ((uint64_t) key[length >> 1] << 8) | key[length - 1];
+}
+
+static inline uint64_t word_hash64(const uint8_t * key, int32_t key_len, uint64_t seed)
+{
+	uint64_t hash = seed ^ HASH_P0;
+	int32_t left = key_len;
+	for(; left > 8; left -= 8, key += 8)
+		hash = hash_mix(hash_read(key, 8) ^ HASH_P1, hash ^ HASH_P2);
+	if(left > 0)
+		hash = hash_mix(hash_read(key, left) ^ HASH_P1, hash ^ HASH_P2);
+	return hash_mix(hash ^ HASH_P0, (uint64_t) key_len ^ HASH_P1);
+}
+
+/* the cache uses 32 bit hashes */
+static inline uint32_t word_hash(const uint8_t * key, int32_t key_len, uint64_t seed)
+{
+	uint64_t hash = word_hash64(key, key_len, seed);
+	return (uint32_t) (hash ^ (hash >> 32));
+}
+
+static inline uint64_t hash_random_seed(void)
+{
+	uint64_t seed;
+	int fd = open("/dev/urandom", O_RDONLY);
+	if(fd < 0 || read(fd, &seed, sizeof(seed)) != sizeof(seed))
+		/* not very random, but it will do */
+		seed = ((uint64_t) time(NULL) << 32) ^ getpid();
+	if(fd >= 0)
+		close(fd);
+	return seed;
+}
+
+#endif /* __HASH_H */
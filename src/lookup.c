@@ -24,49 +24,109 @@
 #include <stdint.h>
 #include <netdb.h>
 #include <pthread.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
 #include <arpa/nameser.h>
+#include <resolv.h>
 
 #include "nscd.h"
 #include "misc.h"
 #include "cache.h"
 #include "lookup.h"
+#include "negative.h"
+#include "epoch.h"
+#include "dns.h"
 
 /* The functions in this file actually generate replies in response to queries.
  * Also the background thread that handles GET*ENT queries is in this file. */
 
-/* This structure is used to communicate between the query threads and the
- * background GET*ENT thread(s). When a background thread is started, it begins
- * iterating through either users or groups and adding entries to the cache.
- * When it has fetched the one that the query was interested in, it wakes up the
- * query thread that originally started it so that the reply can be sent to the
- * client before the iteration is finished. Later, additional queries may arrive
- * and wait for other indices in the iteration, and they too will be woken up
- * when the desired index has been added to the cache. Only one such background
- * thread will exist at a time for each service (passwd, group). */
+/* GET*ENT requests are answered from a snapshot of the whole database: an
+ * array of replies, one for each user or group, built by a single background
+ * iteration. Clients ask for entries by index, and any number of them can read
+ * a finished snapshot at once without taking a lock. While a new snapshot is
+ * being built, clients wait for the index they want to be added to it, so they
+ * don't have to wait for the whole iteration. When it is finished, it replaces
+ * the old one, which is freed once nobody is reading it. Only one iteration
+ * runs at a time for each service (passwd, group). */
+struct ent_snapshot {
+	time_t expire_time;
+	/* the reply to GET*ALL, with all the others in one buffer */
+	void * all;
+	/* for group snapshots, the groups of each user, see below */
+	struct member_index * members;
+	/* the last reply says there are no more entries */
+	int count, size;
+	void * replies[0];
+};
+
+/* The groups of each user, built from the members of every group in a group
+ * snapshot, so that INITGROUPS can be answered without getgrouplist() going
+ * through all the groups again for each user. Users who are not in the index
+ * are still looked up with getgrouplist(). The users are sorted by name, and
+ * everything is in one allocation with the index. */
+struct member_user {
+	const char * name;
+	int first, count;
+};
+
+struct member_index {
+	int users;
+	struct member_user * user;
+	gid_t * gids;
+};
+
+/* a user and one of their groups, collected while the snapshot is built */
+struct member_pair {
+	char * name;
+	gid_t gid;
+};
+
+struct member_builder {
+	int count, size;
+	struct member_pair * pairs;
+};
+
 struct ent_info {
 	request_type type;
-	int thread_busy, wait_index;
-	pthread_mutex_t query_mutex;
+	int thread_busy;
+	/* the published snapshot, and the one being built */
+	struct ent_snapshot * current;
+	struct ent_snapshot * building;
+	/* counted so that waiters can tell when a new snapshot is published,
+	 * and so that one started before an invalidation isn't kept */
+	unsigned int published, invalidations;
 	pthread_mutex_t busy_mutex;
 	pthread_cond_t wait_done;
 };
 
 static struct ent_info pwent_info = {
-	GETPWENT, 0, -1,
-	PTHREAD_MUTEX_INITIALIZER,
+	GETPWENT, 0, NULL, NULL, 0, 0,
 	PTHREAD_MUTEX_INITIALIZER,
 	PTHREAD_COND_INITIALIZER};
 static struct ent_info grent_info = {
-	GETGRENT, 0, -1,
-	PTHREAD_MUTEX_INITIALIZER,
+	GETGRENT, 0, NULL, NULL, 0, 0,
 	PTHREAD_MUTEX_INITIALIZER,
 	PTHREAD_COND_INITIALIZER};
 
-/* The query mutex is held by the sleeping query thread which is waiting for the
- * background iteration thread to get to the index it wants. This makes sure
- * there will only be one such query thread at a time. */
-pthread_mutex_t * pwent_query_mutex = &pwent_info.query_mutex;
-pthread_mutex_t * grent_query_mutex = &grent_info.query_mutex;
+/* the raw address of an AF_INET or AF_INET6 addrinfo, as clients want it */
+static const void * ai_address(struct addrinfo * ai)
+{
+	if(ai->ai_family == AF_INET)
+		return &((struct sockaddr_in *) ai->ai_addr)->sin_addr;
+	return &((struct sockaddr_in6 *) ai->ai_addr)->sin6_addr;
+}
+
+static size_t ai_address_length(struct addrinfo * ai)
+{
+	return (ai->ai_family == AF_INET) ? NS_INADDRSZ : NS_IN6ADDRSZ;
+}
+
+static int ai_same_address(struct addrinfo * a, struct addrinfo * b)
+{
+	if(a->ai_family != b->ai_family)
+		return 0;
+	return !memcmp(ai_address(a), ai_address(b), ai_address_length(a));
+}
 
 /* Marshall a passwd structure into the NSCD format. */
 static int marshall_pwd(int error, struct passwd * pwd, void ** reply, int32_t * reply_len, time_t * refresh_interval)
@@ -88,7 +148,7 @@ static int marshall_pwd(int error, struct passwd * pwd, void ** reply, int32_t *
 		header.pw_shell_len = 0;
 		
 		*reply_len = sizeof(header);
-		*reply = malloc(*reply_len);
+		*reply = reply_alloc(*reply_len);
 		if(!*reply)
 			return -1;
 		memcpy(*reply, &header, sizeof(header));
@@ -98,7 +158,7 @@ static int marshall_pwd(int error, struct passwd * pwd, void ** reply, int32_t *
 		 * have to redo the iteration only to find that there still
 		 * aren't any more users. The "error" variable will be 0 only in
 		 * this case - all other cases have an error code. */
-		*refresh_interval = error ? 20 : 600;
+		*refresh_interval = error ? negative_ttl[DB_PASSWD] : positive_ttl[DB_PASSWD];
 	}
 	else
 	{
@@ -119,7 +179,7 @@ static int marshall_pwd(int error, struct passwd * pwd, void ** reply, int32_t *
 		             + header.pw_gecos_len
 		             + header.pw_dir_len
 		             + header.pw_shell_len;
-		*reply = malloc(*reply_len);
+		*reply = reply_alloc(*reply_len);
 		if(!*reply)
 			return -1;
 		memcpy(*reply, &header, sizeof(header));
@@ -138,7 +198,7 @@ static int marshall_pwd(int error, struct passwd * pwd, void ** reply, int32_t *
 		offset += header.pw_dir_len;
 		
 		strcpy(*reply + offset, pwd->pw_shell);
-		*refresh_interval = 600;
+		*refresh_interval = positive_ttl[DB_PASSWD];
 	}
 	return 0;
 }
@@ -160,7 +220,7 @@ static int marshall_grp(int error, struct group * grp, void ** reply, int32_t *
 		header.gr_mem_cnt = 0;
 		
 		*reply_len = sizeof(header);
-		*reply = malloc(*reply_len);
+		*reply = reply_alloc(*reply_len);
 		if(!*reply)
 			return -1;
 		memcpy(*reply, &header, sizeof(header));
@@ -170,7 +230,7 @@ static int marshall_grp(int error, struct group * grp, void ** reply, int32_t *
 		 * have to redo the iteration only to find that there still
 		 * aren't any more groups. The "error" variable will be 0 only
 		 * in this case - all other cases have an error code. */
-		*refresh_interval = error ? 60 : 3600;
+		*refresh_interval = error ? negative_ttl[DB_GROUP] : positive_ttl[DB_GROUP];
 	}
 	else
 	{
@@ -191,7 +251,7 @@ static int marshall_grp(int error, struct group * grp, void ** reply, int32_t *
 		             + header.gr_name_len
 		             + header.gr_passwd_len
 		             + mem_size;
-		*reply = malloc(*reply_len);
+		*reply = reply_alloc(*reply_len);
 		if(!*reply)
 			return -1;
 		memcpy(*reply, &header, sizeof(header));
@@ -213,7 +273,7 @@ static int marshall_grp(int error, struct group * grp, void ** reply, int32_t *
 			strcpy(*reply + offset, grp->gr_mem[i]);
 			offset += sizes[i];
 		}
-		*refresh_interval = 3600;
+		*refresh_interval = positive_ttl[DB_GROUP];
 	}
 	return 0;
 }
@@ -237,13 +297,13 @@ static int marshall_hst(int error, struct hostent * hst, void ** reply, int32_t
 		header.error = HOST_NOT_FOUND;
 		
 		*reply_len = sizeof(header);
-		*reply = malloc(*reply_len);
+		*reply = reply_alloc(*reply_len);
 		if(!*reply)
 			return -1;
 		memcpy(*reply, &header, sizeof(header));
 		/* The original nscd seems to treat TRY_AGAIN differently. So,
 		 * we do as well. I'm not sure what the rationale is. */
-		*refresh_interval = (error == TRY_AGAIN) ? 60 : 20;
+		*refresh_interval = (error == TRY_AGAIN) ? 60 : negative_ttl[DB_HOSTS];
 	}
 	else
 	{
@@ -267,7 +327,7 @@ static int marshall_hst(int error, struct hostent * hst, void ** reply, int32_t
 		             + header.h_aliases_cnt * sizeof(uint32_t)
 		             + header.h_addr_list_cnt * header.h_length
 		             + mem_size;
-		*reply = malloc(*reply_len);
+		*reply = reply_alloc(*reply_len);
 		if(!*reply)
 			return -1;
 		memcpy(*reply, &header, sizeof(header));
@@ -292,16 +352,97 @@ static int marshall_hst(int error, struct hostent * hst, void ** reply, int32_t
 			strcpy(*reply + offset, hst->h_aliases[i]);
 			offset += sizes[i];
 		}
-		*refresh_interval = 600;
+		*refresh_interval = positive_ttl[DB_HOSTS];
 	}
 	return 0;
 }
 
+/* Marshall a getaddrinfo() result into the NSCD format: the addresses, then
+ * the family of each address, then the canonical name. The result has both
+ * IPv4 and IPv6 addresses, so one lookup answers clients asking for either. */
 static int marshall_ai(int error, struct addrinfo * ai, void ** reply, int32_t * reply_len, time_t * refresh_interval)
 {
-	/* This function would marshall the addrinfo structure. Since Google
-	 * doesn't use the host cache anyway, it is not implemented yet. */
-	return -1;
+	ai_response_header header;
+	struct addrinfo * entry;
+	struct addrinfo * other;
+	const char * canon = NULL;
+	size_t offset;
+	uint8_t * family;
+	
+	header.version = NSCD_VERSION;
+	header.found = 0;
+	header.naddrs = 0;
+	header.addrslen = 0;
+	header.canonlen = 0;
+	header.error = NETDB_SUCCESS;
+	if(error)
+	{
+		/* as for marshall_hst(), only a definite answer is cached */
+		if(error == EAI_NONAME)
+			header.error = HOST_NOT_FOUND;
+		else if(error == EAI_NODATA)
+			header.error = NO_DATA;
+		else if(error == EAI_AGAIN)
+			header.error = TRY_AGAIN;
+		else
+			return -1;
+		
+		*reply_len = sizeof(header);
+		*reply = reply_alloc(*reply_len);
+		if(!*reply)
+			return -1;
+		memcpy(*reply, &header, sizeof(header));
+		*refresh_interval = (error == EAI_AGAIN) ? 60 : negative_ttl[DB_HOSTS];
+		return 0;
+	}
+	
+	/* count each address once, even if it came back for several socket
+	 * types or from several sources */
+	for(entry = ai; entry; entry = entry->ai_next)
+	{
+		if(!canon && entry->ai_canonname)
+			canon = entry->ai_canonname;
+		if(entry->ai_family != AF_INET && entry->ai_family != AF_INET6)
+			continue;
+		for(other = ai; other != entry; other = other->ai_next)
+			if(ai_same_address(other, entry))
+				break;
+		if(other != entry)
+			continue;
+		header.naddrs++;
+		header.addrslen += ai_address_length(entry);
+	}
+	if(!header.naddrs)
+		return marshall_ai(EAI_NODATA, NULL, reply, reply_len, refresh_interval);
+	header.found = 1;
+	if(canon)
+		header.canonlen = strlen(canon) + 1;
+	
+	*reply_len = sizeof(header) + header.addrslen + header.naddrs + header.canonlen;
+	*reply = reply_alloc(*reply_len);
+	if(!*reply)
+		return -1;
+	memcpy(*reply, &header, sizeof(header));
+	offset = sizeof(header);
+	family = (uint8_t *) (*reply + offset + header.addrslen);
+	for(entry = ai; entry; entry = entry->ai_next)
+	{
+		if(entry->ai_family != AF_INET && entry->ai_family != AF_INET6)
+			continue;
+		for(other = ai; other != entry; other = other->ai_next)
+			if(ai_same_address(other, entry))
+				break;
+		if(other != entry)
+			continue;
+		memcpy(*reply + offset, ai_address(entry), ai_address_length(entry));
+		offset += ai_address_length(entry);
+		*family++ = entry->ai_family;
+	}
+	if(canon)
+		strcpy((char *) family, canon);
+	
+	*refresh_interval = positive_ttl[DB_HOSTS];
+	return 0;
 }
 
 /* Marshall a getgrouplist() result into the NSCD format. */
@@ -316,7 +457,7 @@ static int marshall_igr(int group_count, gid_t * groups, void ** reply, int32_t
 	header.ngrps = group_count - 1;
 	
 	*reply_len = sizeof(header) + header.ngrps * sizeof(int32_t);
-	*reply = malloc(*reply_len);
+	*reply = reply_alloc(*reply_len);
 	if(!*reply)
 		return -1;
 	memcpy(*reply, &header, sizeof(header));
@@ -327,7 +468,7 @@ static int marshall_igr(int group_count, gid_t * groups, void ** reply, int32_t
 		if(groups[i] != -1)
 			*gids++ = groups[i];
 	
-	*refresh_interval = 600;
+	*refresh_interval = positive_ttl[DB_GROUP];
 	
 	return 0;
 }
@@ -448,6 +589,126 @@ static int generate_grp_reply(request_header * req, void * key, uid_t uid, void
 	return error;
 }
 
+/* bumped by resolver_reload(), and compared with the one each thread saw */
+static unsigned int resolver_generation = 0;
+static __thread unsigned int resolver_seen = 0;
+
+void resolver_reload(void)
+{
+	__atomic_add_fetch(&resolver_generation, 1, __ATOMIC_RELAXED);
+}
+
+static void resolver_check(void)
+{
+	unsigned int generation = __atomic_load_n(&resolver_generation, __ATOMIC_RELAXED);
+	if(generation != resolver_seen)
+	{
+		res_init();
+		resolver_seen = generation;
+	}
+}
+
+/* Look up a host request in DNS ourselves if the name service would only have
+ * asked DNS, so that the TTLs of the answer are known. Return 1 if the name
+ * service must be asked instead. */
+static int dns_ask(request_header * req, void * key, struct dns_host * host)
+{
+	struct __res_state state;
+	int error;
+	
+	if(!dns_only(req, key))
+		return 1;
+	/* each lookup reads resolv.conf, like res_init() does */
+	memset(&state, 0, sizeof(state));
+	if(res_ninit(&state) < 0)
+		return 1;
+	error = dns_lookup(&state, req, key, host);
+	res_nclose(&state);
+	return error < 0;
+}
+
+static int dns_hst_reply(request_header * req, void * key, void ** reply, int32_t * reply_len, time_t * refresh_interval)
+{
+	struct dns_host host;
+	struct hostent hst;
+	char * aliases[DNS_MAXALIASES + 1];
+	char * addresses[DNS_MAXADDRS + 1];
+	int i, count = 0, error;
+	
+	if(dns_ask(req, key, &host))
+		return 1;
+	if(host.error != NETDB_SUCCESS)
+		error = marshall_hst(host.error, NULL, reply, reply_len, refresh_interval);
+	else
+	{
+		hst.h_name = host.name;
+		hst.h_addrtype = (req->type == GETHOSTBYNAME || req->type == GETHOSTBYADDR) ? AF_INET : AF_INET6;
+		hst.h_length = (hst.h_addrtype == AF_INET) ? NS_INADDRSZ : NS_IN6ADDRSZ;
+		for(i = 0; i < host.aliases; i++)
+			aliases[i] = host.alias[i];
+		aliases[i] = NULL;
+		hst.h_aliases = aliases;
+		for(i = 0; i < host.addrs; i++)
+			if(host.family[i] == hst.h_addrtype)
+				addresses[count++] = (char *) host.address[i];
+		addresses[count] = NULL;
+		hst.h_addr_list = addresses;
+		error = marshall_hst(NETDB_SUCCESS, &hst, reply, reply_len, refresh_interval);
+	}
+	if(!error && host.ttl >= 0)
+		*refresh_interval = dns_clamp(host.ttl);
+	return error;
+}
+
+static int dns_ai_reply(request_header * req, void * key, void ** reply, int32_t * reply_len, time_t * refresh_interval)
+{
+	struct dns_host host;
+	struct addrinfo ai[DNS_MAXADDRS];
+	union {
+		struct sockaddr_in in;
+		struct sockaddr_in6 in6;
+	} addresses[DNS_MAXADDRS];
+	int i, error;
+	
+	if(dns_ask(req, key, &host))
+		return 1;
+	if(host.error == NETDB_SUCCESS)
+		error = 0;
+	else if(host.error == HOST_NOT_FOUND)
+		error = EAI_NONAME;
+	else if(host.error == NO_DATA)
+		error = EAI_NODATA;
+	else if(host.error == TRY_AGAIN)
+		error = EAI_AGAIN;
+	else
+		error = EAI_FAIL;
+	
+	memset(ai, 0, sizeof(ai));
+	memset(addresses, 0, sizeof(addresses));
+	for(i = 0; i < host.addrs; i++)
+	{
+		ai[i].ai_family = host.family[i];
+		ai[i].ai_addr = (struct sockaddr *) &addresses[i];
+		ai[i].ai_next = (i + 1 < host.addrs) ? &ai[i + 1] : NULL;
+		if(host.family[i] == AF_INET)
+		{
+			addresses[i].in.sin_family = AF_INET;
+			memcpy(&addresses[i].in.sin_addr, host.address[i], NS_INADDRSZ);
+		}
+		else
+		{
+			addresses[i].in6.sin6_family = AF_INET6;
+			memcpy(&addresses[i].in6.sin6_addr, host.address[i], NS_IN6ADDRSZ);
+		}
+	}
+	ai[0].ai_canonname = host.name;
+	
+	error = marshall_ai(error, host.addrs ? ai : NULL, reply, reply_len, refresh_interval);
+	if(!error && host.ttl >= 0)
+		*refresh_interval = dns_clamp(host.ttl);
+	return error;
+}
+
 static int generate_hst_reply(request_header * req, void * key, uid_t uid, void ** reply, int32_t * reply_len, time_t * refresh_interval)
 {
 	struct hostent * hst = NULL;
@@ -460,6 +721,10 @@ static int generate_hst_reply(request_header * req, void * key, uid_t uid, void
 		return -1;
 	if(req->type == GETHOSTBYADDRv6 && req->key_len != NS_IN6ADDRSZ)
 		return -1;
+	resolver_check();
+	error = dns_hst_reply(req, key, reply, reply_len, refresh_interval);
+	if(error <= 0)
+		return error;
 	
 	/* We keep trying to get the reply with larger and larger buffers, until
 	 * either we fail to allocate a buffer or we succeed. The first try uses
@@ -514,12 +779,312 @@ static int generate_hst_reply(request_header * req, void * key, uid_t uid, void
 
 static int generate_ai_reply(request_header * req, void * key, uid_t uid, void ** reply, int32_t * reply_len, time_t * refresh_interval)
 {
-	/* This function would generate the getaddrinfo reply. Since Google
-	 * doesn't use the host cache anyway, it is not implemented yet. */
-	(void) &marshall_ai;
+	struct addrinfo hints;
+	struct addrinfo * ai = NULL;
+	int error;
+	
+	resolver_check();
+	error = dns_ai_reply(req, key, reply, reply_len, refresh_interval);
+	if(error <= 0)
+		return error;
+	/* Clients ask for any family and filter the result themselves, as glibc
+	 * does with what its nscd returns. One socket type is enough to get
+	 * each address, and the canonical name comes along for clients which
+	 * ask for it. */
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_flags = AI_CANONNAME;
+	error = getaddrinfo(key, NULL, &hints, &ai);
+	if(error == EAI_SYSTEM)
+		return -1;
+	
+	error = marshall_ai(error, ai, reply, reply_len, refresh_interval);
+	if(ai)
+		freeaddrinfo(ai);
+	return error;
+}
+
+static void members_abort(struct member_builder * members)
+{
+	int i;
+	for(i = 0; i < members->count; i++)
+		free(members->pairs[i].name);
+	free(members->pairs);
+	members->pairs = NULL;
+	members->count = 0;
+	members->size = 0;
+}
+
+/* Add the members of a group to the member index being built. If that fails,
+ * the builder is emptied and the index isn't built. */
+static int members_pair(struct member_builder * members, const char * name, gid_t gid)
+{
+	if(members->count == members->size)
+	{
+		int size = members->size ? members->size * 2 : 256;
+		struct member_pair * pairs = realloc(members->pairs, size * sizeof(*pairs));
+		if(!pairs)
+			goto fail;
+		members->pairs = pairs;
+		members->size = size;
+	}
+	members->pairs[members->count].name = strdup(name);
+	if(!members->pairs[members->count].name)
+		goto fail;
+	members->pairs[members->count++].gid = gid;
+	return 0;
+
+fail:
+	members_abort(members);
 	return -1;
 }
 
+static int members_add(struct member_builder * members, struct group * grp)
+{
+	char ** member;
+	for(member = grp->gr_mem; member && *member; member++)
+		if(members_pair(members, *member, grp->gr_gid) < 0)
+			return -1;
+	return 0;
+}
+
+static int pair_compare(const void * a, const void * b)
+{
+	const struct member_pair * x = (const struct member_pair *) a;
+	const struct member_pair * y = (const struct member_pair *) b;
+	int r = strcmp(x->name, y->name);
+	if(r)
+		return r;
+	return (x->gid > y->gid) - (x->gid < y->gid);
+}
+
+/* Build the member index from the pairs collected, and empty the builder. */
+static struct member_index * members_finish(struct member_builder * members)
+{
+	struct member_index * index = NULL;
+	struct member_user * user = NULL;
+	int i, users = 0, gids = 0;
+	size_t names = 0;
+	char * name;
+	
+	qsort(members->pairs, members->count, sizeof(*members->pairs), pair_compare);
+	/* a user may be listed more than once in a group */
+	for(i = 0; i < members->count; i++)
+	{
+		if(i && members->pairs[i].gid == members->pairs[i - 1].gid && !strcmp(members->pairs[i].name, members->pairs[i - 1].name))
+			continue;
+		if(!i || strcmp(members->pairs[i].name, members->pairs[i - 1].name))
+		{
+			users++;
+			names += strlen(members->pairs[i].name) + 1;
+		}
+		gids++;
+	}
+	
+	index = malloc(sizeof(*index) + users * sizeof(*index->user) + gids * sizeof(*index->gids) + names);
+	if(!index)
+		goto out;
+	index->users = 0;
+	index->user = (struct member_user *) &index[1];
+	index->gids = (gid_t *) &index->user[users];
+	name = (char *) &index->gids[gids];
+	gids = 0;
+	for(i = 0; i < members->count; i++)
+	{
+		if(user && members->pairs[i].gid == members->pairs[i - 1].gid && !strcmp(members->pairs[i].name, user->name))
+			continue;
+		if(!user || strcmp(members->pairs[i].name, user->name))
+		{
+			user = &index->user[index->users++];
+			user->name = name;
+			user->first = gids;
+			user->count = 0;
+			strcpy(name, members->pairs[i].name);
+			name += strlen(name) + 1;
+		}
+		index->gids[gids++] = members->pairs[i].gid;
+		user->count++;
+	}
+	if(debug)
+		printf("Built a member index of %d users in %d groups\n", index->users, gids);
+
+out:
+	members_abort(members);
+	return index;
+}
+
+static int user_compare(const void * key, const void * member)
+{
+	return strcmp((const char *) key, ((const struct member_user *) member)->name);
+}
+
+/* Answer INITGROUPS from the member index of the group snapshot, if it is
+ * fresh and has the user in it. If the snapshot has expired, build a new one
+ * in the background for next time. Return -1 if getgrouplist() must be used. */
+static int members_reply(const char * key, void ** reply, int32_t * reply_len, time_t * refresh_interval)
+{
+	struct ent_snapshot * snapshot;
+	struct member_index * members;
+	struct member_user * user = NULL;
+	initgr_response_header header;
+	int32_t * gids;
+	int i, expired = 0;
+	
+	if(!initgroups_index)
+		return -1;
+	epoch_enter();
+	snapshot = __atomic_load_n(&grent_info.current, __ATOMIC_ACQUIRE);
+	if(!snapshot || time(NULL) >= snapshot->expire_time)
+		expired = 1;
+	else if((members = __atomic_load_n(&snapshot->members, __ATOMIC_ACQUIRE)))
+		user = bsearch(key, members->user, members->users, sizeof(*user), user_compare);
+	if(user)
+	{
+		header.version = NSCD_VERSION;
+		header.found = 1;
+		header.ngrps = user->count;
+		*reply_len = sizeof(header) + header.ngrps * sizeof(int32_t);
+		*reply = reply_alloc(*reply_len);
+		if(*reply)
+		{
+			memcpy(*reply, &header, sizeof(header));
+			gids = (int32_t *) (*reply + sizeof(header));
+			for(i = 0; i < user->count; i++)
+				gids[i] = members->gids[user->first + i];
+		}
+	}
+	epoch_exit();
+	
+	if(expired)
+		start_enumeration(DB_GROUP);
+	if(!user || !*reply)
+		return -1;
+	if(debug)
+		printf("Found the groups of [%s] in the member index\n", key);
+	*refresh_interval = positive_ttl[DB_GROUP];
+	return 0;
+}
+
+/* Find the gid and the member names of a group in a GETGRBY* reply. The names
+ * point into the reply, and the array of them is malloc()ed. Return the number
+ * of members, 0 if the group wasn't found, or -1 if the reply can't be read. */
+static int group_members(void * reply, gid_t * gid, const char *** names)
+{
+	gr_response_header header;
+	int32_t length = reply_length(reply);
+	int32_t offset = sizeof(header);
+	int32_t * sizes;
+	int i;
+	
+	*names = NULL;
+	if(length < (int32_t) sizeof(header))
+		return -1;
+	memcpy(&header, reply, sizeof(header));
+	if(header.found != 1)
+		return 0;
+	if(header.gr_mem_cnt < 0 || header.gr_mem_cnt > (length - offset) / (int32_t) sizeof(int32_t))
+		return -1;
+	sizes = (int32_t *) (reply + offset);
+	offset += header.gr_mem_cnt * sizeof(int32_t);
+	if(header.gr_name_len < 0 || header.gr_passwd_len < 0 || header.gr_name_len + header.gr_passwd_len > length - offset)
+		return -1;
+	offset += header.gr_name_len + header.gr_passwd_len;
+	*gid = header.gr_gid;
+	if(!header.gr_mem_cnt)
+		return 0;
+	*names = malloc(header.gr_mem_cnt * sizeof(**names));
+	if(!*names)
+		return -1;
+	for(i = 0; i < header.gr_mem_cnt; i++)
+	{
+		if(sizes[i] < 1 || sizes[i] > length - offset || ((char *) reply)[offset + sizes[i] - 1])
+		{
+			free(*names);
+			*names = NULL;
+			return -1;
+		}
+		(*names)[i] = (const char *) (reply + offset);
+		offset += sizes[i];
+	}
+	return header.gr_mem_cnt;
+}
+
+static int member_listed(const char * name, const char ** names, int count)
+{
+	int i;
+	for(i = 0; i < count; i++)
+		if(!strcmp(name, names[i]))
+			return 1;
+	return 0;
+}
+
+/* Copy a member index, leaving out the old members of a group and adding its
+ * new ones. Return NULL if that fails. */
+static struct member_index * members_patch(struct member_index * index, gid_t old_gid, const char ** old_names, int old_count, gid_t new_gid, const char ** new_names, int new_count)
+{
+	struct member_builder members = {count: 0, size: 0, pairs: NULL};
+	int i, j;
+	
+	for(i = 0; i < index->users; i++)
+	{
+		for(j = 0; j < index->user[i].count; j++)
+		{
+			gid_t gid = index->gids[index->user[i].first + j];
+			if(gid == old_gid && member_listed(index->user[i].name, old_names, old_count))
+				continue;
+			if(members_pair(&members, index->user[i].name, gid) < 0)
+				return NULL;
+		}
+	}
+	for(i = 0; i < new_count; i++)
+		if(members_pair(&members, new_names[i], new_gid) < 0)
+			return NULL;
+	return members_finish(&members);
+}
+
+void members_refresh(void * old_reply, void * new_reply)
+{
+	struct ent_info * info = &grent_info;
+	struct member_index * index;
+	const char ** old_names;
+	const char ** new_names = NULL;
+	gid_t old_gid = -1, new_gid = -1;
+	int old_count, new_count = 0;
+	
+	if(!initgroups_index)
+		return;
+	old_count = group_members(old_reply, &old_gid, &old_names);
+	if(new_reply)
+		new_count = group_members(new_reply, &new_gid, &new_names);
+	if(old_count < 0 || new_count < 0)
+	{
+		/* if it can't be patched, the index is built again */
+		ent_invalidate(DB_GROUP);
+		goto out;
+	}
+	if(!old_count && !new_count)
+		goto out;
+	
+	pthread_mutex_lock(&info->busy_mutex);
+	/* a snapshot being built may already have read the old group */
+	if(info->thread_busy)
+		info->invalidations++;
+	if(info->current && info->current->members)
+	{
+		/* without an index INITGROUPS just uses getgrouplist() */
+		struct member_index * old = info->current->members;
+		index = members_patch(old, old_gid, old_names, old_count, new_gid, new_names, new_count);
+		__atomic_store_n(&info->current->members, index, __ATOMIC_RELEASE);
+		epoch_retire(free, old);
+	}
+	pthread_mutex_unlock(&info->busy_mutex);
+
+out:
+	free(old_names);
+	free(new_names);
+}
+
 static int generate_igr_reply(request_header * req, void * key, uid_t uid, void ** reply, int32_t * reply_len, time_t * refresh_interval)
 {
 	gid_t stack_groups[32];
@@ -527,6 +1092,9 @@ static int generate_igr_reply(request_header * req, void * key, uid_t uid, void
 	int group_count = sizeof(stack_groups) / sizeof(stack_groups[0]);
 	int error;
 	
+	if(!members_reply((char *) key, reply, reply_len, refresh_interval))
+		return 0;
+	
 	/* we use -1 as "not a real group" */
 	error = getgrouplist((char *) key, -1, groups, &group_count);
 	if(error < 0)
@@ -548,17 +1116,100 @@ static int generate_igr_reply(request_header * req, void * key, uid_t uid, void
 	return error;
 }
 
+/* Add the keys a user or group can be looked up by to a negative filter. */
+static void ent_filter(struct filter_builder * filter, request_type by_name, request_type by_id, const char * name, int id)
+{
+	char key[16];
+	filter_add(filter, by_name, name, strlen(name) + 1);
+	/* clients send ids the way glibc prints them */
+	filter_add(filter, by_id, key, snprintf(key, sizeof(key), "%d", id) + 1);
+}
+
+static void ent_snapshot_free(void * arg)
+{
+	struct ent_snapshot * snapshot = (struct ent_snapshot *) arg;
+	int i;
+	for(i = 0; i < snapshot->count; i++)
+		reply_release(snapshot->replies[i]);
+	if(snapshot->all)
+		reply_release(snapshot->all);
+	free(snapshot->members);
+	free(snapshot);
+}
+
+/* Add a reply to the snapshot being built, growing it if necessary.
+ * MUST BE CALLED WITH busy_mutex HELD */
+static int ent_append(struct ent_info * info, void * reply)
+{
+	struct ent_snapshot * snapshot = info->building;
+	if(!snapshot || snapshot->count == snapshot->size)
+	{
+		int size = snapshot ? snapshot->size * 2 : 64;
+		snapshot = realloc(snapshot, sizeof(*snapshot) + size * sizeof(void *));
+		if(!snapshot)
+			return -1;
+		if(!info->building)
+		{
+			snapshot->all = NULL;
+			snapshot->members = NULL;
+			snapshot->count = 0;
+		}
+		snapshot->size = size;
+		info->building = snapshot;
+	}
+	snapshot->replies[snapshot->count++] = reply;
+	return 0;
+}
+
+/* Copy all the replies of a finished snapshot into one, so that GET*ALL can be
+ * answered with a single write. The snapshot belongs to the iteration thread,
+ * which is the only one that changes it, so no lock is needed to read it. */
+static void * ent_all(struct ent_snapshot * snapshot)
+{
+	allent_response_header header;
+	void * reply;
+	int32_t offset;
+	int i;
+	
+	header.version = NSCD_VERSION;
+	header.found = 1;
+	header.count = snapshot ? snapshot->count : 0;
+	header.datalen = 0;
+	for(i = 0; i < header.count; i++)
+		header.datalen += reply_length(snapshot->replies[i]);
+	reply = reply_alloc(sizeof(header) + header.datalen);
+	if(!reply)
+		return NULL;
+	memcpy(reply, &header, sizeof(header));
+	offset = sizeof(header);
+	for(i = 0; i < header.count; i++)
+	{
+		memcpy(reply + offset, snapshot->replies[i], reply_length(snapshot->replies[i]));
+		offset += reply_length(snapshot->replies[i]);
+	}
+	return reply;
+}
+
 /* This is the background GET*ENT iteration thread. */
 static void * ent_thread(void * arg)
 {
 	struct ent_info * info = (struct ent_info *) arg;
-	request_header req = {version: NSCD_VERSION, type: info->type};
-	uid_t uid = -1;
-	char key[16];
-	int index = 0;
+	struct ent_snapshot * old = NULL;
+	time_t expire_time = time(NULL);
+	int db = request_database(info->type);
+	struct filter_builder * filter = filter_begin(db);
+	struct member_builder members = {count: 0, size: 0, pairs: NULL};
+	struct member_index * index;
+	int index_members = info->type == GETGRENT && initgroups_index;
+	unsigned int invalidations;
+	void * all;
+	int failed = 0;
 	
 	if(debug)
 		printf("ent_thread() starting\n");
+	pthread_mutex_lock(&info->busy_mutex);
+	invalidations = info->invalidations;
+	pthread_mutex_unlock(&info->busy_mutex);
 	if(info->type == GETPWENT)
 		setpwent();
 	else
@@ -574,69 +1225,98 @@ static void * ent_thread(void * arg)
 			struct group * grp;
 			void * data;
 		} data;
+		/* the filter is only used if the iteration didn't fail */
+		errno = 0;
 		if(info->type == GETPWENT)
 		{
 			data.pwd = getpwent();
 			r = marshall_pwd(0, data.pwd, &reply, &reply_len, &refresh_interval);
+			if(filter && data.pwd)
+				ent_filter(filter, GETPWBYNAME, GETPWBYUID, data.pwd->pw_name, data.pwd->pw_uid);
 		}
 		else
 		{
 			data.grp = getgrent();
 			r = marshall_grp(0, data.grp, &reply, &reply_len, &refresh_interval);
+			if(filter && data.grp)
+				ent_filter(filter, GETGRBYNAME, GETGRBYGID, data.grp->gr_name, data.grp->gr_gid);
+			if(index_members && data.grp && members_add(&members, data.grp) < 0)
+				index_members = 0;
+		}
+		if(!data.data && errno && errno != ENOENT)
+		{
+			if(filter)
+				filter_abort(filter);
+			filter = NULL;
+			/* the member index is only used if it has every group */
+			index_members = 0;
 		}
 		
-		/* must lock cache_mutex first */
-		pthread_mutex_lock(&cache_mutex);
-		pthread_mutex_lock(&info->busy_mutex);
-		
-		if(r >= 0)
+		all = NULL;
+		index = NULL;
+		if(r >= 0 && !data.data)
 		{
-			struct cache_entry * entry;
-			snprintf(key, sizeof(key), "%d%n", -index - 1, &req.key_len);
-			req.key_len++;
-			
-			if(cache_search(&req, key, uid, &entry) < 0)
-			{
-				/* it's not in the cache, so add it */
-				if(cache_add(&req, key, uid, reply, reply_len, 0, refresh_interval) < 0)
-					free(reply);
-			}
-			else
+			all = ent_all(info->building);
+			if(!all)
 			{
-				if(debug)
-					printf("Refreshing index %d (key %s, length %d)\n", index, key, req.key_len);
-				/* It's already in the cache, so just update the
-				 * reply and the expiration time. */
-				free(entry->reply);
-				entry->reply = reply;
-				entry->reply_len = reply_len;
-				entry->expire_time = time(NULL) + refresh_interval;
-				entry->refresh_interval = refresh_interval;
-				entry->refreshes++;
+				reply_release(reply);
+				r = -1;
 			}
+			else if(index_members)
+				index = members_finish(&members);
 		}
-		if(info->wait_index == index++)
+		
+		pthread_mutex_lock(&info->busy_mutex);
+		if(r < 0 || ent_append(info, reply) < 0)
 		{
-			if(debug)
-				printf("Notifying waiter for index %d\n", info->wait_index);
-			/* there should only be one waiter, but broadcast anyway */
+			if(r >= 0)
+				reply_release(reply);
+			if(all)
+				reply_release(all);
+			free(index);
+			failed = 1;
+		}
+		/* the waiters check for their index themselves */
+		else if(data.data)
 			pthread_cond_broadcast(&info->wait_done);
+		else
+		{
+			if(debug)
+				printf("Built a snapshot of %d entries\n", info->building->count - 1);
+			/* if the database was invalidated meanwhile, the
+			 * snapshot is only given to the clients waiting for it */
+			expire_time += refresh_interval;
+			info->building->expire_time = (invalidations == info->invalidations) ? expire_time : 0;
+			info->building->all = all;
+			info->building->members = index;
+			old = info->current;
+			__atomic_store_n(&info->current, info->building, __ATOMIC_RELEASE);
+			info->building = NULL;
+			info->published++;
 		}
-		
 		pthread_mutex_unlock(&info->busy_mutex);
-		pthread_mutex_unlock(&cache_mutex);
 		
-		if(!data.data)
+		if(failed || !data.data)
 			break;
 	}
 	if(info->type == GETPWENT)
 		endpwent();
 	else
 		endgrent();
+	if(filter)
+		filter_finish(filter);
+	members_abort(&members);
+	if(old)
+		epoch_retire(ent_snapshot_free, old);
 	
 	pthread_mutex_lock(&info->busy_mutex);
+	if(info->building)
+	{
+		ent_snapshot_free(info->building);
+		info->building = NULL;
+	}
 	info->thread_busy = 0;
-	/* somebody might be waiting on a larger index than there actually is */
+	/* the waiters will either find what they want or give up */
 	pthread_cond_broadcast(&info->wait_done);
 	pthread_mutex_unlock(&info->busy_mutex);
 	if(debug)
@@ -645,55 +1325,194 @@ static void * ent_thread(void * arg)
 	return NULL;
 }
 
-/* This function is protected in thread.c by one of pwent_query_mutex or grent_query_mutex. */
-int request_ent_cache(request_header * req, void * key, uid_t uid)
+/* Start the background iteration thread, unless it is already running.
+ * MUST BE CALLED WITH busy_mutex HELD */
+static int ent_start(struct ent_info * info)
 {
-	struct ent_info * info;
-	
-	char * end;
-	long index = strtol(key, &end, 10);
-	if(*end || end != key + req->key_len - 1)
+	pthread_t thread;
+	if(info->thread_busy)
+		return 0;
+	info->thread_busy = 1;
+	if(debug)
+		printf("Starting iteration thread\n");
+	if(pthread_create(&thread, NULL, ent_thread, info))
+	{
+		info->thread_busy = 0;
 		return -1;
-	index = -index - 1;
-	if(index < 0)
+	}
+	pthread_detach(thread);
+	return 0;
+}
+
+static struct ent_info * ent_find(int db)
+{
+	if(db == DB_PASSWD)
+		return &pwent_info;
+	if(db == DB_GROUP)
+		return &grent_info;
+	return NULL;
+}
+
+int start_enumeration(int db)
+{
+	struct ent_info * info = ent_find(db);
+	int r;
+	if(!info)
 		return -1;
-	
-	/* returns when the request has been fulfilled */
-	if(req->type == GETPWENT)
-		info = &pwent_info;
-	else if(req->type == GETGRENT)
-		info = &grent_info;
+	pthread_mutex_lock(&info->busy_mutex);
+	r = ent_start(info);
+	pthread_mutex_unlock(&info->busy_mutex);
+	return r;
+}
+
+/* Take a reference to the reply at an index of a snapshot. Indices past the
+ * end get the last reply, which says there are no more entries, and index -1
+ * gets the GET*ALL reply. */
+static void * ent_index(struct ent_snapshot * snapshot, long index)
+{
+	void * reply;
+	if(index < 0)
+		reply = snapshot->all;
 	else
+		reply = snapshot->replies[(index < snapshot->count) ? index : snapshot->count - 1];
+	reply_ref(reply);
+	return reply;
+}
+
+int ent_reply(request_header * req, void * key, void ** reply, int32_t * reply_len)
+{
+	struct ent_info * info = ent_find(request_database(req->type));
+	struct ent_snapshot * snapshot;
+	unsigned int published;
+	int started = 0;
+	
+	char * end;
+	long index = -1;
+	if(!info)
 		return -1;
+	/* GET*ALL requests have no index */
+	if(req->type == GETPWENT || req->type == GETGRENT)
+	{
+		index = strtol(key, &end, 10);
+		if(*end || end != key + req->key_len - 1)
+			return -1;
+		index = -index - 1;
+		if(index < 0)
+			return -1;
+	}
+	
+	epoch_enter();
+	snapshot = __atomic_load_n(&info->current, __ATOMIC_ACQUIRE);
+	if(snapshot && time(NULL) < snapshot->expire_time)
+	{
+		*reply = ent_index(snapshot, index);
+		epoch_exit();
+		*reply_len = reply_length(*reply);
+		return 0;
+	}
+	epoch_exit();
 	
+	/* The snapshot has expired, so wait for the index we want to be added
+	 * to a new one. The current snapshot can't be replaced while we hold
+	 * busy_mutex, so it needs no epoch here. */
 	pthread_mutex_lock(&info->busy_mutex);
-	pthread_mutex_unlock(&cache_mutex);
-	info->wait_index = index;
-	if(!info->thread_busy)
+	published = info->published;
+	*reply = NULL;
+	for(;;)
 	{
-		pthread_t thread;
-		int r;
-		info->thread_busy = 1;
-		if(debug)
-			printf("Starting iteration thread\n");
-		r = pthread_create(&thread, NULL, ent_thread, info);
-		if(r < 0)
-		{ 
-			info->thread_busy = 0;
-			pthread_mutex_unlock(&info->busy_mutex);
-			pthread_mutex_lock(&cache_mutex);
-			return -1;
+		snapshot = info->current;
+		if(snapshot && (time(NULL) < snapshot->expire_time || info->published != published))
+			*reply = ent_index(snapshot, index);
+		else if(info->building && index >= 0 && index < info->building->count)
+			*reply = ent_index(info->building, index);
+		else if(!info->thread_busy)
+		{
+			/* the iteration we waited for failed */
+			if(started || ent_start(info) < 0)
+				break;
+			started = 1;
+			/* any snapshot published from now on will do */
+			published = info->published;
 		}
-		pthread_detach(thread);
+		if(*reply)
+			break;
+		pthread_cond_wait(&info->wait_done, &info->busy_mutex);
 	}
-	/* wait for a signal */
-	while(pthread_cond_wait(&info->wait_done, &info->busy_mutex) < 0);
 	pthread_mutex_unlock(&info->busy_mutex);
-	pthread_mutex_lock(&cache_mutex);
-	
+	if(!*reply)
+		return -1;
+	*reply_len = reply_length(*reply);
 	return 0;
 }
 
+void ent_invalidate(int db)
+{
+	struct ent_info * info = ent_find(db);
+	struct ent_snapshot * old;
+	if(!info)
+		return;
+	pthread_mutex_lock(&info->busy_mutex);
+	old = info->current;
+	__atomic_store_n(&info->current, NULL, __ATOMIC_RELEASE);
+	info->invalidations++;
+	pthread_mutex_unlock(&info->busy_mutex);
+	if(old)
+		epoch_retire(ent_snapshot_free, old);
+}
+
+/* Store a key, including its terminating null, for reply_sibling(). The value
+ * comes from a reply, which has only so many bytes available for it. */
+static int sibling_key(request_header * sibling, request_type type, const char * value, int32_t length, int32_t available, char * key, int32_t key_size)
+{
+	if(length <= 0 || length > available || length > key_size || value[length - 1])
+		return -1;
+	memcpy(key, value, length);
+	sibling->version = NSCD_VERSION;
+	sibling->type = type;
+	sibling->key_len = length;
+	return 0;
+}
+
+int reply_sibling(request_type type, void * reply, int32_t reply_len, request_header * sibling, char * key, int32_t key_size)
+{
+	char number[16];
+	switch(type)
+	{
+		case GETPWBYNAME:
+		case GETPWBYUID:
+		{
+			pw_response_header * header = reply;
+			if(reply_len < sizeof(*header) || header->found != 1)
+				return -1;
+			if(type == GETPWBYUID)
+				return sibling_key(sibling, GETPWBYNAME, reply + sizeof(*header), header->pw_name_len, reply_len - sizeof(*header), key, key_size);
+			/* clients send ids the way glibc prints them */
+			return sibling_key(sibling, GETPWBYUID, number, snprintf(number, sizeof(number), "%d", header->pw_uid) + 1, sizeof(number), key, key_size);
+		}
+		case GETGRBYNAME:
+		case GETGRBYGID:
+		{
+			gr_response_header * header = reply;
+			size_t offset = sizeof(*header);
+			if(reply_len < offset || header->found != 1)
+				return -1;
+			if(type == GETGRBYGID)
+			{
+				/* the name follows the member name lengths */
+				if(header->gr_mem_cnt < 0)
+					return -1;
+				offset += header->gr_mem_cnt * sizeof(uint32_t);
+				if(reply_len < offset)
+					return -1;
+				return sibling_key(sibling, GETGRBYNAME, reply + offset, header->gr_name_len, reply_len - offset, key, key_size);
+			}
+			return sibling_key(sibling, GETGRBYGID, number, snprintf(number, sizeof(number), "%d", header->gr_gid) + 1, sizeof(number), key, key_size);
+		}
+		default:
+			return -1;
+	}
+}
+
 /* Return values:
  * Negative on error
  * 0 on success with a reusable socket
@@ -727,8 +1546,14 @@ int generate_reply(request_header * req, void * key, uid_t uid, void ** reply, i
 static pw_response_header pw_disabled = {version: NSCD_VERSION, found: -1, pw_name_len: 0, pw_passwd_len: 0, pw_uid: -1, pw_gid: -1, pw_gecos_len: 0, pw_dir_len: 0, pw_shell_len: 0};
 static gr_response_header gr_disabled = {version: NSCD_VERSION, found: -1, gr_name_len: 0, gr_passwd_len: 0, gr_gid: -1, gr_mem_cnt: 0};
 static hst_response_header hst_disabled = {version: NSCD_VERSION, found: -1, h_name_len: 0, h_aliases_cnt: 0, h_addrtype: -1, h_length: -1, h_addr_list_cnt: 0, error: NETDB_INTERNAL};
+static allent_response_header allent_disabled = {version: NSCD_VERSION, found: -1, count: 0, datalen: 0};
 static ai_response_header ai_disabled = {version: NSCD_VERSION, found: -1, naddrs: 0, addrslen: -1, canonlen: -1, error: -1};
 
+/* These are the replies marshall_pwd() and marshall_grp() give when there is no
+ * such user or group. */
+static pw_response_header pw_negative = {version: NSCD_VERSION, found: 0, pw_name_len: 0, pw_passwd_len: 0, pw_uid: -1, pw_gid: -1, pw_gecos_len: 0, pw_dir_len: 0, pw_shell_len: 0};
+static gr_response_header gr_negative = {version: NSCD_VERSION, found: 0, gr_name_len: 0, gr_passwd_len: 0, gr_gid: -1, gr_mem_cnt: 0};
+
 int generate_disabled_reply(request_type type, void ** reply, int32_t * reply_len)
 {
 	switch(type)
@@ -753,6 +1578,11 @@ int generate_disabled_reply(request_type type, void ** reply, int32_t * reply_le
 			*reply = &hst_disabled;
 			*reply_len = sizeof(hst_disabled);
 			return 0;
+		case GETPWALL:
+		case GETGRALL:
+			*reply = &allent_disabled;
+			*reply_len = sizeof(allent_disabled);
+			return 0;
 		case GETAI:
 			/* The glibc version of nscd actually sends a
 			 * hst_response_header for disabled host service,
@@ -767,3 +1597,22 @@ int generate_disabled_reply(request_type type, void ** reply, int32_t * reply_le
 	}
 	return -1;
 }
+
+int generate_negative_reply(request_type type, void ** reply, int32_t * reply_len)
+{
+	switch(type)
+	{
+		case GETPWBYNAME:
+		case GETPWBYUID:
+			*reply = &pw_negative;
+			*reply_len = sizeof(pw_negative);
+			return 0;
+		case GETGRBYNAME:
+		case GETGRBYGID:
+			*reply = &gr_negative;
+			*reply_len = sizeof(gr_negative);
+			return 0;
+		default:
+			return -1;
+	}
+}
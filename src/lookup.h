@@ -23,14 +23,39 @@
 
 #include "nscd.h"
 
-extern pthread_mutex_t * pwent_query_mutex;
-extern pthread_mutex_t * grent_query_mutex;
-
 /* generate normal replies and disabled replies, respectively */
 extern int generate_reply(request_header * req, void * key, uid_t uid, void ** reply, int32_t * reply_len, time_t * refresh_interval);
 extern int generate_disabled_reply(request_type type, void ** reply, int32_t * reply_len);
 
-/* request that a background thread fetch this GET*ENT request and add it to the cache */
-extern int request_ent_cache(request_header * req, void * key, uid_t uid);
+/* Return the reply which says that there is no such user or group, for the
+ * request types which have one. */
+extern int generate_negative_reply(request_type type, void ** reply, int32_t * reply_len);
+
+/* A reply to a GETPWBYNAME request also answers the GETPWBYUID request for its
+ * uid, and the other way around, and likewise for groups. Fill in that sibling
+ * request and its key, which must fit in key_size bytes, and return 0, or
+ * return -1 if the reply has no sibling. */
+extern int reply_sibling(request_type type, void * reply, int32_t reply_len, request_header * sibling, char * key, int32_t key_size);
+
+/* Answer a GET*ENT or GET*ALL request from the snapshot of its database,
+ * building a new snapshot first if it has expired. The caller gets a reference
+ * to the reply. */
+extern int ent_reply(request_header * req, void * key, void ** reply, int32_t * reply_len);
+
+/* Throw away the GET*ENT snapshot of a database. */
+extern void ent_invalidate(int db);
+
+/* Update the members of a group in the INITGROUPS member index, after a refresh
+ * of the group found that they changed. The new reply is NULL if the group is
+ * gone. */
+extern void members_refresh(void * old_reply, void * new_reply);
+
+/* Make every thread reload resolv.conf before its next host lookup. Each
+ * thread has resolver state of its own, so res_init() would only reload it for
+ * the thread calling it. */
+extern void resolver_reload(void);
+
+/* start a background iteration of a database, unless one is already running */
+extern int start_enumeration(int db);
 
 #endif /* __LOOKUP_H */
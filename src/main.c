@@ -24,12 +24,14 @@
 #include <sys/socket.h>
 #include <sys/types.h>
 #include <sys/stat.h>
-#include <sys/poll.h>
 #include <sys/un.h>
+#include <sys/uio.h>
 
 #include "nscd.h"
 #include "cache.h"
 #include "misc.h"
+#include "handoff.h"
+#include "watch.h"
 
 #define NSCD_PIDFILE "/var/run/gnscd.pid"
 
@@ -61,6 +63,57 @@ static int write_pid(void)
 	return 0;
 }
 
+/* The parent of a daemonized gnscd waits for the daemon to say that it has
+ * started on this pipe, so that it can exit with an error if it didn't. */
+static int ready_fd = -1;
+
+/* Fork into the background. The parent exits once the child calls
+ * daemon_ready(), or with an error if the child exits first. */
+static void daemon_start(void)
+{
+	int fds[2], fd;
+	ssize_t r;
+	char ready;
+	pid_t pid;
+	
+	if(pipe(fds) < 0)
+		exit(1);
+	pid = fork();
+	if(pid < 0)
+		exit(1);
+	if(pid > 0)
+	{
+		close(fds[1]);
+		while((r = read(fds[0], &ready, 1)) < 0 && errno == EINTR);
+		_exit(r == 1 ? 0 : 1);
+	}
+	close(fds[0]);
+	ready_fd = fds[1];
+	
+	setsid();
+	if(chdir("/") < 0)
+		exit(1);
+	fd = open("/dev/null", O_RDWR);
+	if(fd >= 0)
+	{
+		dup2(fd, STDIN_FILENO);
+		dup2(fd, STDOUT_FILENO);
+		dup2(fd, STDERR_FILENO);
+		if(fd > STDERR_FILENO)
+			close(fd);
+	}
+}
+
+static void daemon_ready(void)
+{
+	char ready = 0;
+	if(ready_fd < 0)
+		return;
+	write(ready_fd, &ready, 1);
+	close(ready_fd);
+	ready_fd = -1;
+}
+
 #define FAIL_OPEN(string) do { perror(string); close(sock); return -1; } while(0)
 
 /* open a listening nscd server socket */
@@ -84,40 +137,134 @@ static int open_socket(const char * name)
 	return sock;
 }
 
+/* This function is run when gnscd is run with -i, and tells the running gnscd
+ * to invalidate a database, or just one key in it. */
+static int invalidate(const char * db, const char * key)
+{
+	char buffer[256];
+	request_header req = {version: NSCD_VERSION, type: INVALIDATE};
+	struct iovec iov[2] = {{iov_base: &req, iov_len: sizeof(req)}, {iov_base: buffer}};
+	int32_t result;
+	struct sockaddr_un sun;
+	int sock;
+	
+	req.key_len = strlen(db) + 1;
+	if(key)
+		req.key_len += strlen(key) + 1;
+	if(req.key_len > sizeof(buffer))
+	{
+		fprintf(stderr, "%s: key too long\n", key);
+		return -1;
+	}
+	strcpy(buffer, db);
+	if(key)
+		strcpy(&buffer[strlen(db) + 1], key);
+	iov[1].iov_len = req.key_len;
+	
+	sock = socket(PF_UNIX, SOCK_STREAM, 0);
+	if(sock < 0)
+	{
+		perror("socket");
+		return -1;
+	}
+	sun.sun_family = AF_UNIX;
+	strcpy(sun.sun_path, NSCD_SOCKET);
+	if(connect(sock, (struct sockaddr *) &sun, sizeof(sun)) < 0)
+	{
+		perror(NSCD_SOCKET);
+		close(sock);
+		return -1;
+	}
+	if(writev(sock, iov, 2) != sizeof(req) + req.key_len || read(sock, &result, sizeof(result)) != sizeof(result))
+	{
+		fprintf(stderr, "%s: no reply from gnscd\n", NSCD_SOCKET);
+		close(sock);
+		return -1;
+	}
+	close(sock);
+	if(result)
+	{
+		fprintf(stderr, "%s: %s\n", db, strerror(result));
+		return -1;
+	}
+	return 0;
+}
+
 int main(int argc, char * argv[])
 {
-	struct pollfd pfd[2];
+	int socks[2];
+	const char * config = GNSCD_CONFIG;
+	int opt, daemonize = 1, restart = 0;
+	int handoff = -1, snapshot = -1;
+	const char * invalidate_db = NULL;
 	
-	if(argc > 1 && !strcmp(argv[1], "-g"))
+	while((opt = getopt(argc, argv, "dgf:ri:")) != -1)
+		switch(opt)
+		{
+			case 'd':
+				daemonize = 0;
+				debug = 1;
+				break;
+			case 'g':
+				get_stats();
+				exit(0);
+			case 'f':
+				config = optarg;
+				break;
+			case 'r':
+				restart = 1;
+				break;
+			case 'i':
+				invalidate_db = optarg;
+				break;
+			default:
+				fprintf(stderr, "Usage: %s [-d] [-g] [-r] [-i database [key]] [-f config]\n", argv[0]);
+				exit(1);
+		}
+	
+	if(invalidate_db)
+		return invalidate(invalidate_db, optind < argc ? argv[optind] : NULL) < 0;
+	
+	if(config_load(config) < 0)
 	{
-		get_stats();
-		exit(0);
+		fprintf(stderr, "%s: error reading configuration\n", config);
+		return 1;
 	}
 	
 	/* register cleanup hooks */
 	signal(SIGINT, signal_handler);
 	signal(SIGTERM, signal_handler);
 	
-	pfd[0].fd = open_socket(NSCD_SOCKET);
-	if(pfd[0].fd < 0)
-		return 1;
-	pfd[1].fd = open_socket(NSCD_SOCKET_OLD);
-	if(pfd[1].fd < 0)
+	if(restart)
 	{
-		close(pfd[0].fd);
-		return 1;
+		/* take the sockets and the cache over from the running gnscd */
+		handoff = handoff_receive(socks, 2, &snapshot);
+		if(handoff < 0)
+		{
+			fprintf(stderr, "%s: can't take over from the running gnscd\n", argv[0]);
+			return 1;
+		}
+	}
+	else
+	{
+		socks[0] = open_socket(NSCD_SOCKET);
+		if(socks[0] < 0)
+			return 1;
+		socks[1] = open_socket(NSCD_SOCKET_OLD);
+		if(socks[1] < 0)
+		{
+			close(socks[0]);
+			return 1;
+		}
 	}
-	
-	pfd[0].events = POLLIN;
-	pfd[1].events = POLLIN;
 	
 	/* In debug mode, we don't daemonize. We also print debugging
 	 * information about what is going on inside gnscd. */
-	if(argc < 2 || strcmp(argv[1], "-d"))
+	if(daemonize)
 	{
-		/* become a daemon */
-		daemon(0, 0);
-		setsid();
+		/* become a daemon, but only tell whoever started us that
+		 * we did once everything below has worked */
+		daemon_start();
 		write_pid();
 		
 		/* ignore job control signals */
@@ -125,8 +272,6 @@ int main(int argc, char * argv[])
 		signal(SIGTTIN, SIG_IGN);
 		signal(SIGTSTP, SIG_IGN);
 	}
-	else
-		debug = 1;
 	
 	/* don't die if a client closes a socket on us */
 	signal(SIGPIPE, SIG_IGN);
@@ -134,31 +279,22 @@ int main(int argc, char * argv[])
 	/* make sure we don't get recursive calls */
 	__nss_disable_nscd();
 	
-	if(cache_init() < 0)
+	if(cache_init(snapshot) < 0)
 		exit(1);
-	
-	/* listen for clients and dispatch them to threads */
-	for(;;)
+	if(thread_init() < 0)
+		exit(1);
+	if(watch_init() < 0)
+		exit(1);
+	if(restart)
 	{
-		int i;
-		
-		if(poll(pfd, 2, -1) < 0)
-			if(errno != EINTR)
-				exit(1);
-		
-		for(i = 0; i < 2; i++)
-		{
-			int client;
-			if(!pfd[i].revents)
-				continue;
-			client = accept(pfd[i].fd, NULL, NULL);
-			if(client < 0)
-				/* odd... poll() says we can accept but accept failed? */
-				continue;
-			if(dispatch_client(client) < 0)
-				close(client);
-		}
-	}	
+		/* the old gnscd can stop accepting clients now */
+		close(snapshot);
+		handoff_ready(handoff);
+	}
+	daemon_ready();
+	
+	/* listen for clients and dispatch their requests to threads */
+	serve_clients(socks, 2);
 	
 	return 0;
 }
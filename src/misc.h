@@ -19,14 +19,67 @@
 
 #include <sys/types.h>
 
+#include "nscd.h"
+
+/* These timeouts are used when communicating with clients. They are given in
+ * milliseconds. The long timeout is used between requests to close the
+ * connection when it is idle (or before the first request), and the short
+ * timeout is used during requests to wait for more data. */
+#define SHORT_TIMEOUT 200
+#define LONG_TIMEOUT 5000
+
+#define GNSCD_CONFIG "/etc/gnscd.conf"
+#define GNSCD_SNAPSHOT "/var/cache/gnscd/snapshot"
+
 /* main.c */
 extern int debug;
 
+/* config.c */
+enum database {
+	DB_PASSWD,
+	DB_GROUP,
+	DB_HOSTS,
+	DB_COUNT
+};
+extern int min_threads;
+extern int max_threads;
+extern const char * db_names[DB_COUNT];
+extern int enable_cache[DB_COUNT];
+extern int grace_period[DB_COUNT];
+extern int max_stale[DB_COUNT];
+extern int refresh_threads;
+extern int max_refreshes[DB_COUNT];
+extern int max_db_size[DB_COUNT];
+extern int shared[DB_COUNT];
+extern int suggested_size[DB_COUNT];
+extern int snapshot_interval;
+extern int positive_ttl[DB_COUNT];
+extern int dns_min_ttl;
+extern int dns_max_ttl;
+extern int check_files[DB_COUNT];
+extern int negative_ttl[DB_COUNT];
+extern int negative_size[DB_COUNT];
+extern int negative_filter[DB_COUNT];
+extern int initgroups_index;
+/* return the database a request type looks up, or -1 */
+extern int request_database(request_type type);
+extern int config_load(const char * file);
+
 /* stats.c */
+struct stats_buffer {
+	char * data;
+	size_t length, size;
+};
+extern void stats_printf(struct stats_buffer * stats, const char * format, ...) __attribute__((format(printf, 2, 3)));
 extern void send_stats(int client, uid_t uid);
 extern void get_stats(void);
 
 /* thread.c */
-extern int dispatch_client(int client);
+extern ssize_t write_all(int fd, const void * buf, size_t len, int timeout);
+extern int thread_init(void);
+extern void serve_clients(int * socks, int count);
+/* return 1 once another gnscd has taken over */
+extern int serve_handed_off(void);
+extern void thread_stats(struct stats_buffer * stats);
 
 #endif /* __MISC_H */
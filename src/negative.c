@@ -0,0 +1,373 @@
+/* This file is part of gnscd, a complete nscd replacement.
+ * Copyright (C) 2006 Google. Licensed under the GPL version 2. */
+
+/* gnscd is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; version 2 of the License.
+ * 
+ * gnscd is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ * 
+ * You can download the GNU General Public License from the GNU website
+ * at http://www.gnu.org/ or write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "nscd.h"
+#include "misc.h"
+#include "cache.h"
+#include "lookup.h"
+#include "epoch.h"
+#include "hash.h"
+#include "negative.h"
+
+/* Each slot of the store holds the top half of a key's hash, and the time its
+ * negative reply expires in the bottom half, so that it can be read and written
+ * without a lock. The low bits of the hash pick a pair of slots, and a new key
+ * takes whichever of the two expires first. */
+#define TAG_MASK 0xFFFFFFFF00000000ULL
+
+/* Filters are Bloom filters, with ten bits and seven hashes per key, which
+ * wrongly pass about 1% of the keys that aren't in them. Keys in them always
+ * pass, so a key which doesn't pass was not in the enumeration. */
+#define FILTER_BITS_PER_KEY 10
+#define FILTER_HASHES 7
+
+struct negative_filter {
+	time_t built;
+	uint64_t mask;
+	unsigned long keys;
+	uint64_t bits[0];
+};
+
+/* the hashes of the keys seen so far by an enumeration */
+struct filter_builder {
+	int db;
+	int failed;
+	time_t started;
+	uint64_t * hashes;
+	unsigned long count, size;
+};
+
+struct negative_db {
+	uint64_t * slots;
+	uint32_t mask;
+	/* every negative entry has the same reply */
+	void * reply;
+	struct negative_filter * filter;
+	/* when the last enumeration for the filter started */
+	time_t filter_started;
+	/* when the filter was last dropped, see filter_drop() */
+	time_t filter_dropped;
+	/* statistics */
+	unsigned long added, hits, filter_hits;
+};
+
+static struct negative_db negatives[DB_COUNT];
+static uint64_t negative_seed;
+
+#define negative_hash(type, key, key_len) word_hash64(key, key_len, negative_seed + (type))
+
+/* Return the store for a request type, or NULL if its database has none. */
+static struct negative_db * negative_find(request_type type)
+{
+	void * reply;
+	int32_t reply_len;
+	if(generate_negative_reply(type, &reply, &reply_len) < 0)
+		return NULL;
+	return negatives[request_database(type)].reply ? &negatives[request_database(type)] : NULL;
+}
+
+static int slot_search(struct negative_db * negative, uint64_t hash, time_t now)
+{
+	uint32_t index = (uint32_t) hash & negative->mask;
+	int i;
+	for(i = 0; i < 2; i++)
+	{
+		uint64_t slot = __atomic_load_n(&negative->slots[index ^ i], __ATOMIC_RELAXED);
+		if(!((slot ^ hash) & TAG_MASK) && (uint32_t) slot >= (uint32_t) now)
+			return 1;
+	}
+	return 0;
+}
+
+static int filter_test(struct negative_filter * filter, uint64_t hash)
+{
+	uint64_t step = (hash >> 32) | 1;
+	int i;
+	for(i = 0; i < FILTER_HASHES; i++, hash += step)
+		if(!(filter->bits[(hash & filter->mask) / 64] & (1ULL << (hash & 63))))
+			return 0;
+	return 1;
+}
+
+static void filter_set(struct negative_filter * filter, uint64_t hash)
+{
+	uint64_t step = (hash >> 32) | 1;
+	int i;
+	for(i = 0; i < FILTER_HASHES; i++, hash += step)
+		filter->bits[(hash & filter->mask) / 64] |= 1ULL << (hash & 63);
+}
+
+int negative_search(request_header * req, void * key, void ** reply, int32_t * reply_len)
+{
+	struct negative_db * negative = negative_find(req->type);
+	struct negative_filter * filter;
+	uint64_t hash;
+	time_t now;
+	int found = 0;
+	
+	if(!negative)
+		return -1;
+	hash = negative_hash(req->type, key, req->key_len);
+	now = time(NULL);
+	if(negative->slots && slot_search(negative, hash, now))
+	{
+		__sync_add_and_fetch(&negative->hits, 1);
+		found = 1;
+	}
+	else
+	{
+		epoch_enter();
+		filter = __atomic_load_n(&negative->filter, __ATOMIC_ACQUIRE);
+		/* don't trust a filter which hasn't been rebuilt for a while */
+		if(filter && now <= filter->built + 2 * negative_filter[request_database(req->type)] && !filter_test(filter, hash))
+		{
+			__sync_add_and_fetch(&negative->filter_hits, 1);
+			found = 1;
+		}
+		epoch_exit();
+	}
+	if(!found)
+		return -1;
+	if(debug)
+		printf("Found a negative reply for [%s]\n", (char *) key);
+	*reply = negative->reply;
+	*reply_len = reply_length(*reply);
+	reply_ref(*reply);
+	return 0;
+}
+
+int negative_add(request_header * req, void * key, void * reply)
+{
+	struct negative_db * negative = negative_find(req->type);
+	uint64_t hash, slot, other;
+	uint32_t index;
+	
+	if(!negative || !negative->slots)
+		return -1;
+	if(reply_length(reply) != reply_length(negative->reply) || memcmp(reply, negative->reply, reply_length(reply)))
+		return -1;
+	hash = negative_hash(req->type, key, req->key_len);
+	index = (uint32_t) hash & negative->mask;
+	slot = __atomic_load_n(&negative->slots[index], __ATOMIC_RELAXED);
+	other = __atomic_load_n(&negative->slots[index ^ 1], __ATOMIC_RELAXED);
+	/* use the slot the key already has, or the one which expires first */
+	if(!((other ^ hash) & TAG_MASK) || (((slot ^ hash) & TAG_MASK) && (uint32_t) other < (uint32_t) slot))
+		index ^= 1;
+	slot = (hash & TAG_MASK) | (uint32_t) (time(NULL) + negative_ttl[request_database(req->type)]);
+	__atomic_store_n(&negative->slots[index], slot, __ATOMIC_RELAXED);
+	__sync_add_and_fetch(&negative->added, 1);
+	if(debug)
+		printf("Adding negative cache entry for [%s]\n", (char *) key);
+	return 0;
+}
+
+/* Drop the filter of a database whose users or groups may have changed. An
+ * enumeration which started before this may have missed the change, so its
+ * filter is thrown away too, and a new one is started at the next tick. */
+static void filter_drop(struct negative_db * negative)
+{
+	struct negative_filter * filter;
+	__atomic_store_n(&negative->filter_dropped, time(NULL), __ATOMIC_RELAXED);
+	filter = __atomic_exchange_n(&negative->filter, NULL, __ATOMIC_ACQ_REL);
+	if(filter)
+		epoch_retire(free, filter);
+	__atomic_store_n(&negative->filter_started, 0, __ATOMIC_RELAXED);
+}
+
+void negative_invalidate(int db)
+{
+	struct negative_db * negative = &negatives[db];
+	uint32_t i;
+	if(!negative->reply)
+		return;
+	if(negative->slots)
+		for(i = 0; i <= negative->mask; i++)
+			__atomic_store_n(&negative->slots[i], 0, __ATOMIC_RELAXED);
+	filter_drop(negative);
+}
+
+void negative_remove(request_header * req, void * key)
+{
+	struct negative_db * negative = negative_find(req->type);
+	uint64_t hash;
+	uint32_t index;
+	int i;
+	if(!negative)
+		return;
+	if(negative->slots)
+	{
+		hash = negative_hash(req->type, key, req->key_len);
+		index = (uint32_t) hash & negative->mask;
+		for(i = 0; i < 2; i++)
+		{
+			uint64_t slot = __atomic_load_n(&negative->slots[index ^ i], __ATOMIC_RELAXED);
+			if(!((slot ^ hash) & TAG_MASK))
+				__atomic_compare_exchange_n(&negative->slots[index ^ i], &slot, 0, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+		}
+	}
+	filter_drop(negative);
+}
+
+struct filter_builder * filter_begin(int db)
+{
+	struct filter_builder * filter;
+	if(db < 0 || !negatives[db].reply || !negative_filter[db])
+		return NULL;
+	filter = malloc(sizeof(*filter));
+	if(!filter)
+		return NULL;
+	filter->db = db;
+	filter->failed = 0;
+	filter->started = time(NULL);
+	filter->hashes = NULL;
+	filter->count = 0;
+	filter->size = 0;
+	__atomic_store_n(&negatives[db].filter_started, filter->started, __ATOMIC_RELAXED);
+	return filter;
+}
+
+void filter_add(struct filter_builder * filter, request_type type, const void * key, int32_t key_len)
+{
+	if(filter->count == filter->size)
+	{
+		unsigned long size = filter->size ? filter->size * 2 : 1024;
+		uint64_t * hashes = realloc(filter->hashes, size * sizeof(*hashes));
+		if(!hashes)
+		{
+			/* a filter missing keys would turn real users away */
+			filter->failed = 1;
+			return;
+		}
+		filter->hashes = hashes;
+		filter->size = size;
+	}
+	filter->hashes[filter->count++] = negative_hash(type, key, key_len);
+}
+
+void filter_finish(struct filter_builder * builder)
+{
+	struct negative_db * negative = &negatives[builder->db];
+	struct negative_filter * filter = NULL;
+	uint64_t bits = 64;
+	unsigned long i;
+	
+	/* An empty enumeration more likely means that the name service can't
+	 * enumerate than that there are no users at all. */
+	if(!builder->failed && builder->count && builder->started > __atomic_load_n(&negative->filter_dropped, __ATOMIC_RELAXED))
+	{
+		while(bits < builder->count * FILTER_BITS_PER_KEY)
+			bits <<= 1;
+		filter = calloc(1, sizeof(*filter) + bits / 8);
+	}
+	if(filter)
+	{
+		filter->built = builder->started;
+		filter->mask = bits - 1;
+		filter->keys = builder->count;
+		for(i = 0; i < builder->count; i++)
+			filter_set(filter, builder->hashes[i]);
+		filter = __atomic_exchange_n(&negative->filter, filter, __ATOMIC_ACQ_REL);
+		if(filter)
+			epoch_retire(free, filter);
+		if(debug)
+			printf("Built the %s negative filter from %lu keys\n", db_names[builder->db], builder->count);
+	}
+	filter_abort(builder);
+}
+
+void filter_abort(struct filter_builder * builder)
+{
+	free(builder->hashes);
+	free(builder);
+}
+
+void negative_tick(time_t now)
+{
+	int db;
+	for(db = 0; db < DB_COUNT; db++)
+	{
+		/* try again an interval after the last one started, even if
+		 * that one failed or is still going */
+		if(!negatives[db].reply || !negative_filter[db])
+			continue;
+		if(now < __atomic_load_n(&negatives[db].filter_started, __ATOMIC_RELAXED) + negative_filter[db])
+			continue;
+		if(debug)
+			printf("Enumerating %s for the negative filter\n", db_names[db]);
+		start_enumeration(db);
+	}
+}
+
+void negative_stats(struct stats_buffer * stats)
+{
+	int db;
+	for(db = 0; db < DB_COUNT; db++)
+	{
+		struct negative_db * negative = &negatives[db];
+		struct negative_filter * filter;
+		if(!negative->reply)
+			continue;
+		stats_printf(stats, "%15lu  %s negative replies cached\n", negative->added, db_names[db]);
+		stats_printf(stats, "%15lu  %s replies from the negative cache\n", negative->hits, db_names[db]);
+		stats_printf(stats, "%15lu  %s replies from the negative filter\n", negative->filter_hits, db_names[db]);
+		epoch_enter();
+		filter = __atomic_load_n(&negative->filter, __ATOMIC_ACQUIRE);
+		if(filter)
+		{
+			stats_printf(stats, "%15lu  keys in the %s negative filter\n", filter->keys, db_names[db]);
+			stats_printf(stats, "%15ld  seconds since the %s negative filter was built\n", (long) (time(NULL) - filter->built), db_names[db]);
+		}
+		epoch_exit();
+	}
+}
+
+int negative_init(void)
+{
+	static const request_type types[] = {GETPWBYNAME, GETGRBYNAME};
+	int i;
+	
+	negative_seed = hash_random_seed();
+	for(i = 0; i < sizeof(types) / sizeof(types[0]); i++)
+	{
+		struct negative_db * negative = &negatives[request_database(types[i])];
+		void * reply;
+		int32_t reply_len;
+		uint32_t size = 2;
+		
+		generate_negative_reply(types[i], &reply, &reply_len);
+		negative->reply = reply_alloc(reply_len);
+		if(!negative->reply)
+			return -1;
+		memcpy(negative->reply, reply, reply_len);
+		
+		/* a size of 0 keeps negative replies in the cache proper */
+		if(!negative_size[request_database(types[i])])
+			continue;
+		while(size < negative_size[request_database(types[i])])
+			size <<= 1;
+		negative->slots = calloc(size, sizeof(*negative->slots));
+		if(!negative->slots)
+			return -1;
+		negative->mask = size - 1;
+	}
+	return 0;
+}
@@ -0,0 +1,63 @@
+/* This file is part of gnscd, a complete nscd replacement.
+ * Copyright (C) 2006 Google. Licensed under the GPL version 2. */
+
+/* gnscd is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; version 2 of the License.
+ * 
+ * gnscd is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ * 
+ * You can download the GNU General Public License from the GNU website
+ * at http://www.gnu.org/ or write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA. */
+
+#ifndef __NEGATIVE_H
+#define __NEGATIVE_H
+
+#include <stdint.h>
+#include <time.h>
+
+#include "nscd.h"
+#include "misc.h"
+
+/* Replies saying that a user or group doesn't exist are not kept in the cache
+ * proper, where lookups of made up names could push out real entries, but in
+ * a fixed size store of their own which remembers only the keys and when they
+ * expire. Optionally, a filter built from a full enumeration of the database
+ * answers for names and ids which weren't in it, without asking the name
+ * service at all. */
+
+/* Look for a negative reply to a request. If there is one, fill in the reply
+ * pointers as cache_search() would and return 0. */
+extern int negative_search(request_header * req, void * key, void ** reply, int32_t * reply_len);
+
+/* Remember that the reply to a request was negative, if it was, and return 0.
+ * The caller keeps its reference to the reply. */
+extern int negative_add(request_header * req, void * key, void * reply);
+
+/* Forget the negative replies for a database, or for one request. A user or
+ * group may have been added, so the filter is dropped until it is rebuilt. */
+extern void negative_invalidate(int db);
+extern void negative_remove(request_header * req, void * key);
+
+/* A filter is built while a database is enumerated. filter_begin() returns
+ * NULL if the database has no filter. filter_finish() starts using the
+ * filter, while filter_abort() throws it away, if the enumeration failed. */
+struct filter_builder;
+extern struct filter_builder * filter_begin(int db);
+extern void filter_add(struct filter_builder * filter, request_type type, const void * key, int32_t key_len);
+extern void filter_finish(struct filter_builder * filter);
+extern void filter_abort(struct filter_builder * filter);
+
+/* Start the enumerations filters are built from when they are due. */
+extern void negative_tick(time_t now);
+
+/* Add the negative cache statistics to a stats buffer. */
+extern void negative_stats(struct stats_buffer * stats);
+
+extern int negative_init(void);
+
+#endif /* __NEGATIVE_H */
@@ -60,7 +60,12 @@ typedef enum
   INITGROUPS,
   GETPWENT, /* should be above with other GETPW things */
   GETGRENT, /* should be above with other GETGR things */
-  LASTREQ
+  LASTREQ,
+  /* gnscd's own requests are numbered far above glibc's, which has since
+   * taken 18-20 for GETFDSERV, GETNETGRENT and INNETGR */
+  GETPWALL = 0x100, /* every GETPWENT reply at once */
+  GETGRALL, /* every GETGRENT reply at once */
+  HANDOFF /* hand the sockets and the cache over to a new gnscd */
 } request_type;
 
 
@@ -147,4 +152,121 @@ typedef struct
   nscd_ssize_t ngrps;
 } initgr_response_header;
 
+
+/* Structure sent in reply to a GETPWALL or GETGRALL query, followed by the
+   GETPWENT or GETGRENT replies for all the entries, one after another.  Note
+   that this struct is sent also if the service is disabled.  */
+typedef struct
+{
+  int32_t version;
+  int32_t found;
+  int32_t count;
+  nscd_ssize_t datalen;
+} allent_response_header;
+
+
+/* Type for offsets in data part of database.  */
+typedef uint32_t ref_t;
+/* Value for invalid/no reference.  */
+#define ENDREF	UINT32_MAX
+
+/* Timestamp type.  */
+typedef uint64_t nscd_time_t;
+
+/* Alignment requirement of the beginning of the data region.  */
+#define ALIGN 16
+
+/* Maximum alignment requirement we will encounter.  */
+#define BLOCK_ALIGN_LOG 3
+#define BLOCK_ALIGN (1 << BLOCK_ALIGN_LOG)
+#define BLOCK_ALIGN_M1 (BLOCK_ALIGN - 1)
+
+/* gnscd keeps its own cache entries in the hash entries below.  */
+struct cache_entry;
+
+/* Structure for one hash table entry.  */
+struct hashentry
+{
+  unsigned int type:8;		/* Which type of dataset.  */
+  bool first;			/* True if this was the original key.  */
+  nscd_ssize_t len;		/* Length of key (including NUL).  */
+  ref_t key;			/* Pointer to key.  */
+  int32_t owner;		/* If secure table, UID of owner.  */
+  ref_t next;			/* Next entry in this hash bucket list.  */
+  ref_t packet;			/* Records for the result.  */
+  union
+  {
+    struct hashentry *dellist;	/* Next record to be deleted.  This can be a
+				   pointer since only nscd uses this field.  */
+    ref_t *prevp;		/* Pointer to field containing forward
+				   reference.  */
+    struct cache_entry *entry;	/* The gnscd cache entry for this record.  */
+  };
+};
+
+/* Current persistent database version.  */
+#define DB_VERSION	2
+
+/* Maximum time allowed between updates of the timestamp.  */
+#define MAPPING_TIMEOUT (5 * 60)
+
+/* Header of the data of one cached result.  */
+struct datahead
+{
+  nscd_ssize_t allocsize;	/* Allocated Bytes.  */
+  nscd_ssize_t recsize;		/* Size of the record.  */
+  nscd_time_t timeout;		/* Time when this entry becomes invalid.  */
+  uint8_t notfound;		/* Nonzero if data has not been found.  */
+  uint8_t nreloads;		/* Reloads without use.  */
+  uint8_t usable;		/* False if the entry must be ignored.  */
+  uint8_t unused;		/* Unused.  */
+  uint32_t ttl;			/* TTL value used.  */
+
+  /* We need to have the following element aligned for the response
+     header data types and probably the data which follows.  */
+  union
+  {
+    pw_response_header pwdata;
+    gr_response_header grdata;
+    hst_response_header hstdata;
+    ai_response_header aidata;
+    initgr_response_header initgrdata;
+    nscd_ssize_t align1;
+    nscd_time_t align2;
+  } data[0];
+};
+
+/* Header of persistent database file.  */
+struct database_pers_head
+{
+  int32_t version;
+  int32_t header_size;
+  volatile int32_t gc_cycle;
+  volatile int32_t nscd_certainly_running;
+  volatile nscd_time_t timestamp;
+  /* Room for extensions.  */
+  volatile uint32_t extra_data[4];
+
+  nscd_ssize_t module;
+  nscd_ssize_t data_size;
+
+  nscd_ssize_t first_free;	/* Offset of first free byte in data area.  */
+
+  nscd_ssize_t nentries;
+  nscd_ssize_t maxnentries;
+  nscd_ssize_t maxnsearched;
+
+  uint64_t poshit;
+  uint64_t neghit;
+  uint64_t posmiss;
+  uint64_t negmiss;
+
+  uint64_t rdlockdelayed;
+  uint64_t wrlockdelayed;
+
+  uint64_t addfailed;
+
+  ref_t array[0];
+};
+
 #endif /* __NSCD_H */
@@ -0,0 +1,451 @@
+/* This file is part of gnscd, a complete nscd replacement.
+ * Copyright (C) 2006 Google. Licensed under the GPL version 2. */
+
+/* gnscd is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; version 2 of the License.
+ * 
+ * gnscd is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ * 
+ * You can download the GNU General Public License from the GNU website
+ * at http://www.gnu.org/ or write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA. */
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+#include "nscd.h"
+#include "misc.h"
+#include "cache.h"
+#include "shared.h"
+
+/* Each shared database is a struct database_pers_head, followed by the heads
+ * of its hash chains, followed by a data area holding the records. A record is
+ * a struct hashentry, the key, and a struct datahead followed by the reply,
+ * all allocated in one piece from the end of the used part of the data area.
+ * Clients search the database without any locks, so records are filled in
+ * before they are linked into their chains, and a record which is removed or
+ * replaced is first marked unusable and then unlinked. Its space is only
+ * reused when the data area fills up and is compacted; clients notice that
+ * because gc_cycle is odd while that happens, and changes while they look. */
+struct shared_db {
+	pthread_mutex_t mutex;
+	/* the file descriptor we give to clients */
+	int fd;
+	struct database_pers_head * head;
+	char * data;
+	uint64_t map_size;
+	/* statistics, protected by the mutex */
+	unsigned long added;
+	unsigned long collections;
+	unsigned long invalidations;
+};
+
+static struct shared_db shared_dbs[DB_COUNT];
+
+#define block_align(size) (((size) + BLOCK_ALIGN_M1) & ~(size_t) BLOCK_ALIGN_M1)
+
+#define record_size(key_len, reply_len) (sizeof(struct hashentry) + block_align(key_len) + offsetof(struct datahead, data) + block_align(reply_len))
+
+/* glibc's nis_hash(), which clients use to pick a hash chain */
+static uint32_t nis_hash(const uint8_t * key, int32_t key_len)
+{
+	uint32_t hash = 0;
+	while(key_len-- > 0)
+		hash = *key++ + 65599 * hash;
+	return hash;
+}
+
+/* return the shared database for a request type, or NULL */
+static struct shared_db * shared_db(request_type type)
+{
+	struct shared_db * db;
+	switch(type)
+	{
+		case GETPWBYNAME:
+		case GETPWBYUID:
+		case GETGRBYNAME:
+		case GETGRBYGID:
+		case INITGROUPS:
+		case GETHOSTBYNAME:
+		case GETHOSTBYNAMEv6:
+		case GETHOSTBYADDR:
+		case GETHOSTBYADDRv6:
+		case GETAI:
+			/* clients look all these up in the shared databases */
+			db = &shared_dbs[request_database(type)];
+			return db->head ? db : NULL;
+		default:
+			return NULL;
+	}
+}
+
+/* Unlink a record from its hash chain, after telling clients which have
+ * already found it to ignore it.
+ * MUST BE CALLED WITH THE LOCK HELD */
+static void shared_unlink(struct shared_db * db, ref_t ref)
+{
+	struct hashentry * here = (struct hashentry *) (db->data + ref);
+	struct datahead * data = (struct datahead *) (db->data + here->packet);
+	ref_t * link = &db->head->array[nis_hash((uint8_t *) db->data + here->key, here->len) % db->head->module];
+	__atomic_store_n(&data->usable, 0, __ATOMIC_RELEASE);
+	while(*link != ref)
+		link = &((struct hashentry *) (db->data + *link))->next;
+	__atomic_store_n(link, here->next, __ATOMIC_RELEASE);
+}
+
+/* Move all the records still in use to the start of the data area, in the
+ * order they are in their chains, and update the cache entries they belong
+ * to. This is what glibc's nscd calls garbage collection.
+ * MUST BE CALLED WITH THE LOCK HELD */
+static void shared_collect(struct shared_db * db)
+{
+	struct database_pers_head * head = db->head;
+	ref_t first_free = 0;
+	int32_t bucket;
+	char * old = malloc(head->first_free);
+	if(!old)
+		return;
+	memcpy(old, db->data, head->first_free);
+	
+	__atomic_add_fetch(&head->gc_cycle, 1, __ATOMIC_SEQ_CST);
+	for(bucket = 0; bucket < head->module; bucket++)
+	{
+		ref_t * link = &head->array[bucket];
+		ref_t ref = *link;
+		while(ref != ENDREF)
+		{
+			struct hashentry * here = (struct hashentry *) (old + ref);
+			struct datahead * data = (struct datahead *) (old + here->packet);
+			struct hashentry * moved = (struct hashentry *) (db->data + first_free);
+			memcpy(moved, here, record_size(here->len, data->recsize));
+			moved->key = first_free + (here->key - ref);
+			moved->packet = first_free + (here->packet - ref);
+			moved->entry->shared = first_free;
+			*link = first_free;
+			link = &moved->next;
+			first_free += record_size(here->len, data->recsize);
+			ref = here->next;
+		}
+		*link = ENDREF;
+	}
+	head->first_free = first_free;
+	__atomic_add_fetch(&head->gc_cycle, 1, __ATOMIC_SEQ_CST);
+	
+	db->collections++;
+	free(old);
+}
+
+/* MUST BE CALLED WITH THE LOCK HELD */
+static ref_t shared_alloc(struct shared_db * db, size_t size)
+{
+	ref_t ref = db->head->first_free;
+	if(size > (size_t) (db->head->data_size - ref))
+	{
+		shared_collect(db);
+		ref = db->head->first_free;
+		if(size > (size_t) (db->head->data_size - ref))
+			return ENDREF;
+	}
+	db->head->first_free = ref + size;
+	return ref;
+}
+
+void shared_add(struct cache_entry * entry)
+{
+	struct shared_db * db = shared_db(entry->type);
+	struct hashentry * here;
+	struct datahead * data;
+	int32_t reply_len;
+	ref_t ref, * link;
+	if(!db)
+		return;
+	reply_len = reply_length(entry->reply);
+	
+	pthread_mutex_lock(&db->mutex);
+	ref = shared_alloc(db, record_size(entry->key_len, reply_len));
+	if(ref == ENDREF)
+	{
+		/* clients will have to ask us for it */
+		db->head->addfailed++;
+		if(entry->shared != ENDREF)
+		{
+			shared_unlink(db, entry->shared);
+			db->head->nentries--;
+			entry->shared = ENDREF;
+		}
+		pthread_mutex_unlock(&db->mutex);
+		return;
+	}
+	
+	here = (struct hashentry *) (db->data + ref);
+	here->type = entry->type;
+	here->first = 1;
+	here->len = entry->key_len;
+	here->key = ref + sizeof(*here);
+	here->owner = 0;
+	here->packet = here->key + block_align(entry->key_len);
+	here->entry = entry;
+	memcpy(db->data + here->key, entry->key, entry->key_len);
+	
+	data = (struct datahead *) (db->data + here->packet);
+	data->allocsize = offsetof(struct datahead, data) + block_align(reply_len);
+	data->recsize = reply_len;
+	data->timeout = entry->expire_time;
+	/* every reply header starts with the version and the found flag */
+	data->notfound = !((int32_t *) entry->reply)[1];
+	data->nreloads = entry->refreshes;
+	data->usable = 1;
+	data->unused = 0;
+	data->ttl = entry->refresh_interval;
+	memcpy(data->data, entry->reply, reply_len);
+	
+	/* it goes in front of any old copy, which is then removed */
+	link = &db->head->array[nis_hash(entry->key, entry->key_len) % db->head->module];
+	here->next = *link;
+	__atomic_store_n(link, ref, __ATOMIC_RELEASE);
+	if(entry->shared != ENDREF)
+		shared_unlink(db, entry->shared);
+	else if(++db->head->nentries > db->head->maxnentries)
+		db->head->maxnentries = db->head->nentries;
+	entry->shared = ref;
+	db->added++;
+	pthread_mutex_unlock(&db->mutex);
+}
+
+void shared_remove(struct cache_entry * entry)
+{
+	struct shared_db * db = shared_db(entry->type);
+	if(!db)
+		return;
+	pthread_mutex_lock(&db->mutex);
+	if(entry->shared != ENDREF)
+	{
+		shared_unlink(db, entry->shared);
+		db->head->nentries--;
+		entry->shared = ENDREF;
+	}
+	pthread_mutex_unlock(&db->mutex);
+}
+
+void shared_invalidate(int db_index)
+{
+	struct shared_db * db = &shared_dbs[db_index];
+	struct database_pers_head * head = db->head;
+	int32_t bucket;
+	if(!head)
+		return;
+	pthread_mutex_lock(&db->mutex);
+	/* clients looking while this happens will look again */
+	__atomic_add_fetch(&head->gc_cycle, 1, __ATOMIC_SEQ_CST);
+	for(bucket = 0; bucket < head->module; bucket++)
+	{
+		ref_t ref = head->array[bucket];
+		while(ref != ENDREF)
+		{
+			struct hashentry * here = (struct hashentry *) (db->data + ref);
+			struct datahead * data = (struct datahead *) (db->data + here->packet);
+			__atomic_store_n(&data->usable, 0, __ATOMIC_RELEASE);
+			here->entry->shared = ENDREF;
+			ref = here->next;
+		}
+		__atomic_store_n(&head->array[bucket], ENDREF, __ATOMIC_RELEASE);
+	}
+	head->first_free = 0;
+	head->nentries = 0;
+	__atomic_add_fetch(&head->gc_cycle, 1, __ATOMIC_SEQ_CST);
+	db->invalidations++;
+	pthread_mutex_unlock(&db->mutex);
+}
+
+int shared_send(int client, request_type type, void * key, int32_t key_len)
+{
+	struct shared_db * db;
+	const char * name;
+	struct iovec iov[2];
+	struct msghdr msg;
+	union {
+		struct cmsghdr header;
+		char bytes[CMSG_SPACE(sizeof(int))];
+	} control;
+	struct cmsghdr * cmsg;
+	
+	switch(type)
+	{
+		case GETFDPW:
+			db = &shared_dbs[DB_PASSWD];
+			break;
+		case GETFDGR:
+			db = &shared_dbs[DB_GROUP];
+			break;
+		case GETFDHST:
+			db = &shared_dbs[DB_HOSTS];
+			break;
+		default:
+			return -1;
+	}
+	name = db_names[db - shared_dbs];
+	/* the key is the name of the database */
+	if(!db->head || key_len != strlen(name) + 1 || memcmp(key, name, key_len))
+		return -1;
+	
+	/* along with the descriptor, send the name back and the size to map */
+	iov[0].iov_base = (void *) name;
+	iov[0].iov_len = key_len;
+	iov[1].iov_base = &db->map_size;
+	iov[1].iov_len = sizeof(db->map_size);
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = iov;
+	msg.msg_iovlen = 2;
+	msg.msg_control = control.bytes;
+	msg.msg_controllen = CMSG_LEN(sizeof(int));
+	cmsg = CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+	*(int *) CMSG_DATA(cmsg) = db->fd;
+	
+	if(debug)
+		printf("Sending shared %s database to client %d\n", name, client);
+	return (sendmsg(client, &msg, MSG_NOSIGNAL) < 0) ? -1 : 0;
+}
+
+void shared_tick(time_t now)
+{
+	int i;
+	for(i = 0; i < DB_COUNT; i++)
+		if(shared_dbs[i].head)
+			shared_dbs[i].head->timestamp = now;
+}
+
+void shared_stats(struct stats_buffer * stats)
+{
+	int i;
+	for(i = 0; i < DB_COUNT; i++)
+	{
+		struct shared_db * db = &shared_dbs[i];
+		if(!db->head)
+			continue;
+		pthread_mutex_lock(&db->mutex);
+		stats_printf(stats, "%15d  %s entries in shared memory\n", db->head->nentries, db_names[i]);
+		stats_printf(stats, "%15d  bytes of shared %s data in use\n", db->head->first_free, db_names[i]);
+		stats_printf(stats, "%15d  bytes of shared %s data\n", db->head->data_size, db_names[i]);
+		stats_printf(stats, "%15lu  %s entries written to shared memory\n", db->added, db_names[i]);
+		stats_printf(stats, "%15llu  %s entries too big for shared memory\n", (unsigned long long) db->head->addfailed, db_names[i]);
+		stats_printf(stats, "%15lu  shared %s data compactions\n", db->collections, db_names[i]);
+		stats_printf(stats, "%15lu  times shared %s data was emptied\n", db->invalidations, db_names[i]);
+		pthread_mutex_unlock(&db->mutex);
+	}
+}
+
+/* Create the memory for a shared database, and return the file descriptor to
+ * give to clients. Clients must not be able to write to it, so we use a sealed
+ * memfd if we can, or else a deleted file only root can open for writing. */
+static int shared_map(struct shared_db * db, const char * name)
+{
+	char path[] = "/var/run/nscd/gnscd.XXXXXX";
+	void * map;
+	int fd;
+#ifdef F_SEAL_FUTURE_WRITE
+	fd = memfd_create(name, MFD_CLOEXEC | MFD_ALLOW_SEALING);
+	if(fd >= 0)
+	{
+		if(!ftruncate(fd, db->map_size))
+		{
+			map = mmap(NULL, db->map_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+			if(map != MAP_FAILED)
+			{
+				/* this mapping stays writable, but no new one can be */
+				if(!fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_FUTURE_WRITE | F_SEAL_SEAL))
+				{
+					db->head = map;
+					return fd;
+				}
+				munmap(map, db->map_size);
+			}
+		}
+		close(fd);
+	}
+#endif
+	fd = mkstemp(path);
+	if(fd < 0)
+		return -1;
+	db->fd = open(path, O_RDONLY);
+	unlink(path);
+	if(db->fd < 0 || ftruncate(fd, db->map_size) < 0)
+		goto fail;
+	map = mmap(NULL, db->map_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if(map == MAP_FAILED)
+		goto fail;
+	close(fd);
+	fcntl(db->fd, F_SETFD, FD_CLOEXEC);
+	db->head = map;
+	return db->fd;
+
+fail:
+	if(db->fd >= 0)
+		close(db->fd);
+	close(fd);
+	return -1;
+}
+
+/* Tell clients to stop using the shared databases when we exit. */
+static void shared_exit(void)
+{
+	shared_tick(0);
+}
+
+int shared_init(void)
+{
+	int i;
+	for(i = 0; i < DB_COUNT; i++)
+	{
+		struct shared_db * db = &shared_dbs[i];
+		struct database_pers_head * head;
+		size_t buckets = (suggested_size[i] * sizeof(ref_t) + ALIGN - 1) & ~(size_t) (ALIGN - 1);
+		if(!shared[i] || !enable_cache[i])
+			continue;
+		pthread_mutex_init(&db->mutex, NULL);
+		/* the records are smaller than the cache entries they copy, so
+		 * this is enough room for a full cache, plus some garbage */
+		db->map_size = sizeof(*head) + buckets + block_align(max_db_size[i]);
+		db->fd = shared_map(db, db_names[i]);
+		if(db->fd < 0)
+		{
+			perror("gnscd: shared database");
+			db->head = NULL;
+			return -1;
+		}
+		
+		head = db->head;
+		head->version = DB_VERSION;
+		head->header_size = sizeof(*head);
+		head->gc_cycle = 0;
+		/* clients check the timestamp instead */
+		head->nscd_certainly_running = 0;
+		head->timestamp = time(NULL);
+		head->module = suggested_size[i];
+		head->data_size = block_align(max_db_size[i]);
+		head->first_free = 0;
+		memset(head->array, 0xFF, suggested_size[i] * sizeof(ref_t));
+		db->data = (char *) head + sizeof(*head) + buckets;
+	}
+	atexit(shared_exit);
+	return 0;
+}
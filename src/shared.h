@@ -0,0 +1,54 @@
+/* This file is part of gnscd, a complete nscd replacement.
+ * Copyright (C) 2006 Google. Licensed under the GPL version 2. */
+
+/* gnscd is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; version 2 of the License.
+ * 
+ * gnscd is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ * 
+ * You can download the GNU General Public License from the GNU website
+ * at http://www.gnu.org/ or write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA. */
+
+#ifndef __SHARED_H
+#define __SHARED_H
+
+#include <time.h>
+
+#include "nscd.h"
+#include "misc.h"
+#include "cache.h"
+
+/* Besides its own cache, gnscd keeps a copy of the entries of each database in
+ * shared memory, laid out the way glibc's nscd does it. Clients ask for it with
+ * a GETFD* request, map it read-only, and search it themselves, so that a hit
+ * costs them no system calls at all. The cache calls these functions to keep
+ * the copy up to date; they have their own locks, so they may be called with
+ * shard locks held. */
+
+/* Add an entry to the shared copy, or replace the copy of its reply. */
+extern void shared_add(struct cache_entry * entry);
+
+/* Remove an entry from the shared copy. */
+extern void shared_remove(struct cache_entry * entry);
+
+/* Empty a shared database when its cache is invalidated. */
+extern void shared_invalidate(int db);
+
+/* Send the file descriptor for a shared database to a client. */
+extern int shared_send(int client, request_type type, void * key, int32_t key_len);
+
+/* Tell clients that the shared databases are still being kept up to date. */
+extern void shared_tick(time_t now);
+
+/* Add the shared database statistics to a stats buffer. */
+extern void shared_stats(struct stats_buffer * stats);
+
+/* Create the shared databases which are enabled. */
+extern int shared_init(void);
+
+#endif /* __SHARED_H */
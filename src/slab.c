@@ -0,0 +1,168 @@
+/* This file is part of gnscd, a complete nscd replacement.
+ * Copyright (C) 2006 Google. Licensed under the GPL version 2. */
+
+/* gnscd is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; version 2 of the License.
+ * 
+ * gnscd is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ * 
+ * You can download the GNU General Public License from the GNU website
+ * at http://www.gnu.org/ or write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA. */
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <pthread.h>
+
+#include "misc.h"
+#include "slab.h"
+
+/* The size classes go up by 16 bytes to 128 bytes, and then by quarters of a
+ * power of two (160, 192, 224, 256, 320, ...) up to SLAB_MAX, so that no more
+ * than about a fifth of an object is wasted by rounding it up. */
+#define SLAB_MAX 4096
+#define SLAB_CLASSES 28
+/* each class gets memory from malloc() this much at a time */
+#define SLAB_CHUNK 65536
+
+struct slab_class {
+	pthread_mutex_t mutex;
+	size_t size;
+	/* free objects, linked through their first word */
+	void * free;
+	/* statistics */
+	unsigned long chunks;
+	unsigned long objects;
+	size_t requested;
+};
+
+static struct slab_class classes[SLAB_CLASSES];
+
+/* objects too big for any class */
+static unsigned long large_objects = 0;
+static size_t large_bytes = 0;
+
+static int slab_class(size_t size)
+{
+	int shift;
+	if(size <= 128)
+		return size ? (size - 1) / 16 : 0;
+	/* the position of the top bit of size - 1, and the next two bits */
+	shift = sizeof(unsigned long) * 8 - 1 - __builtin_clzl(size - 1);
+	return 8 + (shift - 7) * 4 + ((size - 1) >> (shift - 2)) - 4;
+}
+
+size_t slab_size(size_t size)
+{
+	if(size > SLAB_MAX)
+		return size;
+	return classes[slab_class(size)].size;
+}
+
+/* MUST BE CALLED WITH THE LOCK HELD */
+static int slab_grow(struct slab_class * class)
+{
+	char * chunk = malloc(SLAB_CHUNK);
+	size_t offset;
+	if(!chunk)
+		return -1;
+	/* chunks are never given back: the cache limits how much memory it
+	 * uses, so the free objects will be used again */
+	for(offset = 0; offset + class->size <= SLAB_CHUNK; offset += class->size)
+	{
+		*(void **) (chunk + offset) = class->free;
+		class->free = chunk + offset;
+	}
+	class->chunks++;
+	return 0;
+}
+
+void * slab_alloc(size_t size)
+{
+	struct slab_class * class;
+	void * object;
+	if(size > SLAB_MAX)
+	{
+		object = malloc(size);
+		if(object)
+		{
+			__atomic_add_fetch(&large_objects, 1, __ATOMIC_RELAXED);
+			__atomic_add_fetch(&large_bytes, size, __ATOMIC_RELAXED);
+		}
+		return object;
+	}
+	class = &classes[slab_class(size)];
+	pthread_mutex_lock(&class->mutex);
+	if(!class->free && slab_grow(class) < 0)
+	{
+		pthread_mutex_unlock(&class->mutex);
+		return NULL;
+	}
+	object = class->free;
+	class->free = *(void **) object;
+	class->objects++;
+	class->requested += size;
+	pthread_mutex_unlock(&class->mutex);
+	return object;
+}
+
+void slab_free(void * object, size_t size)
+{
+	struct slab_class * class;
+	if(size > SLAB_MAX)
+	{
+		__atomic_sub_fetch(&large_objects, 1, __ATOMIC_RELAXED);
+		__atomic_sub_fetch(&large_bytes, size, __ATOMIC_RELAXED);
+		free(object);
+		return;
+	}
+	class = &classes[slab_class(size)];
+	pthread_mutex_lock(&class->mutex);
+	*(void **) object = class->free;
+	class->free = object;
+	class->objects--;
+	class->requested -= size;
+	pthread_mutex_unlock(&class->mutex);
+}
+
+void slab_stats(struct stats_buffer * stats)
+{
+	size_t total = 0, used = 0, requested = 0;
+	int i;
+	for(i = 0; i < SLAB_CLASSES; i++)
+	{
+		struct slab_class * class = &classes[i];
+		pthread_mutex_lock(&class->mutex);
+		if(class->chunks)
+			stats_printf(stats, "%15lu  of %lu %zu byte slab objects in use\n", class->objects, class->chunks * (SLAB_CHUNK / class->size), class->size);
+		total += class->chunks * SLAB_CHUNK;
+		used += class->objects * class->size;
+		requested += class->requested;
+		pthread_mutex_unlock(&class->mutex);
+	}
+	stats_printf(stats, "%15zu  bytes of slab memory\n", total);
+	stats_printf(stats, "%15zu  bytes of slab objects in use\n", used);
+	stats_printf(stats, "%15zu  bytes of slab objects requested\n", requested);
+	/* free objects, and the ends of objects lost to rounding */
+	stats_printf(stats, "%14.1f%%  slab memory not in use\n", total ? (total - used) * 100.0 / total : 0.0);
+	stats_printf(stats, "%14.1f%%  slab memory lost to rounding\n", total ? (used - requested) * 100.0 / total : 0.0);
+	stats_printf(stats, "%15lu  objects too big for slabs\n", __atomic_load_n(&large_objects, __ATOMIC_RELAXED));
+	stats_printf(stats, "%15zu  bytes in objects too big for slabs\n", __atomic_load_n(&large_bytes, __ATOMIC_RELAXED));
+}
+
+void slab_init(void)
+{
+	int i;
+	for(i = 0; i < SLAB_CLASSES; i++)
+	{
+		pthread_mutex_init(&classes[i].mutex, NULL);
+		if(i < 8)
+			classes[i].size = (i + 1) * 16;
+		else
+			classes[i].size = (size_t) ((i - 8) % 4 + 5) << (7 + (i - 8) / 4 - 2);
+	}
+}
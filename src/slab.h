@@ -0,0 +1,45 @@
+/* This file is part of gnscd, a complete nscd replacement.
+ * Copyright (C) 2006 Google. Licensed under the GPL version 2. */
+
+/* gnscd is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; version 2 of the License.
+ * 
+ * gnscd is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ * 
+ * You can download the GNU General Public License from the GNU website
+ * at http://www.gnu.org/ or write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA. */
+
+#ifndef __SLAB_H
+#define __SLAB_H
+
+#include <stddef.h>
+
+#include "misc.h"
+
+/* The slab allocator hands out the memory used by the cache. Small objects
+ * are rounded up to one of a few dozen size classes, and each class carves
+ * its objects out of large chunks and keeps the free ones on a list, so that
+ * allocating and freeing them is cheap and objects of similar sizes are kept
+ * together. Larger objects come from malloc(). Callers must remember how big
+ * their objects are, since slab_free() needs to know. */
+
+/* Return how many bytes an object of the given size really uses. */
+extern size_t slab_size(size_t size);
+
+/* Allocate and free an object of the given size. */
+extern void * slab_alloc(size_t size);
+extern void slab_free(void * object, size_t size);
+
+/* Add the slab statistics to a stats buffer. */
+extern void slab_stats(struct stats_buffer * stats);
+
+/* Initialize the slab allocator. Must be called before any other slab
+ * function. */
+extern void slab_init(void);
+
+#endif /* __SLAB_H */
@@ -0,0 +1,183 @@
+/* This file is part of gnscd, a complete nscd replacement.
+ * Copyright (C) 2006 Google. Licensed under the GPL version 2. */
+
+/* gnscd is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; version 2 of the License.
+ * 
+ * gnscd is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ * 
+ * You can download the GNU General Public License from the GNU website
+ * at http://www.gnu.org/ or write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA. */
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "snapshot.h"
+
+#define SNAPSHOT_MAGIC 0x646e7367
+#define SNAPSHOT_VERSION 1
+
+struct snapshot_header {
+	uint32_t magic;
+	uint32_t version;
+	/* bytes of records after the header */
+	uint64_t length;
+	uint64_t count;
+	uint64_t checksum;
+};
+
+struct snapshot {
+	int fd;
+	char * map;
+	size_t size;
+	/* where the next record goes, or is read from */
+	size_t offset;
+	uint64_t count;
+};
+
+#define pad(length) (((length) + 7) & ~(size_t) 7)
+
+/* a Fletcher style checksum, a word at a time */
+static uint64_t snapshot_checksum(const char * data, size_t length)
+{
+	const uint64_t * word = (const uint64_t *) data;
+	uint64_t a = 0, b = 0;
+	for(length /= sizeof(*word); length; length--)
+	{
+		a += *word++;
+		b += a;
+	}
+	return a ^ (b << 32) ^ (b >> 32);
+}
+
+struct snapshot * snapshot_create(int fd, size_t size)
+{
+	struct snapshot * snapshot = malloc(sizeof(*snapshot));
+	if(!snapshot)
+		return NULL;
+	snapshot->fd = fd;
+	snapshot->size = sizeof(struct snapshot_header) + pad(size);
+	snapshot->offset = sizeof(struct snapshot_header);
+	snapshot->count = 0;
+	if(ftruncate(fd, snapshot->size) < 0)
+	{
+		free(snapshot);
+		return NULL;
+	}
+	snapshot->map = mmap(NULL, snapshot->size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if(snapshot->map == MAP_FAILED)
+	{
+		free(snapshot);
+		return NULL;
+	}
+	return snapshot;
+}
+
+int snapshot_add(struct snapshot * snapshot, const struct snapshot_record * record, const void * key, const void * reply)
+{
+	size_t length = sizeof(*record) + pad(record->key_len) + pad(record->reply_len);
+	char * data;
+	if(snapshot->offset + length > snapshot->size)
+	{
+		/* the cache grew since we started, so grow the file too */
+		size_t size = snapshot->size * 2;
+		void * map;
+		if(size < snapshot->offset + length)
+			size = snapshot->offset + length;
+		if(ftruncate(snapshot->fd, size) < 0)
+			return -1;
+		map = mremap(snapshot->map, snapshot->size, size, MREMAP_MAYMOVE);
+		if(map == MAP_FAILED)
+			return -1;
+		snapshot->map = map;
+		snapshot->size = size;
+	}
+	/* the file starts out zero, so the padding already is */
+	data = snapshot->map + snapshot->offset;
+	memcpy(data, record, sizeof(*record));
+	memcpy(data + sizeof(*record), key, record->key_len);
+	memcpy(data + sizeof(*record) + pad(record->key_len), reply, record->reply_len);
+	snapshot->offset += length;
+	snapshot->count++;
+	return 0;
+}
+
+ssize_t snapshot_finish(struct snapshot * snapshot)
+{
+	struct snapshot_header * header = (struct snapshot_header *) snapshot->map;
+	ssize_t length = snapshot->offset;
+	int r;
+	header->magic = SNAPSHOT_MAGIC;
+	header->version = SNAPSHOT_VERSION;
+	header->length = length - sizeof(*header);
+	header->count = snapshot->count;
+	header->checksum = snapshot_checksum((char *) (header + 1), header->length);
+	r = msync(snapshot->map, snapshot->size, MS_SYNC);
+	munmap(snapshot->map, snapshot->size);
+	if(r < 0 || ftruncate(snapshot->fd, length) < 0)
+		length = -1;
+	free(snapshot);
+	return length;
+}
+
+struct snapshot * snapshot_open(int fd)
+{
+	struct snapshot * snapshot;
+	struct snapshot_header * header;
+	struct stat st;
+	if(fstat(fd, &st) < 0 || st.st_size < sizeof(*header))
+		return NULL;
+	snapshot = malloc(sizeof(*snapshot));
+	if(!snapshot)
+		return NULL;
+	snapshot->fd = fd;
+	snapshot->size = st.st_size;
+	snapshot->offset = sizeof(*header);
+	snapshot->count = 0;
+	snapshot->map = mmap(NULL, snapshot->size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if(snapshot->map == MAP_FAILED)
+	{
+		free(snapshot);
+		return NULL;
+	}
+	madvise(snapshot->map, snapshot->size, MADV_SEQUENTIAL);
+	header = (struct snapshot_header *) snapshot->map;
+	if(header->magic != SNAPSHOT_MAGIC || header->version != SNAPSHOT_VERSION || header->length != snapshot->size - sizeof(*header) || header->checksum != snapshot_checksum((char *) (header + 1), header->length))
+	{
+		snapshot_close(snapshot);
+		return NULL;
+	}
+	return snapshot;
+}
+
+const struct snapshot_record * snapshot_next(struct snapshot * snapshot, const void ** key, const void ** reply)
+{
+	const struct snapshot_record * record = (struct snapshot_record *) (snapshot->map + snapshot->offset);
+	size_t left = snapshot->size - snapshot->offset;
+	if(left < sizeof(*record) || record->key_len < 0 || record->reply_len < 0)
+		return NULL;
+	if(left - sizeof(*record) < pad(record->key_len) + pad(record->reply_len))
+		return NULL;
+	*key = record + 1;
+	*reply = (char *) *key + pad(record->key_len);
+	snapshot->offset += sizeof(*record) + pad(record->key_len) + pad(record->reply_len);
+	return record;
+}
+
+void snapshot_close(struct snapshot * snapshot)
+{
+	munmap(snapshot->map, snapshot->size);
+	free(snapshot);
+}
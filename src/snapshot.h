@@ -0,0 +1,63 @@
+/* This file is part of gnscd, a complete nscd replacement.
+ * Copyright (C) 2006 Google. Licensed under the GPL version 2. */
+
+/* gnscd is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; version 2 of the License.
+ * 
+ * gnscd is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ * 
+ * You can download the GNU General Public License from the GNU website
+ * at http://www.gnu.org/ or write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA. */
+
+#ifndef __SNAPSHOT_H
+#define __SNAPSHOT_H
+
+#include <stdint.h>
+#include <sys/types.h>
+
+/* A snapshot is a copy of the cache in a file, which is written with the file
+ * mapped into memory and read back the same way. It is a header followed by
+ * one record per entry, each followed by the entry's key and reply, padded to
+ * 8 bytes. The header has a checksum of the records, so a snapshot that was
+ * not completely written is not loaded. */
+struct snapshot_record {
+	int32_t type;
+	int32_t key_len;
+	int32_t reply_len;
+	int32_t close_socket;
+	int64_t expire_time;
+	int64_t refresh_interval;
+	int32_t refreshes;
+	int32_t unused;
+};
+
+struct snapshot;
+
+/* Start writing a snapshot to an empty file, with room for about size bytes
+ * of records to start with. */
+extern struct snapshot * snapshot_create(int fd, size_t size);
+
+/* Add a record to a snapshot being written. */
+extern int snapshot_add(struct snapshot * snapshot, const struct snapshot_record * record, const void * key, const void * reply);
+
+/* Finish writing a snapshot, and return how many bytes it took. The file
+ * descriptor is not closed or synced. */
+extern ssize_t snapshot_finish(struct snapshot * snapshot);
+
+/* Open a snapshot for reading, returning NULL if the file is not a complete
+ * snapshot. */
+extern struct snapshot * snapshot_open(int fd);
+
+/* Return the next record of a snapshot being read, and point to its key and
+ * reply, or return NULL when there are no more. */
+extern const struct snapshot_record * snapshot_next(struct snapshot * snapshot, const void ** key, const void ** reply);
+
+/* Finish reading a snapshot. The file descriptor is not closed. */
+extern void snapshot_close(struct snapshot * snapshot);
+
+#endif /* __SNAPSHOT_H */
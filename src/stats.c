@@ -16,22 +16,63 @@
 
 #include <unistd.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
 #include <errno.h>
 #include <sys/socket.h>
 #include <sys/types.h>
 #include <sys/un.h>
 
 #include "nscd.h"
+#include "misc.h"
+#include "cache.h"
+
+/* Append formatted text to a stats buffer, growing it as necessary. If we run
+ * out of memory, the rest of the stats are silently dropped. */
+void stats_printf(struct stats_buffer * stats, const char * format, ...)
+{
+	va_list ap;
+	int needed;
+	
+	for(;;)
+	{
+		size_t left = stats->size - stats->length;
+		char * data;
+		va_start(ap, format);
+		needed = vsnprintf(stats->data + stats->length, left, format, ap);
+		va_end(ap);
+		if(needed < 0)
+			return;
+		if(needed < left)
+			break;
+		left = stats->size ? stats->size * 2 : 1024;
+		while(left < stats->length + needed + 1)
+			left *= 2;
+		data = realloc(stats->data, left);
+		if(!data)
+			return;
+		stats->data = data;
+		stats->size = left;
+	}
+	stats->length += needed;
+}
 
 /* This function is run when a client connects and requests stats. */
 void send_stats(int client, uid_t uid)
 {
-	char * stats = "Compiled on " __DATE__ " at "__TIME__ "\n";
-	/* We don't have any stats to send, but that's OK. If we want to add
-	 * some in the future, put them here. Currently, we send a string, but
-	 * we could change it to be a structure of some sort that is interpreted
-	 * on the other side by get_stats() if necessary. */
-	write(client, stats, strlen(stats) + 1);
+	struct stats_buffer stats = {NULL, 0, 0};
+	/* We send a string, but we could change it to be a structure of some
+	 * sort that is interpreted on the other side by get_stats() if
+	 * necessary. Each part of gnscd adds its own stats here. */
+	stats_printf(&stats, "Compiled on " __DATE__ " at " __TIME__ "\n");
+	stats_printf(&stats, "\nThreads:\n");
+	thread_stats(&stats);
+	stats_printf(&stats, "\nCache:\n");
+	cache_stats(&stats);
+	if(stats.data)
+		write_all(client, stats.data, stats.length + 1, SHORT_TIMEOUT);
+	free(stats.data);
 }
 
 /* This function is run when gnscd is run with -g, and contacts the running
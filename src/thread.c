@@ -19,53 +19,29 @@
 #include <unistd.h>
 #include <fcntl.h>
 #include <errno.h>
+#include <string.h>
 #include <pthread.h>
+#include <signal.h>
 #include <sys/socket.h>
 #include <sys/poll.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
 #include <sys/un.h>
 #include <sys/uio.h>
+#include <sys/time.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <resolv.h>
 
 #include "nscd.h"
 #include "misc.h"
 #include "cache.h"
 #include "lookup.h"
-
-/* These timeouts are used when communicating with clients. They are given in
- * milliseconds. The long timeout is used between requests to close the
- * connection when it is idle (or before the first request), and the short
- * timeout is used during requests to wait for more data. */
-#define SHORT_TIMEOUT 200
-#define LONG_TIMEOUT 5000
-
-/* like read(), but times out if no data can be read */
-static ssize_t read_timeout(int fd, void * buf, size_t len, int timeout, int is_nonblock)
-{
-	ssize_t r;
-	struct pollfd pfd;
-	
-	if(is_nonblock)
-	{
-		r = read(fd, buf, len);
-		if(r > 0 || (r < 0 && errno != EAGAIN))
-			return r;
-	}
-	
-	pfd.fd = fd;
-	pfd.events = POLLIN;
-	r = poll(&pfd, 1, timeout);
-	if(r < 0)
-		return r;
-	if(!r)
-	{
-		errno = ETIMEDOUT;
-		return -1;
-	}
-	
-	return read(fd, buf, len);
-}
+#include "shared.h"
+#include "handoff.h"
 
 /* like write(), but keep retrying unless we fail for a timeout period */
-static ssize_t write_all(int fd, const void * buf, size_t len, int timeout)
+ssize_t write_all(int fd, const void * buf, size_t len, int timeout)
 {
 	size_t n = len;
 	ssize_t ret;
@@ -89,10 +65,15 @@ static ssize_t write_all(int fd, const void * buf, size_t len, int timeout)
 		n -= ret;
 	} while(n > 0);
 	if(debug && ret <= 0 && errno == EPIPE)
-		printf("Client %d closed connection on us! (wrote %d bytes)\n", fd, len - n);
+		printf("Client %d closed connection on us! (wrote %d bytes)\n", fd, (int) (len - n));
 	return (len == n) ? ret : len - n;
 }
 
+/* the listening sockets, which can be handed off to a new gnscd */
+static int * listen_socks = NULL;
+static int listen_count = 0;
+static void serve_stop(void);
+
 /* return 1 if the service is disabled, 0 otherwise */
 static int is_disabled(request_type type)
 {
@@ -100,65 +81,155 @@ static int is_disabled(request_type type)
 	{
 		case GETPWBYNAME:
 		case GETPWBYUID:
-			return 0;
 		case GETGRBYNAME:
 		case GETGRBYGID:
 		case INITGROUPS:
-			return 0;
 		case GETHOSTBYNAME:
 		case GETHOSTBYNAMEv6:
 		case GETHOSTBYADDR:
 		case GETHOSTBYADDRv6:
-			return 1;
+		case GETAI:
 		case GETPWENT:
 		case GETGRENT:
-			return 0;
-		case GETAI:
-			/* Note that getaddrinfo() support is not only disabled, but it is also
-			 * not implemented since Google doesn't use the host cache anyway. */
-			return 1;
+		case GETPWALL:
+		case GETGRALL:
+			return !enable_cache[request_database(type)];
 		default:
 			return -1;
 	}
 }
 
+/* Remove the cached entries a key of a database may have been looked up by. */
+static void invalidate_key(int db, char * key, int32_t key_len)
+{
+	request_header req = {version: NSCD_VERSION, key_len: key_len};
+	char * end;
+	struct in6_addr addr;
+	
+	switch(db)
+	{
+		case DB_PASSWD:
+			strtoul(key, &end, 10);
+			if(*key && !*end)
+			{
+				req.type = GETPWBYUID;
+				cache_remove(&req, key);
+				break;
+			}
+			req.type = GETPWBYNAME;
+			cache_remove(&req, key);
+			/* its primary group may have changed */
+			req.type = INITGROUPS;
+			cache_remove(&req, key);
+			break;
+		case DB_GROUP:
+			strtoul(key, &end, 10);
+			req.type = (*key && !*end) ? GETGRBYGID : GETGRBYNAME;
+			cache_remove(&req, key);
+			break;
+		case DB_HOSTS:
+			if(inet_pton(AF_INET, key, &addr) > 0)
+			{
+				req.type = GETHOSTBYADDR;
+				req.key_len = NS_INADDRSZ;
+				cache_remove(&req, &addr);
+				break;
+			}
+			if(inet_pton(AF_INET6, key, &addr) > 0)
+			{
+				req.type = GETHOSTBYADDRv6;
+				req.key_len = NS_IN6ADDRSZ;
+				cache_remove(&req, &addr);
+				break;
+			}
+			req.type = GETHOSTBYNAME;
+			cache_remove(&req, key);
+			req.type = GETHOSTBYNAMEv6;
+			cache_remove(&req, key);
+			req.type = GETAI;
+			cache_remove(&req, key);
+			break;
+	}
+}
+
+/* The key is the name of a database, optionally followed by a key in that
+ * database, each with its terminating null. Returns 0 or an error number. */
+static int32_t invalidate(uid_t uid, char * key, int32_t key_len)
+{
+	int db;
+	int32_t length;
+	
+	/* only root may invalidate the cache */
+	if(uid)
+		return EPERM;
+	if(key_len < 1 || key[key_len - 1])
+		return EINVAL;
+	for(db = 0; db < DB_COUNT; db++)
+	{
+		length = strlen(db_names[db]) + 1;
+		/* use memcmp not strcmp for security */
+		if(key_len >= length && !memcmp(key, db_names[db], length))
+			break;
+	}
+	if(db == DB_COUNT)
+		return EINVAL;
+	if(key_len == length)
+	{
+		if(debug)
+			printf("Invalidating %s\n", db_names[db]);
+		cache_invalidate(db);
+		/* pick up any changes to resolv.conf */
+		if(db == DB_HOSTS)
+			resolver_reload();
+		return 0;
+	}
+	if(debug)
+		printf("Invalidating [%s] in %s\n", &key[length], db_names[db]);
+	invalidate_key(db, &key[length], key_len - length);
+	return 0;
+}
+
 /* Return values:
  * Negative on error
  * 0 on success with a reusable socket
  * 1 on success with a non-reusable socket */
 static int process_request(int client, uid_t uid, request_header * req, void * key)
 {
-	struct cache_entry * entry;
 	void * reply;
 	int32_t reply_len;
 	time_t refresh_interval;
-	pthread_mutex_t * extra_mutex = NULL;
-	int r;
+	struct cache_flight * flight = NULL;
+	int r, close_socket;
 	
 	if(debug)
 		printf("Got request type %d (key = [%s]) from UID %d on FD %d\n", req->type, (char *) key, uid, client);
 	/* first check for control messages */
-	if(req->type > LASTDBREQ && req->type != GETPWENT && req->type != GETGRENT && req->type != GETAI && req->type != INITGROUPS)
+	if(req->type > LASTDBREQ && request_database(req->type) < 0)
 	{
 		if(req->type == SHUTDOWN)
+		{
+			/* come back up with a warm cache, unless another
+			 * gnscd has taken over and will save it */
+			if(snapshot_interval && !serve_handed_off())
+				cache_save(GNSCD_SNAPSHOT);
 			exit(0);
+		}
 		if(req->type == GETSTAT)
-		{
 			/* to aid the use of -g in figuring out whether
-			 * gnscd is answering queries correctly, grab
-			 * the cache mutex and release it to make sure
-			 * it's not stuck locked by some thread */
-			pthread_mutex_lock(&cache_mutex);
-			pthread_mutex_unlock(&cache_mutex);
+			 * gnscd is answering queries correctly, the
+			 * cache stats grab and release every cache lock
+			 * to make sure none is stuck locked */
 			send_stats(client, uid);
-		}
 		if(req->type == INVALIDATE)
 		{
-			/* key is "passwd" "group" or "hosts" */
-			/* use memcmp not strcmp for security */
-			/* if it's hosts, call res_init() */
-			/* NOT IMPLEMENTED */
+			int32_t result = invalidate(uid, key, req->key_len);
+			write_all(client, &result, sizeof(result), SHORT_TIMEOUT);
 		}
+		if(req->type == GETFDPW || req->type == GETFDGR || req->type == GETFDHST)
+			shared_send(client, req->type, key, req->key_len);
+		/* only root may take over from us */
+		if(handoff_request(req, key) && !uid && !handoff_send(client, listen_socks, listen_count))
+			serve_stop();
 		return 1;
 	}
 	
@@ -175,54 +246,64 @@ static int process_request(int client, uid_t uid, request_header * req, void * k
 		return r;
 	}
 	
-	/* if it is a GET*ENT query, grab the extra mutex */
-	if(req->type == GETPWENT)
-		extra_mutex = pwent_query_mutex;
-	else if(req->type == GETGRENT)
-		extra_mutex = grent_query_mutex;
-	if(extra_mutex)
-		pthread_mutex_lock(extra_mutex);
-	
-	pthread_mutex_lock(&cache_mutex);
-	r = cache_search(req, key, uid, &entry);
-	if(r < 0 && extra_mutex)
+	/* GET*ENT and GET*ALL queries are answered from a snapshot of the whole
+	 * database */
+	if(req->type == GETPWENT || req->type == GETGRENT || req->type == GETPWALL || req->type == GETGRALL)
 	{
-		if(debug)
-			printf("Not in the cache, requesting iteration.\n");
-		/* request it */
-		r = request_ent_cache(req, key, uid);
-		if(r >= 0)
-			r = cache_search(req, key, uid, &entry);
+		if(ent_reply(req, key, &reply, &reply_len) < 0)
+			return -1;
+		r = 0;
+		if(write_all(client, reply, reply_len, SHORT_TIMEOUT) != reply_len)
+			r = -1;
+		reply_release(reply);
+		return r;
 	}
+	
+	/* We get a reference to the reply so we can write it without holding
+	 * any cache lock. The entry may be refreshed or removed meanwhile, but
+	 * the reply we have will stay around until we release it. */
+	r = cache_search(req, key, uid, &reply, &reply_len, &close_socket);
 	if(r >= 0)
 	{
 		if(debug)
 			printf("Found it in the cache!\n");
-		r = entry->close_socket;
-		/* reset the refresh count */
-		entry->refreshes = 0;
-		if(write_all(client, entry->reply, entry->reply_len, SHORT_TIMEOUT) != entry->reply_len)
+		r = close_socket;
+		if(write_all(client, reply, reply_len, SHORT_TIMEOUT) != reply_len)
 			r = -1;
-		pthread_mutex_unlock(&cache_mutex);
-		if(extra_mutex)
-			pthread_mutex_unlock(extra_mutex);
+		reply_release(reply);
 		return r;
 	}
-	pthread_mutex_unlock(&cache_mutex);
 	
 	if(debug)
 		printf("Not in the cache.\n");
 	
-	if(!extra_mutex)
+	/* if another thread is already looking it up, use its reply */
+	r = cache_wait(req, key, uid, &reply, &reply_len, &close_socket, LONG_TIMEOUT, &flight);
+	if(r == 0)
+	{
+		r = close_socket;
+		if(write_all(client, reply, reply_len, SHORT_TIMEOUT) != reply_len)
+			r = -1;
+		reply_release(reply);
+		return r;
+	}
+	if(r > 0)
+	{
 		/* find it */
 		r = generate_reply(req, key, uid, &reply, &reply_len, &refresh_interval);
-	else
-		r = -1;
+		if(r < 0)
+			cache_finish(flight, req, key, uid, NULL, 0, 0, 0);
+	}
 	
 	if(r >= 0)
 	{
-		int close_socket = r;
-		int add_result = -1;
+		close_socket = r;
+		
+		/* let waiting threads have it before we write it */
+		reply_ref(reply);
+		if(cache_finish(flight, req, key, uid, reply, reply_len, close_socket, refresh_interval) < 0)
+			/* either it was already in the cache or adding it failed */
+			reply_release(reply);
 		
 		if(write_all(client, reply, reply_len, SHORT_TIMEOUT) != reply_len)
 		{
@@ -230,121 +311,612 @@ static int process_request(int client, uid_t uid, request_header * req, void * k
 				printf("Failed to write to client %d\n", client);
 			r = -1;
 		}
-		
-		pthread_mutex_lock(&cache_mutex);
-		/* don't add duplicate entries */
-		if(cache_search(req, key, uid, &entry) < 0)
-			add_result = cache_add(req, key, uid, reply, reply_len, close_socket, refresh_interval);
-		if(add_result < 0)
-			/* either it was already in the cache or adding it failed */
-			free(reply);
-		pthread_mutex_unlock(&cache_mutex);
+		reply_release(reply);
 	}
 	
-	/* if it was a GET*ENT query, release the extra mutex */
-	if(extra_mutex)
-		pthread_mutex_unlock(extra_mutex);
-	
 	return r;
 }
 
-/* Return values:
- * Negative on error
- * 0 on success with a reusable socket
- * 1 on success with a non-reusable socket */
-static int handle_request(int client, uid_t uid)
-{
+/* All client sockets are owned by a single event thread, which waits for them
+ * with epoll. Each connection is a small state machine: first the request
+ * header is read, then the key, and then the complete request is handed to a
+ * worker thread which sends the reply. Reads never block, so idle connections
+ * (e.g. from clients that keep their socket open between requests) only cost
+ * a struct client and not a whole thread. */
+enum client_state {
+	CLIENT_LISTEN,	/* a listening socket, not a client */
+	CLIENT_WAKE,	/* an eventfd to wake the event thread up */
+	CLIENT_HEADER,	/* reading the request header */
+	CLIENT_KEY,	/* reading the key */
+	CLIENT_BUSY	/* a worker thread owns it */
+};
+
+struct client {
+	int fd;
+	uid_t uid;
+	enum client_state state;
 	request_header req;
-	ssize_t got;
-	char buffer[NSCD_MAXKEYLEN];
+	/* with room to null terminate address keys for debugging output */
+	char key[NSCD_MAXKEYLEN + 1];
+	size_t got;
 	
-	/* read the request header, but time out after a short while */
-	got = read_timeout(client, &req, sizeof(req), LONG_TIMEOUT, 1);
+	/* when the client times out, in milliseconds */
+	uint64_t deadline;
+	/* when the client was queued for a worker thread */
+	struct timeval queued;
+	
+	/* idle list or worker queue linkage */
+	struct client * prev;
+	struct client * next;
+};
+
+/* An idle list holds clients waiting for data, in order of their deadlines.
+ * There are two: one for clients between requests (LONG_TIMEOUT), and one for
+ * clients in the middle of a request (SHORT_TIMEOUT). Since all clients on a
+ * list have the same timeout, appending keeps them sorted. */
+struct idle_list {
+	struct client * head;
+	struct client * tail;
+	int timeout;
+};
+
+static int epoll_fd = -1;
+static struct idle_list long_idle = {NULL, NULL, LONG_TIMEOUT};
+static struct idle_list short_idle = {NULL, NULL, SHORT_TIMEOUT};
+static int clients_open = 0;
+/* the idle lists are also used by worker threads, so they need a lock */
+static pthread_mutex_t idle_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/* the eventfd which wakes the event thread up */
+static struct client waker = {fd: -1, state: CLIENT_WAKE};
+/* set by the worker which hands our sockets off to another gnscd, and then by
+ * the event thread once it has stopped listening on them */
+static int handed_off = 0;
+static int draining = 0;
+
+static uint64_t now_ms(void)
+{
+	struct timeval now;
+	gettimeofday(&now, NULL);
+	return now.tv_sec * 1000ULL + now.tv_usec / 1000;
+}
+
+/* MUST BE CALLED WITH THE LOCK HELD */
+static void idle_append(struct idle_list * list, struct client * client)
+{
+	client->deadline = now_ms() + list->timeout;
+	client->next = NULL;
+	client->prev = list->tail;
+	if(list->tail)
+		list->tail->next = client;
+	else
+		list->head = client;
+	list->tail = client;
+}
+
+/* MUST BE CALLED WITH THE LOCK HELD */
+static void idle_remove(struct idle_list * list, struct client * client)
+{
+	if(client->prev)
+		client->prev->next = client->next;
+	else
+		list->head = client->next;
+	if(client->next)
+		client->next->prev = client->prev;
+	else
+		list->tail = client->prev;
+	client->prev = NULL;
+	client->next = NULL;
+}
+
+static struct idle_list * client_idle_list(struct client * client)
+{
+	/* a client which hasn't started a request yet gets the long timeout */
+	if(client->state == CLIENT_HEADER && !client->got)
+		return &long_idle;
+	return &short_idle;
+}
+
+static void client_close(struct client * client)
+{
 	if(debug)
+		printf("Closing client on FD %d\n", client->fd);
+	/* closing the socket also removes it from the epoll set */
+	close(client->fd);
+	free(client);
+	pthread_mutex_lock(&idle_mutex);
+	clients_open--;
+	pthread_mutex_unlock(&idle_mutex);
+	/* the event thread exits when the last client is gone */
+	if(__atomic_load_n(&draining, __ATOMIC_RELAXED))
 	{
-		if(got < 0)
-		{
-			if(errno == ETIMEDOUT)
-				printf("Client %d timed out\n", client);
-			else if(errno == ECONNRESET)
-				printf("Client %d closed by peer\n", client);
-			else
-				printf("Client %d error (%s)\n", client, strerror(errno));
-		}
-		else if(!got)
-			printf("Client %d completed\n", client);
+		uint64_t one = 1;
+		write(waker.fd, &one, sizeof(one));
 	}
-	if(got != sizeof(req) || req.version != NSCD_VERSION)
-		return -1;
-	
-	/* glibc nscd limits the key to 1024 bytes, so we will too */
-	if(req.key_len < 0 || req.key_len > NSCD_MAXKEYLEN)
-		return -1;
+}
+
+/* put the client back on an idle list, and wait for more data from it */
+static int client_wait(struct client * client)
+{
+	struct epoll_event event;
+	event.events = EPOLLIN | EPOLLONESHOT;
+	event.data.ptr = client;
 	
-	if(req.key_len)
+	pthread_mutex_lock(&idle_mutex);
+	idle_append(client_idle_list(client), client);
+	pthread_mutex_unlock(&idle_mutex);
+	/* the event thread may pick the client up before this even returns */
+	if(epoll_ctl(epoll_fd, EPOLL_CTL_MOD, client->fd, &event) < 0)
 	{
-		/* read the key, but again time out after a (shorter) while */
-		got = read_timeout(client, buffer, req.key_len, SHORT_TIMEOUT, 1);
-		if(got != req.key_len)
-			return -1;
-		/* the last character of the key should be null */
-		if(buffer[req.key_len - 1])
-			return -1;
+		pthread_mutex_lock(&idle_mutex);
+		idle_remove(client_idle_list(client), client);
+		pthread_mutex_unlock(&idle_mutex);
+		return -1;
 	}
-	else
-		buffer[0] = 0;
-	
-	return process_request(client, uid, &req, buffer);
+	return 0;
 }
 
-/* this code runs as a thread and handles a single client until it is done */
-static void * handle_client_thread(void * arg)
+/* handle a complete request, and return the client to the event thread */
+static void handle_client(struct client * client)
 {
-	int r, client = (int) arg;
-	uid_t uid = -1;
-	
-	if(fcntl(client, F_SETFL, fcntl(client, F_GETFL) | O_NONBLOCK) < 0)
+	int r = process_request(client->fd, client->uid, &client->req, client->key);
+	/* once we've handed off, clients should reconnect to the new gnscd */
+	if(r || __atomic_load_n(&draining, __ATOMIC_RELAXED))
 	{
-		close(client);
-		return NULL;
+		client_close(client);
+		return;
 	}
+	/* the socket is reusable, so wait for another request */
+	client->state = CLIENT_HEADER;
+	client->got = 0;
+	if(client_wait(client) < 0)
+		client_close(client);
+}
 
-#ifdef SO_PEERCRED
-	struct ucred caller;
-	socklen_t optlen = sizeof(caller);
-	if(getsockopt(client, SOL_SOCKET, SO_PEERCRED, &caller, &optlen) < 0)
+/* Return values:
+ * Negative on error or end of file
+ * 0 if more data is needed
+ * 1 if a complete request has been read */
+static int client_read(struct client * client)
+{
+	for(;;)
 	{
-		close(client);
-		return NULL;
+		void * buffer;
+		size_t want;
+		ssize_t got;
+		
+		if(client->state == CLIENT_HEADER)
+		{
+			buffer = (char *) &client->req + client->got;
+			want = sizeof(client->req) - client->got;
+		}
+		else
+		{
+			buffer = client->key + client->got;
+			want = client->req.key_len - client->got;
+		}
+		
+		got = read(client->fd, buffer, want);
+		if(got < 0 && errno == EINTR)
+			continue;
+		if(got < 0 && errno == EAGAIN)
+			return 0;
+		if(got <= 0)
+		{
+			if(debug)
+			{
+				if(!got)
+					printf("Client %d completed\n", client->fd);
+				else if(errno == ECONNRESET)
+					printf("Client %d closed by peer\n", client->fd);
+				else
+					printf("Client %d error (%s)\n", client->fd, strerror(errno));
+			}
+			return -1;
+		}
+		client->got += got;
+		if(got < want)
+			continue;
+		
+		if(client->state == CLIENT_HEADER)
+		{
+			if(client->req.version != NSCD_VERSION)
+				return -1;
+			/* glibc nscd limits the key to 1024 bytes, so we will too */
+			if(client->req.key_len < 0 || client->req.key_len > NSCD_MAXKEYLEN)
+				return -1;
+			client->state = CLIENT_KEY;
+			client->got = 0;
+			if(!client->req.key_len)
+			{
+				client->key[0] = 0;
+				return 1;
+			}
+		}
+		else
+		{
+			/* the last character of the key should be null, except
+			 * in addresses, which glibc sends as they are */
+			client->key[client->req.key_len] = 0;
+			if(client->req.type == GETHOSTBYADDR && client->req.key_len == NS_INADDRSZ)
+				return 1;
+			if(client->req.type == GETHOSTBYADDRv6 && client->req.key_len == NS_IN6ADDRSZ)
+				return 1;
+			if(client->key[client->req.key_len - 1])
+				return -1;
+			return 1;
+		}
 	}
-	uid = caller.uid;
+}
+
+static void client_accept(int sock)
+{
+	for(;;)
+	{
+		struct client * client;
+		struct epoll_event event;
+		int fd = accept(sock, NULL, NULL);
+		if(fd < 0)
+		{
+			if(errno == EINTR)
+				continue;
+			/* EAGAIN means we have accepted all of them */
+			return;
+		}
+		
+		client = malloc(sizeof(*client));
+		if(!client || fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK) < 0)
+		{
+			free(client);
+			close(fd);
+			continue;
+		}
+		client->fd = fd;
+		client->uid = -1;
+		client->state = CLIENT_HEADER;
+		client->got = 0;
+
+#ifdef SO_PEERCRED
+		struct ucred caller;
+		socklen_t optlen = sizeof(caller);
+		if(getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &caller, &optlen) < 0)
+		{
+			free(client);
+			close(fd);
+			continue;
+		}
+		client->uid = caller.uid;
 #else
 #warning Not using SO_PEERCRED
 #endif
-	
-	if(debug)
-		printf("New client on FD %d\n", client);
-	/* continue serving requests until handle_request returns nonzero */
-	do {
-		r = handle_request(client, uid);
-	} while(!r);
-	if(debug)
-		printf("Closing client on FD %d\n", client);
-	
-	close(client);
+
+		if(debug)
+			printf("New client on FD %d\n", fd);
+		event.events = EPOLLIN | EPOLLONESHOT;
+		event.data.ptr = client;
+		pthread_mutex_lock(&idle_mutex);
+		idle_append(&long_idle, client);
+		clients_open++;
+		pthread_mutex_unlock(&idle_mutex);
+		if(epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &event) < 0)
+		{
+			pthread_mutex_lock(&idle_mutex);
+			idle_remove(&long_idle, client);
+			pthread_mutex_unlock(&idle_mutex);
+			client_close(client);
+		}
+	}
+}
+
+/* close clients on this list whose deadlines have passed, and return the time
+ * in milliseconds until the next one will (or -1 if the list is empty) */
+static int idle_expire(struct idle_list * list, uint64_t now)
+{
+	int timeout = -1;
+	pthread_mutex_lock(&idle_mutex);
+	while(list->head)
+	{
+		struct client * client = list->head;
+		if(client->deadline > now)
+		{
+			timeout = client->deadline - now;
+			break;
+		}
+		if(debug)
+			printf("Client %d timed out\n", client->fd);
+		idle_remove(list, client);
+		pthread_mutex_unlock(&idle_mutex);
+		client_close(client);
+		pthread_mutex_lock(&idle_mutex);
+	}
+	pthread_mutex_unlock(&idle_mutex);
+	return timeout;
+}
+
+/* Accepted clients with complete requests are handed to a pool of worker
+ * threads through this queue. The pool starts with min_threads workers and
+ * grows up to max_threads when requests are waiting and no worker is idle.
+ * Workers beyond min_threads exit after they have been idle for IDLE_TIMEOUT
+ * seconds. If the queue is full, the client is simply closed. */
+#define QUEUE_SIZE 256
+#define IDLE_TIMEOUT 60
+
+static struct client * queue_head = NULL;
+static struct client * queue_tail = NULL;
+static int queue_count = 0;
+static int pool_threads = 0, pool_idle = 0;
+static pthread_mutex_t pool_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t pool_cond = PTHREAD_COND_INITIALIZER;
+
+/* pool statistics, also protected by pool_mutex */
+static unsigned long clients_queued = 0;
+static unsigned long clients_waited = 0;
+static unsigned long clients_rejected = 0;
+static int max_queue_count = 0;
+static int max_pool_threads = 0;
+static uint64_t queue_wait_usec = 0;
+static uint64_t max_queue_wait_usec = 0;
+
+static void * worker_thread(void * arg)
+{
+	pthread_mutex_lock(&pool_mutex);
+	for(;;)
+	{
+		struct client * next;
+		struct timeval now;
+		uint64_t wait;
+		
+		while(!queue_count)
+		{
+			struct timespec timeout;
+			int r;
+			
+			gettimeofday(&now, NULL);
+			timeout.tv_sec = now.tv_sec + IDLE_TIMEOUT;
+			timeout.tv_nsec = now.tv_usec * 1000;
+			pool_idle++;
+			r = pthread_cond_timedwait(&pool_cond, &pool_mutex, &timeout);
+			pool_idle--;
+			if(r == ETIMEDOUT && !queue_count && pool_threads > min_threads)
+			{
+				pool_threads--;
+				pthread_mutex_unlock(&pool_mutex);
+				if(debug)
+					printf("Idle worker thread exiting\n");
+				return NULL;
+			}
+		}
+		
+		next = queue_head;
+		queue_head = next->next;
+		if(!queue_head)
+			queue_tail = NULL;
+		queue_count--;
+		
+		gettimeofday(&now, NULL);
+		wait = (now.tv_sec - next->queued.tv_sec) * 1000000LL + now.tv_usec - next->queued.tv_usec;
+		queue_wait_usec += wait;
+		if(wait > max_queue_wait_usec)
+			max_queue_wait_usec = wait;
+		pthread_mutex_unlock(&pool_mutex);
+		
+		handle_client(next);
+		
+		pthread_mutex_lock(&pool_mutex);
+	}
 	return NULL;
 }
 
-/* start a new thread to handle this client until it is done */
-int dispatch_client(int client)
+/* MUST BE CALLED WITH THE LOCK HELD */
+static int start_worker(void)
 {
-	/* There is a possible performance improvement here: keep a pool of idle
-	 * threads around, so we don't have to create a new one for each client.
-	 * This is what the original nscd did, but it's much more complicated so
-	 * it is not done here. It's not clear how advantageous it would be. */
 	pthread_t thread;
-	if(pthread_create(&thread, NULL, handle_client_thread, (void *) client) < 0)
+	if(pthread_create(&thread, NULL, worker_thread, NULL))
 		return -1;
 	pthread_detach(thread);
+	if(++pool_threads > max_pool_threads)
+		max_pool_threads = pool_threads;
+	return 0;
+}
+
+/* queue this client for the next available worker thread */
+static int dispatch_client(struct client * client)
+{
+	pthread_mutex_lock(&pool_mutex);
+	if(queue_count == QUEUE_SIZE)
+	{
+		clients_rejected++;
+		pthread_mutex_unlock(&pool_mutex);
+		if(debug)
+			printf("Client queue full, dropping client on FD %d\n", client->fd);
+		return -1;
+	}
+	
+	client->state = CLIENT_BUSY;
+	gettimeofday(&client->queued, NULL);
+	client->next = NULL;
+	if(queue_tail)
+		queue_tail->next = client;
+	else
+		queue_head = client;
+	queue_tail = client;
+	if(++queue_count > max_queue_count)
+		max_queue_count = queue_count;
+	clients_queued++;
+	
+	if(queue_count > pool_idle)
+	{
+		clients_waited++;
+		/* if this fails, an existing worker will get to it eventually */
+		if(pool_threads < max_threads && start_worker() < 0 && debug)
+			printf("Failed to start a new worker thread\n");
+	}
+	pthread_cond_signal(&pool_cond);
+	pthread_mutex_unlock(&pool_mutex);
+	
 	return 0;
 }
+
+/* start the initial set of worker threads */
+int thread_init(void)
+{
+	int r = 0;
+	epoll_fd = epoll_create(256);
+	if(epoll_fd < 0)
+		return -1;
+	pthread_mutex_lock(&pool_mutex);
+	while(pool_threads < min_threads && r >= 0)
+		r = start_worker();
+	pthread_mutex_unlock(&pool_mutex);
+	return pool_threads ? 0 : -1;
+}
+
+/* Stop accepting new clients, after another gnscd has taken over the listening
+ * sockets. The event thread closes them itself, since it may still have events
+ * for them, and exits once the clients we have are done. */
+static void serve_stop(void)
+{
+	uint64_t one = 1;
+	if(debug)
+		printf("Handed off to a new gnscd, finishing up\n");
+	/* the sockets aren't ours to unlink any more */
+	signal(SIGINT, SIG_DFL);
+	signal(SIGTERM, SIG_DFL);
+	__atomic_store_n(&handed_off, 1, __ATOMIC_RELAXED);
+	write(waker.fd, &one, sizeof(one));
+}
+
+/* Close the listening sockets once serve_stop() has been called.
+ * MUST BE CALLED FROM THE EVENT THREAD */
+static void listen_close(void)
+{
+	int i;
+	for(i = 0; i < listen_count; i++)
+	{
+		epoll_ctl(epoll_fd, EPOLL_CTL_DEL, listen_socks[i], NULL);
+		close(listen_socks[i]);
+	}
+	__atomic_store_n(&draining, 1, __ATOMIC_RELAXED);
+}
+
+int serve_handed_off(void)
+{
+	return __atomic_load_n(&handed_off, __ATOMIC_RELAXED);
+}
+
+/* This is the event thread: it accepts new clients on the listening sockets,
+ * reads requests from them, and dispatches complete requests to the workers.
+ * It only returns, by exiting, after another gnscd has taken over. */
+void serve_clients(int * socks, int count)
+{
+	struct epoll_event events[64];
+	struct epoll_event event;
+	struct client * listeners;
+	int i;
+	
+	listeners = calloc(count, sizeof(*listeners));
+	if(!listeners)
+		exit(1);
+	listen_socks = socks;
+	listen_count = count;
+	waker.fd = eventfd(0, EFD_NONBLOCK);
+	event.events = EPOLLIN;
+	event.data.ptr = &waker;
+	if(waker.fd < 0 || epoll_ctl(epoll_fd, EPOLL_CTL_ADD, waker.fd, &event) < 0)
+		exit(1);
+	for(i = 0; i < count; i++)
+	{
+		listeners[i].fd = socks[i];
+		listeners[i].state = CLIENT_LISTEN;
+		event.events = EPOLLIN;
+		event.data.ptr = &listeners[i];
+		if(epoll_ctl(epoll_fd, EPOLL_CTL_ADD, socks[i], &event) < 0)
+			exit(1);
+	}
+	
+	for(;;)
+	{
+		uint64_t now = now_ms();
+		int timeout = idle_expire(&long_idle, now);
+		int short_timeout = idle_expire(&short_idle, now);
+		int ready;
+		
+		if(timeout < 0 || (short_timeout >= 0 && short_timeout < timeout))
+			timeout = short_timeout;
+		ready = epoll_wait(epoll_fd, events, sizeof(events) / sizeof(events[0]), timeout);
+		if(ready < 0)
+		{
+			if(errno == EINTR)
+				continue;
+			exit(1);
+		}
+		
+		for(i = 0; i < ready; i++)
+		{
+			struct client * client = events[i].data.ptr;
+			int r;
+			
+			if(client->state == CLIENT_LISTEN)
+			{
+				client_accept(client->fd);
+				continue;
+			}
+			if(client->state == CLIENT_WAKE)
+			{
+				uint64_t count;
+				read(waker.fd, &count, sizeof(count));
+				continue;
+			}
+			
+			pthread_mutex_lock(&idle_mutex);
+			idle_remove(client_idle_list(client), client);
+			pthread_mutex_unlock(&idle_mutex);
+			
+			r = client_read(client);
+			if(r == 0)
+				r = client_wait(client);
+			else if(r > 0)
+				r = dispatch_client(client);
+			if(r < 0)
+				client_close(client);
+		}
+		
+		/* after the events for them above, which were for sockets
+		 * that were still open */
+		if(!draining && __atomic_load_n(&handed_off, __ATOMIC_RELAXED))
+			listen_close();
+		if(__atomic_load_n(&draining, __ATOMIC_RELAXED))
+		{
+			pthread_mutex_lock(&idle_mutex);
+			i = clients_open;
+			pthread_mutex_unlock(&idle_mutex);
+			if(!i)
+			{
+				if(debug)
+					printf("All clients done, exiting\n");
+				exit(0);
+			}
+		}
+	}
+}
+
+void thread_stats(struct stats_buffer * stats)
+{
+	pthread_mutex_lock(&idle_mutex);
+	stats_printf(stats, "%15d  open client connections\n", clients_open);
+	pthread_mutex_unlock(&idle_mutex);
+	pthread_mutex_lock(&pool_mutex);
+	stats_printf(stats, "%15d  current number of threads\n", pool_threads);
+	stats_printf(stats, "%15d  number of idle threads\n", pool_idle);
+	stats_printf(stats, "%15d  minimum number of threads\n", min_threads);
+	stats_printf(stats, "%15d  maximum number of threads\n", max_threads);
+	stats_printf(stats, "%15d  most threads ever running\n", max_pool_threads);
+	stats_printf(stats, "%15d  requests currently queued\n", queue_count);
+	stats_printf(stats, "%15d  most requests ever queued\n", max_queue_count);
+	stats_printf(stats, "%15lu  requests queued\n", clients_queued);
+	stats_printf(stats, "%15lu  requests without an idle thread\n", clients_waited);
+	stats_printf(stats, "%15lu  requests dropped with a full queue\n", clients_rejected);
+	stats_printf(stats, "%15llu  average queue wait (usec)\n", clients_queued ? (unsigned long long) (queue_wait_usec / clients_queued) : 0ULL);
+	stats_printf(stats, "%15llu  longest queue wait (usec)\n", (unsigned long long) max_queue_wait_usec);
+	pthread_mutex_unlock(&pool_mutex);
+}
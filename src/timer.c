@@ -0,0 +1,164 @@
+/* This file is part of gnscd, a complete nscd replacement.
+ * Copyright (C) 2006 Google. Licensed under the GPL version 2. */
+
+/* gnscd is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; version 2 of the License.
+ * 
+ * gnscd is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ * 
+ * You can download the GNU General Public License from the GNU website
+ * at http://www.gnu.org/ or write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA. */
+
+#include <stdio.h>
+#include <pthread.h>
+#include <time.h>
+
+#include "misc.h"
+#include "timer.h"
+
+/* This is a hierarchical timing wheel. Each level has 64 slots, and each slot
+ * of a level covers 64 times as many seconds as a slot of the level below: a
+ * second, about a minute, and about 3 hours. A timer goes in the lowest level
+ * whose slots, starting from the wheel's current time, reach its expiration
+ * time. When the current time reaches the start of a higher level slot, the
+ * timers in it are moved down to the levels below. Timers further in the
+ * future than the top level can reach are parked in its last slot, and get
+ * put back in the right place when that slot comes around. */
+#define WHEEL_BITS 6
+#define WHEEL_SLOTS (1 << WHEEL_BITS)
+#define WHEEL_MASK (WHEEL_SLOTS - 1)
+#define WHEEL_LEVELS 3
+
+static struct timer * wheel[WHEEL_LEVELS][WHEEL_SLOTS];
+/* the time of the level 0 slot we are working on */
+static time_t wheel_time;
+static pthread_mutex_t wheel_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/* statistics, protected by wheel_mutex */
+static unsigned long timers_scheduled = 0;
+static unsigned long timers_expired = 0;
+static unsigned long timers_cascaded = 0;
+static time_t max_lag = 0;
+
+/* MUST BE CALLED WITH THE LOCK HELD */
+static void timer_link(struct timer * timer)
+{
+	time_t expire = timer->expire;
+	struct timer ** slot;
+	int level;
+	
+	if(expire < wheel_time)
+		expire = wheel_time;
+	for(level = 0; level < WHEEL_LEVELS - 1; level++)
+		if(expire - wheel_time < (time_t) 1 << (WHEEL_BITS * (level + 1)))
+			break;
+	if(expire - wheel_time >= (time_t) 1 << (WHEEL_BITS * WHEEL_LEVELS))
+		/* too far away, so park it in the last slot we can reach */
+		expire = wheel_time + ((time_t) 1 << (WHEEL_BITS * WHEEL_LEVELS)) - 1;
+	
+	slot = &wheel[level][(expire >> (WHEEL_BITS * level)) & WHEEL_MASK];
+	timer->next = *slot;
+	if(timer->next)
+		timer->next->point = &timer->next;
+	timer->point = slot;
+	*slot = timer;
+}
+
+/* MUST BE CALLED WITH THE LOCK HELD */
+static void timer_unlink(struct timer * timer)
+{
+	*timer->point = timer->next;
+	if(timer->next)
+		timer->next->point = timer->point;
+	timer->point = NULL;
+}
+
+void timer_init(time_t now)
+{
+	wheel_time = now;
+}
+
+void timer_schedule(struct timer * timer, time_t expire)
+{
+	pthread_mutex_lock(&wheel_mutex);
+	if(timer->point)
+		timer_unlink(timer);
+	timer->expire = expire;
+	timer_link(timer);
+	timers_scheduled++;
+	pthread_mutex_unlock(&wheel_mutex);
+}
+
+void timer_cancel(struct timer * timer)
+{
+	pthread_mutex_lock(&wheel_mutex);
+	if(timer->point)
+		timer_unlink(timer);
+	pthread_mutex_unlock(&wheel_mutex);
+}
+
+/* Move the timers in a higher level slot down to where they belong now.
+ * MUST BE CALLED WITH THE LOCK HELD */
+static void timer_cascade(int level)
+{
+	struct timer * timer = wheel[level][(wheel_time >> (WHEEL_BITS * level)) & WHEEL_MASK];
+	wheel[level][(wheel_time >> (WHEEL_BITS * level)) & WHEEL_MASK] = NULL;
+	while(timer)
+	{
+		struct timer * next = timer->next;
+		timer_link(timer);
+		timers_cascaded++;
+		timer = next;
+	}
+}
+
+struct timer * timer_expired(time_t now)
+{
+	struct timer * timer = NULL;
+	pthread_mutex_lock(&wheel_mutex);
+	if(now - wheel_time > max_lag)
+		max_lag = now - wheel_time;
+	while(wheel_time <= now)
+	{
+		timer = wheel[0][wheel_time & WHEEL_MASK];
+		if(timer)
+		{
+			timer_unlink(timer);
+			timers_expired++;
+			break;
+		}
+		/* this second is done, so move on to the next one */
+		wheel_time++;
+		if(!(wheel_time & WHEEL_MASK))
+		{
+			int level;
+			/* find the highest level whose slot starts now, and
+			 * cascade from there down */
+			for(level = 1; level < WHEEL_LEVELS - 1; level++)
+				if(wheel_time & (((time_t) 1 << (WHEEL_BITS * (level + 1))) - 1))
+					break;
+			for(; level > 0; level--)
+				timer_cascade(level);
+		}
+	}
+	pthread_mutex_unlock(&wheel_mutex);
+	return timer;
+}
+
+void timer_stats(struct stats_buffer * stats)
+{
+	time_t lag;
+	pthread_mutex_lock(&wheel_mutex);
+	stats_printf(stats, "%15lu  timers scheduled\n", timers_scheduled);
+	stats_printf(stats, "%15lu  timers expired\n", timers_expired);
+	stats_printf(stats, "%15lu  timers moved down the wheel\n", timers_cascaded);
+	lag = time(NULL) - wheel_time;
+	stats_printf(stats, "%15ld  seconds the wheel is behind\n", (long) (lag > 0 ? lag : 0));
+	stats_printf(stats, "%15ld  most seconds the wheel has been behind\n", (long) max_lag);
+	pthread_mutex_unlock(&wheel_mutex);
+}
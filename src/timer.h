@@ -0,0 +1,55 @@
+/* This file is part of gnscd, a complete nscd replacement.
+ * Copyright (C) 2006 Google. Licensed under the GPL version 2. */
+
+/* gnscd is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; version 2 of the License.
+ * 
+ * gnscd is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ * 
+ * You can download the GNU General Public License from the GNU website
+ * at http://www.gnu.org/ or write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA. */
+
+#ifndef __TIMER_H
+#define __TIMER_H
+
+#include <time.h>
+
+#include "misc.h"
+
+/* The timer wheel keeps track of when things need to be done, to the second,
+ * so that work is proportional to the number of timers that go off rather than
+ * to the number of timers. Timers are embedded in the structures they time,
+ * and have no callbacks: whoever runs the wheel asks it for the timers that
+ * have gone off and deals with them. The wheel has its own lock, so all these
+ * functions may be called with other locks held. */
+struct timer {
+	struct timer * next;
+	/* points to the link to this timer, or NULL when not scheduled */
+	struct timer ** point;
+	time_t expire;
+};
+
+/* Start the wheel at the given time. Must be called before any other timer
+ * function. */
+extern void timer_init(time_t now);
+
+/* Schedule a timer to go off at the given time, cancelling it first if it is
+ * already scheduled. Times in the past go off as soon as possible. */
+extern void timer_schedule(struct timer * timer, time_t expire);
+
+/* Cancel a timer, if it is scheduled. */
+extern void timer_cancel(struct timer * timer);
+
+/* Remove and return one timer which has gone off by the given time, or return
+ * NULL if there are none. */
+extern struct timer * timer_expired(time_t now);
+
+/* Add the timer statistics to a stats buffer. */
+extern void timer_stats(struct stats_buffer * stats);
+
+#endif /* __TIMER_H */
@@ -0,0 +1,139 @@
+/* This file is part of gnscd, a complete nscd replacement.
+ * Copyright (C) 2006 Google. Licensed under the GPL version 2. */
+
+/* gnscd is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; version 2 of the License.
+ * 
+ * gnscd is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ * 
+ * You can download the GNU General Public License from the GNU website
+ * at http://www.gnu.org/ or write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA. */
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/inotify.h>
+
+#include "nscd.h"
+#include "misc.h"
+#include "cache.h"
+#include "lookup.h"
+#include "watch.h"
+
+#define WATCH_DIR "/etc"
+
+/* Files are usually replaced by renaming a new copy over them, which would
+ * leave a watch on the file itself watching the old copy, so the directory is
+ * watched instead, for files which are written or moved into place. */
+#define WATCH_EVENTS (IN_CLOSE_WRITE | IN_MOVED_TO | IN_DELETE)
+
+/* -1 means every database */
+static const struct {
+	const char * name;
+	int db;
+} watched[] = {
+	{"passwd", DB_PASSWD},
+	{"group", DB_GROUP},
+	{"hosts", DB_HOSTS},
+	{"resolv.conf", DB_HOSTS},
+	{"nsswitch.conf", -1},
+	{NULL, 0}
+};
+
+static int watch_fd = -1;
+
+/* Return a bit for each database that a change to the file may affect. */
+static int watch_affects(const char * name)
+{
+	int i;
+	for(i = 0; watched[i].name; i++)
+		if(!strcmp(watched[i].name, name))
+			return (watched[i].db < 0) ? (1 << DB_COUNT) - 1 : 1 << watched[i].db;
+	return 0;
+}
+
+static void * watch_thread(void * arg)
+{
+	/* This code runs as a thread and waits for files to change. One read
+	 * gets all the events so far, so when a tool like useradd writes
+	 * several files at once, each database is only invalidated once. */
+	char buffer[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+	for(;;)
+	{
+		ssize_t length = read(watch_fd, buffer, sizeof(buffer));
+		ssize_t offset;
+		int dbs = 0, db;
+		
+		if(length <= 0)
+		{
+			if(length < 0 && errno == EINTR)
+				continue;
+			perror("inotify");
+			break;
+		}
+		for(offset = 0; offset < length; offset += sizeof(struct inotify_event) + ((struct inotify_event *) &buffer[offset])->len)
+		{
+			struct inotify_event * event = (struct inotify_event *) &buffer[offset];
+			/* events were lost, so any of the files may have changed */
+			if(event->mask & IN_Q_OVERFLOW)
+				dbs = (1 << DB_COUNT) - 1;
+			else if(event->len)
+				dbs |= watch_affects(event->name);
+		}
+		for(db = 0; db < DB_COUNT; db++)
+		{
+			if(!(dbs & (1 << db)) || !check_files[db])
+				continue;
+			if(debug)
+				printf("A file used by %s changed\n", db_names[db]);
+			cache_invalidate(db);
+			/* pick up any changes to resolv.conf */
+			if(db == DB_HOSTS)
+				resolver_reload();
+		}
+	}
+	close(watch_fd);
+	watch_fd = -1;
+	return NULL;
+}
+
+int watch_init(void)
+{
+	pthread_t thread;
+	int db;
+	
+	for(db = 0; db < DB_COUNT; db++)
+		if(check_files[db])
+			break;
+	if(db == DB_COUNT)
+		return 0;
+	
+	watch_fd = inotify_init();
+	if(watch_fd < 0)
+	{
+		perror("inotify_init()");
+		return -1;
+	}
+	if(inotify_add_watch(watch_fd, WATCH_DIR, WATCH_EVENTS) < 0)
+	{
+		perror(WATCH_DIR);
+		close(watch_fd);
+		watch_fd = -1;
+		return -1;
+	}
+	if(pthread_create(&thread, NULL, watch_thread, NULL))
+	{
+		close(watch_fd);
+		watch_fd = -1;
+		return -1;
+	}
+	pthread_detach(thread);
+	return 0;
+}
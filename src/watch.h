@@ -0,0 +1,28 @@
+/* This file is part of gnscd, a complete nscd replacement.
+ * Copyright (C) 2006 Google. Licensed under the GPL version 2. */
+
+/* gnscd is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; version 2 of the License.
+ * 
+ * gnscd is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ * 
+ * You can download the GNU General Public License from the GNU website
+ * at http://www.gnu.org/ or write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA. */
+
+#ifndef __WATCH_H
+#define __WATCH_H
+
+/* Local files which the name service reads are watched with inotify, so that
+ * when one of them changes, the databases it is used for are invalidated right
+ * away instead of being served until their entries expire. Only databases
+ * with check-files set are invalidated. */
+
+/* Start the thread which watches the files. */
+extern int watch_init(void);
+
+#endif /* __WATCH_H */
@@ -0,0 +1,195 @@
+/* This file is part of gnscd, a complete nscd replacement.
+ * Copyright (C) 2006 Google. Licensed under the GPL version 2. */
+
+/* gnscd is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; version 2 of the License.
+ * 
+ * gnscd is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ * 
+ * You can download the GNU General Public License from the GNU website
+ * at http://www.gnu.org/ or write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "../src/nscd.h"
+#include "../src/misc.h"
+#include "../src/cache.h"
+#include "keys.h"
+
+/* Measure how cache hits scale with the number of threads looking them up:
+ * the cache is filled with a passwd entry for each key, and then 1, 2, 4 ...
+ * threads search it for those keys as fast as they can. The most threads is
+ * the number of CPUs, or the number given on the command line. */
+
+#define KEYS 10000
+#define SECONDS 1
+
+int debug = 0;
+
+struct bench_thread {
+	pthread_t thread;
+	struct key_set * set;
+	int start;
+	unsigned long hits, misses;
+};
+
+static pthread_barrier_t barrier;
+static volatile int stop;
+
+/* a GETPWBYNAME reply for a made up user */
+static void * passwd_reply(const char * name, uid_t uid, int32_t * reply_len)
+{
+	static const char * fields[] = {"x", "", "/", "/bin/sh"};
+	pw_response_header header;
+	size_t offset;
+	void * reply;
+	int i;
+	
+	header.version = NSCD_VERSION;
+	header.found = 1;
+	header.pw_name_len = strlen(name) + 1;
+	header.pw_passwd_len = strlen(fields[0]) + 1;
+	header.pw_uid = uid;
+	header.pw_gid = uid;
+	header.pw_gecos_len = strlen(fields[1]) + 1;
+	header.pw_dir_len = strlen(fields[2]) + 1;
+	header.pw_shell_len = strlen(fields[3]) + 1;
+	*reply_len = sizeof(header) + header.pw_name_len + header.pw_passwd_len + header.pw_gecos_len + header.pw_dir_len + header.pw_shell_len;
+	reply = reply_alloc(*reply_len);
+	if(!reply)
+		return NULL;
+	memcpy(reply, &header, sizeof(header));
+	offset = sizeof(header);
+	strcpy(reply + offset, name);
+	offset += header.pw_name_len;
+	for(i = 0; i < 4; i++)
+	{
+		strcpy(reply + offset, fields[i]);
+		offset += strlen(fields[i]) + 1;
+	}
+	return reply;
+}
+
+static void * bench_thread(void * arg)
+{
+	struct bench_thread * bench = (struct bench_thread *) arg;
+	struct key_set * set = bench->set;
+	int i = bench->start;
+	
+	pthread_barrier_wait(&barrier);
+	while(!stop)
+	{
+		request_header req = {version: NSCD_VERSION, type: GETPWBYNAME, key_len: set->keys[i].key_len};
+		void * reply;
+		int32_t reply_len;
+		int close_socket;
+		if(!cache_search(&req, set->keys[i].key, 0, &reply, &reply_len, &close_socket))
+		{
+			reply_release(reply);
+			bench->hits++;
+		}
+		else
+			bench->misses++;
+		if(++i == set->count)
+			i = 0;
+	}
+	return NULL;
+}
+
+static double now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Return the hits per second of a number of threads, or -1. */
+static double run(struct key_set * set, int threads)
+{
+	struct bench_thread * bench = calloc(threads, sizeof(*bench));
+	unsigned long hits = 0, misses = 0;
+	double start;
+	int i;
+	
+	if(!bench)
+		return -1;
+	stop = 0;
+	pthread_barrier_init(&barrier, NULL, threads + 1);
+	for(i = 0; i < threads; i++)
+	{
+		bench[i].set = set;
+		bench[i].start = (long) set->count * i / threads;
+		if(pthread_create(&bench[i].thread, NULL, bench_thread, &bench[i]))
+			return -1;
+	}
+	pthread_barrier_wait(&barrier);
+	start = now();
+	sleep(SECONDS);
+	stop = 1;
+	for(i = 0; i < threads; i++)
+	{
+		pthread_join(bench[i].thread, NULL);
+		hits += bench[i].hits;
+		misses += bench[i].misses;
+	}
+	start = now() - start;
+	pthread_barrier_destroy(&barrier);
+	free(bench);
+	if(misses)
+		printf("%d threads: %lu misses\n", threads, misses);
+	return hits / start;
+}
+
+int main(int argc, char ** argv)
+{
+	struct key_set set;
+	int max_threads = (argc > 1) ? atoi(argv[1]) : sysconf(_SC_NPROCESSORS_ONLN);
+	double single = 0, rate;
+	int threads, db, i;
+	
+	/* nothing is saved, shared with clients or expired while we run */
+	snapshot_interval = 0;
+	for(db = 0; db < DB_COUNT; db++)
+		shared[db] = 0;
+	if(max_threads < 1)
+		max_threads = 1;
+	if(keys_load(&set, KEYS) < 0 || cache_init(-1) < 0)
+		return 1;
+	for(i = 0; i < set.count; i++)
+	{
+		request_header req = {version: NSCD_VERSION, type: GETPWBYNAME, key_len: set.keys[i].key_len};
+		int32_t reply_len;
+		void * reply = passwd_reply(set.keys[i].key, 100000 + i, &reply_len);
+		if(!reply)
+			return 1;
+		/* a key made up twice is only added once */
+		cache_add(&req, set.keys[i].key, 0, reply, reply_len, 0, 3600);
+	}
+	
+	for(threads = 1; ; threads *= 2)
+	{
+		if(threads > max_threads)
+			threads = max_threads;
+		rate = run(&set, threads);
+		if(rate < 0)
+			return 1;
+		if(threads == 1)
+			single = rate;
+		printf("cache_search: %3d threads %12.0f hits/s  %5.2fx\n", threads, rate, rate / single);
+		if(threads == max_threads)
+			break;
+	}
+	
+	keys_free(&set);
+	return 0;
+}
@@ -0,0 +1,248 @@
+/* This file is part of gnscd, a complete nscd replacement.
+ * Copyright (C) 2006 Google. Licensed under the GPL version 2. */
+
+/* gnscd is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; version 2 of the License.
+ * 
+ * gnscd is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ * 
+ * You can download the GNU General Public License from the GNU website
+ * at http://www.gnu.org/ or write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA. */
+
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <resolv.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <arpa/nameser.h>
+
+#include "../src/dns.h"
+
+/* Check the TTLs that host entries from DNS are kept for, by pointing the
+ * resolver at a stub server in this process which answers from the table
+ * below. Names which aren't in it don't exist. */
+
+int debug = 0;
+int dns_min_ttl = 30;
+int dns_max_ttl = 3600;
+
+#define SOA_TTL 600
+#define SOA_MINIMUM 45
+
+struct record {
+	const char * name;
+	int type;
+	long ttl;
+	const char * data;
+};
+
+static const struct record records[] = {
+	{"pos.test", ns_t_a, 300, "10.0.0.1"},
+	{"pos.test", ns_t_a, 200, "10.0.0.2"},
+	{"alias.test", ns_t_cname, 100, "pos.test"},
+	{"short.test", ns_t_a, 5, "10.0.0.3"},
+	{"long.test", ns_t_a, 86400, "10.0.0.4"},
+	{"long.test", ns_t_aaaa, 7200, "fd00::4"},
+	{"1.0.0.10.in-addr.arpa", ns_t_ptr, 250, "pos.test"},
+};
+
+#define RECORDS (sizeof(records) / sizeof(records[0]))
+
+static int put_name(unsigned char ** p, unsigned char * end, const char * name)
+{
+	int length = dn_comp(name, *p, end - *p, NULL, NULL);
+	if(length < 0)
+		return -1;
+	*p += length;
+	return 0;
+}
+
+static int put_record(unsigned char ** p, unsigned char * end, const struct record * record)
+{
+	unsigned char data[NS_MAXCDNAME];
+	int length;
+	
+	if(record->type == ns_t_a)
+		length = (inet_pton(AF_INET, record->data, data) == 1) ? NS_INADDRSZ : -1;
+	else if(record->type == ns_t_aaaa)
+		length = (inet_pton(AF_INET6, record->data, data) == 1) ? NS_IN6ADDRSZ : -1;
+	else
+		length = dn_comp(record->data, data, sizeof(data), NULL, NULL);
+	if(length < 0 || put_name(p, end, record->name) < 0 || end - *p < NS_RRFIXEDSZ + length)
+		return -1;
+	ns_put16(record->type, *p);
+	ns_put16(ns_c_in, *p + 2);
+	ns_put32(record->ttl, *p + 4);
+	ns_put16(length, *p + 8);
+	memcpy(*p + NS_RRFIXEDSZ, data, length);
+	*p += NS_RRFIXEDSZ + length;
+	return 0;
+}
+
+/* Build the answer to a query: the CNAME records from the name asked for, and
+ * the records of the type asked for at the end of them, or the SOA record of
+ * the zone if there are none. Return its length, or -1 to send nothing. */
+static int answer(const unsigned char * query, int length, unsigned char * response, int size)
+{
+	static const unsigned char soa_data[] = {
+		2, 'n', 's', 4, 't', 'e', 's', 't', 0,
+		4, 'r', 'o', 'o', 't', 4, 't', 'e', 's', 't', 0,
+		0, 0, 0, 1, 0, 0, 0x0e, 0x10, 0, 0, 0x02, 0x58, 0, 0, 0x0e, 0x10,
+		0, 0, 0, SOA_MINIMUM};
+	char name[NS_MAXDNAME];
+	unsigned char * end = response + size;
+	unsigned char * p;
+	int i, type, question, answers = 0, exists = 0;
+	
+	if(length < NS_HFIXEDSZ || ns_get16(query + 4) != 1)
+		return -1;
+	question = dn_expand(query, query + length, query + NS_HFIXEDSZ, name, sizeof(name));
+	if(question < 0 || length < NS_HFIXEDSZ + question + NS_QFIXEDSZ)
+		return -1;
+	type = ns_get16(query + NS_HFIXEDSZ + question);
+	question += NS_QFIXEDSZ;
+	memcpy(response, query, NS_HFIXEDSZ + question);
+	p = response + NS_HFIXEDSZ + question;
+	
+	for(i = 0; i < RECORDS; i++)
+	{
+		if(strcasecmp(records[i].name, name))
+			continue;
+		exists = 1;
+		if(records[i].type != type && records[i].type != ns_t_cname)
+			continue;
+		if(put_record(&p, end, &records[i]) < 0)
+			return -1;
+		answers++;
+		if(records[i].type == ns_t_cname)
+		{
+			strcpy(name, records[i].data);
+			i = -1;
+		}
+	}
+	/* QR, AA, RD, RA */
+	response[2] = 0x85;
+	response[3] = 0x80 | (exists ? ns_r_noerror : ns_r_nxdomain);
+	ns_put16(answers, response + 6);
+	ns_put16(0, response + 8);
+	ns_put16(0, response + 10);
+	if(!answers)
+	{
+		if(put_name(&p, end, "test") < 0 || end - p < NS_RRFIXEDSZ + sizeof(soa_data))
+			return -1;
+		ns_put16(ns_t_soa, p);
+		ns_put16(ns_c_in, p + 2);
+		ns_put32(SOA_TTL, p + 4);
+		ns_put16(sizeof(soa_data), p + 8);
+		memcpy(p + NS_RRFIXEDSZ, soa_data, sizeof(soa_data));
+		p += NS_RRFIXEDSZ + sizeof(soa_data);
+		ns_put16(1, response + 8);
+	}
+	return p - response;
+}
+
+static void * stub_server(void * arg)
+{
+	int fd = *(int *) arg;
+	unsigned char query[NS_PACKETSZ];
+	unsigned char response[NS_PACKETSZ];
+	struct sockaddr_in from;
+	socklen_t from_len;
+	int length;
+	
+	for(;;)
+	{
+		from_len = sizeof(from);
+		length = recvfrom(fd, query, sizeof(query), 0, (struct sockaddr *) &from, &from_len);
+		if(length < 0)
+			continue;
+		length = answer(query, length, response, sizeof(response));
+		if(length >= 0)
+			sendto(fd, response, length, 0, (struct sockaddr *) &from, from_len);
+	}
+	return NULL;
+}
+
+static int lookup(res_state state, request_type type, const void * key, int key_len, struct dns_host * host)
+{
+	request_header req = {version: NSCD_VERSION, type: type, key_len: key_len};
+	return dns_lookup(state, &req, key, host);
+}
+
+static int check(const char * what, int ok)
+{
+	printf("%s: %s\n", what, ok ? "ok" : "FAILED");
+	return !ok;
+}
+
+int main(void)
+{
+	struct sockaddr_in address;
+	socklen_t address_len = sizeof(address);
+	struct __res_state state;
+	struct dns_host host;
+	unsigned char ptr[NS_INADDRSZ] = {10, 0, 0, 1};
+	pthread_t thread;
+	int fd, failed = 0;
+	
+	fd = socket(AF_INET, SOCK_DGRAM, 0);
+	memset(&address, 0, sizeof(address));
+	address.sin_family = AF_INET;
+	address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	if(fd < 0 || bind(fd, (struct sockaddr *) &address, sizeof(address)) < 0 || getsockname(fd, (struct sockaddr *) &address, &address_len) < 0)
+	{
+		perror("stub server");
+		return 1;
+	}
+	if(pthread_create(&thread, NULL, stub_server, &fd))
+		return 1;
+	
+	memset(&state, 0, sizeof(state));
+	if(res_ninit(&state) < 0)
+		return 1;
+	state.nsaddr_list[0] = address;
+	state.nscount = 1;
+	state.retrans = 1;
+	state.retry = 2;
+	/* only the names in the table are asked for */
+	state.options &= ~(RES_DNSRCH | RES_DEFNAMES);
+	
+	failed |= check("positive answer", !lookup(&state, GETHOSTBYNAME, "pos.test", 9, &host)
+	                && host.error == NETDB_SUCCESS && host.addrs == 2 && host.ttl == 200
+	                && !strcmp(host.name, "pos.test") && !host.aliases);
+	failed |= check("positive TTL within the limits", host.error == NETDB_SUCCESS && dns_clamp(host.ttl) == 200);
+	failed |= check("CNAME TTL", !lookup(&state, GETHOSTBYNAME, "alias.test", 11, &host)
+	                && host.error == NETDB_SUCCESS && host.ttl == 100 && !strcmp(host.name, "pos.test")
+	                && host.aliases == 1 && !strcmp(host.alias[0], "alias.test"));
+	failed |= check("NXDOMAIN takes the SOA minimum", !lookup(&state, GETHOSTBYNAME, "nx.test", 8, &host)
+	                && host.error == HOST_NOT_FOUND && host.ttl == SOA_MINIMUM);
+	failed |= check("NODATA takes the SOA minimum", !lookup(&state, GETHOSTBYNAMEv6, "pos.test", 9, &host)
+	                && host.error == NO_DATA && host.ttl == SOA_MINIMUM);
+	failed |= check("short TTL raised to dns_min_ttl", !lookup(&state, GETHOSTBYNAME, "short.test", 11, &host)
+	                && host.ttl == 5 && dns_clamp(host.ttl) == dns_min_ttl);
+	failed |= check("long TTL lowered to dns_max_ttl", !lookup(&state, GETHOSTBYNAME, "long.test", 10, &host)
+	                && host.ttl == 86400 && dns_clamp(host.ttl) == dns_max_ttl);
+	failed |= check("GETAI takes the smaller TTL", !lookup(&state, GETAI, "long.test", 10, &host)
+	                && host.error == NETDB_SUCCESS && host.addrs == 2 && host.ttl == 7200);
+	failed |= check("GETAI with one family", !lookup(&state, GETAI, "pos.test", 9, &host)
+	                && host.error == NETDB_SUCCESS && host.addrs == 2 && host.ttl == 200);
+	failed |= check("GETAI NXDOMAIN", !lookup(&state, GETAI, "nx.test", 8, &host)
+	                && host.error == HOST_NOT_FOUND && host.ttl == SOA_MINIMUM);
+	failed |= check("PTR", !lookup(&state, GETHOSTBYADDR, ptr, sizeof(ptr), &host)
+	                && host.error == NETDB_SUCCESS && host.ttl == 250 && !strcmp(host.name, "pos.test")
+	                && host.addrs == 1 && !memcmp(host.address[0], ptr, sizeof(ptr)));
+	
+	res_nclose(&state);
+	printf("%s\n", failed ? "FAIL" : "PASS");
+	return failed;
+}
@@ -0,0 +1,68 @@
+/* This file is part of gnscd, a complete nscd replacement.
+ * Copyright (C) 2006 Google. Licensed under the GPL version 2. */
+
+/* gnscd is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; version 2 of the License.
+ * 
+ * gnscd is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ * 
+ * You can download the GNU General Public License from the GNU website
+ * at http://www.gnu.org/ or write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA. */
+
+#include <stdio.h>
+#include <time.h>
+
+#include "../src/hash.h"
+#include "keys.h"
+
+/* Time the cache hash against the Bernstein hash it replaced, over the same
+ * keys as hash_test. */
+
+#define KEYS 100000
+#define ROUNDS 50
+
+static uint32_t bernstein_hash(const uint8_t * key, int32_t key_len, uint32_t level)
+{
+	uint32_t hash = level;
+	while(key_len-- > 0)
+		hash = 33 * hash + *(key++);
+	return hash;
+}
+
+static double now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int main(void)
+{
+	struct key_set set;
+	volatile uint32_t sink = 0;
+	double start;
+	int round, i;
+	
+	if(keys_load(&set, KEYS) < 0)
+		return 1;
+	
+	start = now();
+	for(round = 0; round < ROUNDS; round++)
+		for(i = 0; i < set.count; i++)
+			sink += word_hash((uint8_t *) set.keys[i].key, set.keys[i].key_len, round);
+	printf("word_hash:      %6.2f ns/key\n", (now() - start) * 1e9 / ROUNDS / set.count);
+	
+	start = now();
+	for(round = 0; round < ROUNDS; round++)
+		for(i = 0; i < set.count; i++)
+			sink += bernstein_hash((uint8_t *) set.keys[i].key, set.keys[i].key_len, round);
+	printf("bernstein_hash: %6.2f ns/key\n", (now() - start) * 1e9 / ROUNDS / set.count);
+	
+	keys_free(&set);
+	return 0;
+}
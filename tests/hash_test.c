@@ -0,0 +1,118 @@
+/* This file is part of gnscd, a complete nscd replacement.
+ * Copyright (C) 2006 Google. Licensed under the GPL version 2. */
+
+/* gnscd is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; version 2 of the License.
+ * 
+ * gnscd is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ * 
+ * You can download the GNU General Public License from the GNU website
+ * at http://www.gnu.org/ or write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA. */
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../src/hash.h"
+#include "keys.h"
+
+/* Check that the cache hash spreads real and made up keys evenly over the
+ * buckets, and over the fingerprint bits, and that changing any bit of a key
+ * changes each bit of the hash half the time. */
+
+#define KEYS 100000
+#define SEED 0x0123456789abcdefULL
+
+/* Return how many standard deviations the chi-square statistic of putting the
+ * keys in buckets by the bits of the hash selected is from what it should be
+ * for a random hash. */
+static double chi_square(struct key_set * set, int count, int buckets, int shift)
+{
+	unsigned int * used = calloc(buckets, sizeof(*used));
+	double expected = (double) count / buckets, chi = 0;
+	int i;
+	if(!used)
+		return HUGE_VAL;
+	for(i = 0; i < count; i++)
+		used[(word_hash((uint8_t *) set->keys[i].key, set->keys[i].key_len, SEED) >> shift) % buckets]++;
+	for(i = 0; i < buckets; i++)
+		chi += (used[i] - expected) * (used[i] - expected) / expected;
+	free(used);
+	return (chi - (buckets - 1)) / sqrt(2.0 * (buckets - 1));
+}
+
+/* Return the largest difference from 1/2 of how often a bit of the hash
+ * changes when one bit of a key is flipped. */
+static double avalanche(struct key_set * set, int count)
+{
+	unsigned long flips[32] = {0}, trials = 0;
+	double worst = 0;
+	uint8_t key[64];
+	int i, bit, j;
+	for(i = 0; i < count; i++)
+	{
+		int32_t key_len = set->keys[i].key_len;
+		uint32_t hash;
+		if(key_len > sizeof(key))
+			continue;
+		memcpy(key, set->keys[i].key, key_len);
+		hash = word_hash(key, key_len, SEED);
+		for(bit = 0; bit < key_len * 8; bit++)
+		{
+			uint32_t changed;
+			key[bit / 8] ^= 1 << (bit % 8);
+			changed = hash ^ word_hash(key, key_len, SEED);
+			key[bit / 8] ^= 1 << (bit % 8);
+			for(j = 0; j < 32; j++)
+				flips[j] += (changed >> j) & 1;
+			trials++;
+		}
+	}
+	for(j = 0; j < 32; j++)
+		if(fabs((double) flips[j] / trials - 0.5) > worst)
+			worst = fabs((double) flips[j] / trials - 0.5);
+	return worst;
+}
+
+int main(void)
+{
+	struct key_set set;
+	int failed = 0, real;
+	double z, bias;
+	
+	if(keys_load(&set, 0) < 0)
+		return 1;
+	real = set.count;
+	keys_free(&set);
+	if(keys_load(&set, KEYS) < 0)
+		return 1;
+	
+	/* the low bits pick the shard and the slot */
+	z = chi_square(&set, set.count, 65536, 0);
+	printf("chi-square of %d keys over 65536 buckets: %+.2f sigma\n", set.count, z);
+	failed |= fabs(z) > 5;
+	/* the top 7 bits are the fingerprint */
+	z = chi_square(&set, set.count, 128, 25);
+	printf("chi-square of %d keys over 128 fingerprints: %+.2f sigma\n", set.count, z);
+	failed |= fabs(z) > 5;
+	if(real >= 64)
+	{
+		z = chi_square(&set, real, real / 8, 0);
+		printf("chi-square of %d local keys over %d buckets: %+.2f sigma\n", real, real / 8, z);
+		failed |= fabs(z) > 5;
+	}
+	
+	bias = avalanche(&set, 5000);
+	printf("avalanche: worst output bit flips %.4f away from half the time\n", bias);
+	failed |= bias > 0.01;
+	
+	keys_free(&set);
+	printf("%s\n", failed ? "FAIL" : "PASS");
+	return failed;
+}
@@ -0,0 +1,107 @@
+/* This file is part of gnscd, a complete nscd replacement.
+ * Copyright (C) 2006 Google. Licensed under the GPL version 2. */
+
+/* gnscd is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; version 2 of the License.
+ * 
+ * gnscd is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ * 
+ * You can download the GNU General Public License from the GNU website
+ * at http://www.gnu.org/ or write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA. */
+
+#include <pwd.h>
+#include <grp.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <netdb.h>
+
+#include "keys.h"
+
+static int keys_add(struct key_set * set, const char * key)
+{
+	if(set->count == set->size)
+	{
+		int size = set->size ? set->size * 2 : 1024;
+		void * keys = realloc(set->keys, size * sizeof(*set->keys));
+		if(!keys)
+			return -1;
+		set->keys = keys;
+		set->size = size;
+	}
+	set->keys[set->count].key = strdup(key);
+	if(!set->keys[set->count].key)
+		return -1;
+	set->keys[set->count++].key_len = strlen(key) + 1;
+	return 0;
+}
+
+int keys_load(struct key_set * set, int count)
+{
+	struct passwd * pwd;
+	struct group * grp;
+	struct hostent * hst;
+	char key[32];
+	int i;
+	
+	set->count = 0;
+	set->size = 0;
+	set->keys = NULL;
+	
+	setpwent();
+	while((pwd = getpwent()))
+	{
+		snprintf(key, sizeof(key), "%d", pwd->pw_uid);
+		if(keys_add(set, pwd->pw_name) < 0 || keys_add(set, key) < 0)
+			return -1;
+	}
+	endpwent();
+	setgrent();
+	while((grp = getgrent()))
+	{
+		snprintf(key, sizeof(key), "%d", grp->gr_gid);
+		if(keys_add(set, grp->gr_name) < 0 || keys_add(set, key) < 0)
+			return -1;
+	}
+	endgrent();
+	sethostent(0);
+	while((hst = gethostent()))
+	{
+		if(keys_add(set, hst->h_name) < 0)
+			return -1;
+		for(i = 0; hst->h_aliases[i]; i++)
+			if(keys_add(set, hst->h_aliases[i]) < 0)
+				return -1;
+	}
+	endhostent();
+	
+	for(i = 0; set->count < count; i++)
+	{
+		/* user names, ids in sequence, and GET*ENT indices */
+		if(i % 3 == 0)
+			snprintf(key, sizeof(key), "user%d", i / 3);
+		else if(i % 3 == 1)
+			snprintf(key, sizeof(key), "%d", 1000 + i / 3);
+		else
+			snprintf(key, sizeof(key), "-%d", i / 3);
+		if(keys_add(set, key) < 0)
+			return -1;
+	}
+	return 0;
+}
+
+void keys_free(struct key_set * set)
+{
+	int i;
+	for(i = 0; i < set->count; i++)
+		free(set->keys[i].key);
+	free(set->keys);
+	set->keys = NULL;
+	set->count = 0;
+	set->size = 0;
+}
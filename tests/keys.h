@@ -0,0 +1,38 @@
+/* This file is part of gnscd, a complete nscd replacement.
+ * Copyright (C) 2006 Google. Licensed under the GPL version 2. */
+
+/* gnscd is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; version 2 of the License.
+ * 
+ * gnscd is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ * 
+ * You can download the GNU General Public License from the GNU website
+ * at http://www.gnu.org/ or write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA. */
+
+
+#ifndef __KEYS_H
+#define __KEYS_H
+
+#include <stdint.h>
+
+/* A set of keys as clients send them, including the terminating null. */
+struct key_set {
+	int count, size;
+	struct {
+		char * key;
+		int32_t key_len;
+	} * keys;
+};
+
+/* Collect the names and ids of the users, groups and hosts on this system,
+ * and enough made up keys like them (user names, ids in sequence, and GET*ENT
+ * indices) to make count keys in all. */
+extern int keys_load(struct key_set * set, int count);
+extern void keys_free(struct key_set * set);
+
+#endif /* __KEYS_H */